@@ -44,17 +44,14 @@ function [img,header] = fitsread( filename, varargin )
     end
   end
 
-  if( ! isempty(hdu) && isempty(bitpix) )
-    [img,header] = read_fits_image( filename, hdu );
-  elseif( ! isempty(hdu) && ! isempty(bitpix) )
-    [img,header] = read_fits_image( filename, hdu, bitpix );
-  elseif( isempty(hdu) && ! isempty(bitpix) )
-    [img,header] = read_fits_image( filename, bitpix );
-  else
-    [img,header] = read_fits_image( filename );
+  args = {};
+  if( ! isempty(hdu) )
+    args{end+1} = hdu;
+  end
+  if( ! isempty(bitpix) )
+    args{end+1} = bitpix;
   end
 
-  dims = 1:ndims(img);
-  dims(1:2) = dims(2:-1:1);
-  img = permute( img, dims );
+  ## read_fits_image swaps the first two axes as it reads the image
+  [img,header] = read_fits_image( filename, args{:}, "transpose" );
 end
@@ -46,10 +46,16 @@ function fitswrite( img, filename, varargin )
     end
   end
 
+  if( ! isempty(header) )
+    warning( "fitswrite: HEADER is not written" );
+  end
+
+  args = {};
+  if( ! isempty(bitpix) )
+    args{end+1} = bitpix;
+  end
 
-  dims = 1:ndims(img);
-  dims(1:2) = dims(2:-1:1);
-  writebuf = permute( img, dims );
-  save_fits_image( filename, writebuf, bitpix, header );
+  ## save_fits_image swaps the first two axes as it writes the image
+  save_fits_image( filename, img, args{:}, "Transpose", true );
 end
 
@@ -38,7 +38,9 @@ fits.getNumHDUs = @fits_getNumHDUs;
 fits.movAbsHDU = @fits_movAbsHDU;
 fits.movRelHDU = @fits_movRelHDU;
 fits.writeChecksum = @fits_writeChecksum;
+fits.verifyChecksum = @fits_verifyChecksum;
 fits.deleteHDU = @fits_deleteHDU;
+fits.copyHDU = @fits_copyHDU;
 # keywords
 fits.readCard = @fits_readCard;
 fits.readKey = @fits_readKey;
@@ -48,6 +50,16 @@ fits.readKeyLongLong = @fits_readKeyLongLong;
 fits.readKeyUnit = @fits_readKeyUnit;
 fits.readRecord = @fits_readRecord;
 fits.getHdrSpace = @fits_getHdrSpace;
+# tables
+fits.readCol = @fits_readCol;
+# images
+fits.createImg = @fits_createImg;
+fits.readImg = @fits_readImg;
+fits.writeImg = @fits_writeImg;
+fits.readSubset = @fits_readSubset;
+fits.writeSubset = @fits_writeSubset;
+fits.readCutout = @fits_readCutout;
+fits.setTileCache = @fits_setTileCache;
 
 %!test
 %! import_fits;
@@ -1,32 +1,104 @@
 #include <iostream>
 #include <sstream>
 #include <ctype.h>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <octave/oct.h>
 #include <octave/version.h>
 #include <octave/file-info.h>
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 extern "C"
 {
 #include <fitsio.h>
 }
 
 #include "fits_constants.h"
+#include "fits_columns.h"
+#include "fits_threads.h"
+#include "fits_tile_cache.h"
+#include "fits_reader_pool.h"
 
-// class type to hold the file const
+// an open fits file, shared by all copies of the handle to it, and
+// closed when the last of them is cleared
 class
-octave_fits_file : public octave_base_value
+fits_file_data
 {
 public:
 
-  octave_fits_file ()
-    : fp (0) { }
+  fits_file_data ()
+    : fp (0), shm_created (false), membuf (0), memsize (0) { }
 
-  ~octave_fits_file (void)
+  ~fits_file_data (void)
   {
     if(fp != NULL)
       this->close();
   }
 
+  bool open (const std::string &name, int mode, bool concurrent = false); 
+  bool open_diskfile (const std::string &name, int mode); 
+  bool create (const std::string &name);
+
+  void deletefile (void);
+  void close (void);
+
+  // POSIX shared memory files, named shm://name
+  static bool is_shm_name (const std::string &name)
+  { return name.compare (0, 6, "shm://") == 0; }
+
+  fitsfile *fp;
+
+  // decompressed tiles of compressed images read from the file
+  fits_tile_cache tile_cache;
+
+  // handles for worker threads, if opened for concurrent reads
+  fits_reader_pool readers;
+
+private:
+
+  // the shared memory object of the file, if any.  A created file is
+  // built in membuf and copied to the object when closed; an opened one
+  // is the object mapped at membuf.
+  std::string shm_name;
+  bool shm_created;
+  void *membuf;
+  size_t memsize;
+
+  bool open_shm (const std::string &name, int mode);
+  bool create_shm (const std::string &name);
+  bool close_shm (bool publish);
+
+  // not copyable, the handles share it instead
+  fits_file_data (const fits_file_data &);
+  fits_file_data & operator = (const fits_file_data &);
+};
+
+// class type to hold the file const
+class
+octave_fits_file : public octave_base_value
+{
+public:
+
+  octave_fits_file ()
+    : file (new fits_file_data ()) { }
+
+  // a copy, such as made when the handle is stored in a struct or cell,
+  // refers to the same open file
+  octave_fits_file (const octave_fits_file &f)
+    : octave_base_value (), file (f.file) { }
+
   // Octave internal stuff
   bool is_constant (void) const { return true; }
   bool is_defined (void) const { return true; }
@@ -54,20 +126,25 @@ public:
   }
 
   // internal functions
-  bool open (const std::string &name, int mode); 
-  bool open_diskfile (const std::string &name, int mode); 
-  bool create (const std::string &name);
+  bool open (const std::string &name, int mode, bool concurrent = false)
+  { return file->open (name, mode, concurrent); }
+  bool open_diskfile (const std::string &name, int mode) { return file->open_diskfile (name, mode); }
+  bool create (const std::string &name) { return file->create (name); }
 
-  void deletefile (void);
-  void close (void);
+  // close or delete the file, for every handle to it
+  void deletefile (void) { file->deletefile (); }
+  void close (void) { file->close (); }
 
   // get the fits file ptr
-  fitsfile * get_fp() { return fp; };
-private:
-  fitsfile *fp;
+  fitsfile * get_fp() { return file->fp; };
+
+  // decompressed tiles of compressed images read from the file
+  fits_tile_cache & get_tile_cache() { return file->tile_cache; };
 
-  // needed by Octave for register_type()
-  octave_fits_file (const octave_fits_file &f);
+  // read only handles for worker threads
+  fits_reader_pool & get_readers() { return file->readers; };
+private:
+  std::shared_ptr<fits_file_data> file;
 
   DECLARE_OV_TYPEID_FUNCTIONS_AND_DATA
 };
@@ -76,23 +153,19 @@ DEFINE_OV_TYPEID_FUNCTIONS_AND_DATA (octave_fits_file, "fits_file", "fits_file")
 
 
 /*
- * get the fits file
- */
-octave_fits_file::octave_fits_file(const octave_fits_file &file)
-: fp(NULL)
-{
-  fprintf(stderr, "Called fits_file copy\n");
-}
-
-/*
- * attempt to open file
+ * attempt to open file.  If concurrent is set, the image reads of
+ * fits_readImg, fits_readSubset and fits_readCutout are split between
+ * handles of their own, kept while the file is open.
  */
 bool
-octave_fits_file::open (const std::string &name, int mode)
+fits_file_data::open (const std::string &name, int mode, bool concurrent)
 {
   int status = 0;
   fitsfile *fp;
 
+  if (is_shm_name (name))
+    return open_shm (name, mode);
+
   if ( fits_open_file( &fp, name.c_str(), mode, &status) > 0 )
     {
       fits_report_error( stderr, status );
@@ -100,6 +173,12 @@ octave_fits_file::open (const std::string &name, int mode)
     }
 
   this->fp = fp;
+
+  // only a plain file can be opened again by name
+  char filename[FLEN_FILENAME];
+  if (concurrent && fits_file_name (fp, filename, &status) <= 0
+      && strchr (filename, '[') == NULL && strncmp (filename, "mem:", 4) != 0)
+    readers.set_file (filename);
   
   return true;
 }
@@ -108,7 +187,7 @@ octave_fits_file::open (const std::string &name, int mode)
  * open disk file
  */
 bool
-octave_fits_file::open_diskfile (const std::string &name, int mode)
+fits_file_data::open_diskfile (const std::string &name, int mode)
 {
   int status = 0;
   fitsfile *fp;
@@ -128,11 +207,14 @@ octave_fits_file::open_diskfile (const std::string &name, int mode)
  * create a file
  */
 bool
-octave_fits_file::create (const std::string &name)
+fits_file_data::create (const std::string &name)
 {
   int status = 0;
   fitsfile *fp;
 
+  if (is_shm_name (name))
+    return create_shm (name);
+
   if ( fits_create_file( &fp, name.c_str(), &status) > 0 )
     {
       fits_report_error( stderr, status );
@@ -148,7 +230,7 @@ octave_fits_file::create (const std::string &name)
  * close fits file
  */
 void
-octave_fits_file::close (void)
+fits_file_data::close (void)
 {
   int status = 0;
 
@@ -158,19 +240,28 @@ octave_fits_file::close (void)
     return;
   }
 
+  readers.close ();
+
+  if (! shm_name.empty ())
+    {
+      close_shm (true);
+      return;
+    }
+
   if ( fits_close_file(this->fp, &status ) > 0 )
     {
       fits_report_error( stderr, status );
     }
 
   this->fp = 0;
+  tile_cache.clear ();
 }
 
 /*
  * close and delete file 
  */
 void
-octave_fits_file::deletefile (void)
+fits_file_data::deletefile (void)
 {
   int status=0;
 
@@ -180,12 +271,207 @@ octave_fits_file::deletefile (void)
     return;
   }
 
+  readers.close ();
+
+  if (! shm_name.empty ())
+    {
+#ifdef HAVE_SYS_MMAN_H
+      std::string object = shm_name;
+      bool created = shm_created;
+      close_shm (false);
+      if (! created)
+        shm_unlink (object.c_str ());
+#endif
+      return;
+    }
+
   if ( fits_delete_file(this->fp, &status ) > 0 )
     {
       fits_report_error( stderr, status );
     }
 
   this->fp = 0;
+  tile_cache.clear ();
+}
+
+/*
+ * open a shared memory object in place, as a memory file
+ */
+bool
+fits_file_data::open_shm (const std::string &name, int mode)
+{
+#ifdef HAVE_SYS_MMAN_H
+  std::string object = "/" + name.substr (6);
+  int fd = shm_open (object.c_str (), mode == READWRITE ? O_RDWR : O_RDONLY, 0);
+  if (fd < 0)
+    {
+      fprintf (stderr, "Could not open shared memory %s\n", object.c_str ());
+      return false;
+    }
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+    map = mmap (NULL, st.st_size, mode == READWRITE ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED, fd, 0);
+  ::close (fd);
+
+  if (map == MAP_FAILED)
+    {
+      fprintf (stderr, "Could not map shared memory %s\n", object.c_str ());
+      return false;
+    }
+
+  membuf = map;
+  memsize = st.st_size;
+  shm_name = object;
+  shm_created = false;
+
+  // the object can not grow, as no realloc function is given
+  int status = 0;
+  fitsfile *fp;
+  if (fits_open_memfile (&fp, name.c_str (), mode, &membuf, &memsize, 0, NULL, &status) > 0)
+    {
+      fits_report_error( stderr, status );
+      munmap (membuf, memsize);
+      shm_name = "";
+      membuf = 0;
+      return false;
+    }
+
+  this->fp = fp;
+  return true;
+#else
+  fprintf (stderr, "Shared memory files are not supported\n");
+  return false;
+#endif
+}
+
+/*
+ * create a memory file, to copy to a shared memory object when closed
+ */
+bool
+fits_file_data::create_shm (const std::string &name)
+{
+#ifdef HAVE_SYS_MMAN_H
+  int status = 0;
+  fitsfile *fp;
+
+  membuf = 0;
+  memsize = 0;
+  if (fits_create_memfile (&fp, &membuf, &memsize, 0, realloc, &status) > 0)
+    {
+      fits_report_error( stderr, status );
+      return false;
+    }
+
+  this->fp = fp;
+  shm_name = "/" + name.substr (6);
+  shm_created = true;
+  return true;
+#else
+  fprintf (stderr, "Shared memory files are not supported\n");
+  return false;
+#endif
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * create the new shared memory object name holding the size bytes of data
+ */
+static bool
+write_shm_object (const std::string &name, const void *data, size_t size)
+{
+  int fd = shm_open (name.c_str (), O_RDWR | O_CREAT | O_EXCL, 0666);
+  if (fd < 0)
+    return false;
+
+  void *map = MAP_FAILED;
+  bool ok = (ftruncate (fd, size) == 0);
+  if (ok && size > 0)
+    {
+      map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      ok = (map != MAP_FAILED);
+    }
+  if (ok && size > 0)
+    {
+      memcpy (map, data, size);
+      munmap (map, size);
+    }
+  ::close (fd);
+
+  if (! ok)
+    shm_unlink (name.c_str ());
+
+  return ok;
+}
+#endif
+
+/*
+ * close a shared memory file.  A created file is copied to its shared
+ * memory object if publish is set, replacing any object of that name.
+ * The old object is never written to, so processes that have it mapped
+ * keep its contents: the new one is filled under a temporary name and
+ * renamed over it where shared memory objects are files (/dev/shm), else
+ * the old name is unlinked before the new object is made.
+ */
+bool
+fits_file_data::close_shm (bool publish)
+{
+  bool ok = true;
+#ifdef HAVE_SYS_MMAN_H
+  int status = 0;
+  LONGLONG filesize = 0;
+
+  if (shm_created && publish)
+    {
+      // the file ends with the data of the last HDU
+      int nhdus = 0, hdutype;
+      LONGLONG headstart, datastart;
+      fits_flush_file (fp, &status);
+      fits_get_num_hdus (fp, &nhdus, &status);
+      if (nhdus > 0)
+        {
+          fits_movabs_hdu (fp, nhdus, &hdutype, &status);
+          fits_get_hduaddrll (fp, &headstart, &datastart, &filesize, &status);
+        }
+    }
+
+  int cstatus = 0;
+  if (fits_close_file (fp, &cstatus) > 0)
+    fits_report_error( stderr, cstatus );
+
+  if (shm_created)
+    {
+      if (publish && status <= 0 && cstatus <= 0)
+        {
+          std::ostringstream tmp;
+          tmp << shm_name << ".tmp" << getpid ();
+          ok = write_shm_object (tmp.str (), membuf, filesize);
+          if (ok && rename (("/dev/shm" + tmp.str ()).c_str (),
+                            ("/dev/shm" + shm_name).c_str ()) != 0)
+            {
+              shm_unlink (tmp.str ().c_str ());
+              shm_unlink (shm_name.c_str ());
+              ok = write_shm_object (shm_name, membuf, filesize);
+            }
+          if (! ok)
+            fprintf (stderr, "Could not write shared memory %s\n", shm_name.c_str ());
+        }
+      free (membuf);
+    }
+  else if (membuf)
+    munmap (membuf, memsize);
+#endif
+
+  fp = 0;
+  membuf = 0;
+  memsize = 0;
+  shm_name = "";
+  shm_created = false;
+  tile_cache.clear ();
+
+  return ok;
 }
 
 /*
@@ -212,6 +498,11 @@ Attempt to create  a file of the gien input name.\n \
 If the filename starts with ! and the file exists, it will create a new file, otherwise, if the\n \
 file exists, the create will fail.\n \
 \n \
+A filename of the form shm://name creates a POSIX shared memory object /name, that another\n \
+process can open with fits_openFile.  The file is built in memory, and copied to the\n \
+shared memory object, replacing any of that name, when it is closed; processes that have the\n \
+old object open keep its contents.\n \
+\n \
 This is the equivilent of the cfitsio fits_create_file funtion.\n \
 @seealso {fits_openFile}\n \
 @end deftypefn")
@@ -250,6 +541,18 @@ Attempt to open a a file of the given input name.\n \
 \n \
 If the opion mode string 'READONLY' (default) or 'READWRITE' is provided, open the file using that mode.\n \
 \n \
+The mode 'CONCURRENT' opens the file read only, for the images of large reads to be read on several\n \
+threads: fits_readImg and fits_readSubset split the pixels read between the threads, and\n \
+fits_readCutout decodes tiles of compressed images on them.  Each of the threads reads through a\n \
+handle of its own, opened the first time it is needed and kept until the file is closed, so the\n \
+threads can read different parts of the file without waiting for one another, and later reads do\n \
+not reopen the file.  Other functions, such as those reading keywords or table columns, read\n \
+through the one handle as in 'READONLY' mode.\n \
+\n \
+A filename of the form shm://name opens the POSIX shared memory object /name, as written by\n \
+fits_createFile, in place without copying it.  In READWRITE mode it can be changed but not grown.\n \
+fits_deleteFile removes the object.\n \
+\n \
 This is the equivilent of the cfitsio fits_open_file funtion.\n \
 @seealso {fits_openDiskFile, fits_createFile}\n \
 @end deftypefn")
@@ -266,6 +569,7 @@ This is the equivilent of the cfitsio fits_open_file funtion.\n \
     }
 
   int mode = READONLY;
+  bool concurrent = false;
 
   if(args.length() == 2)
     {
@@ -281,6 +585,8 @@ This is the equivilent of the cfitsio fits_open_file funtion.\n \
         mode = READWRITE;
       else if(modestr == "readonly")
         mode = READONLY;
+      else if(modestr == "concurrent")
+        concurrent = true;
       else
         {
           error( "fits_openFile:: unknown file mode" );
@@ -294,7 +600,7 @@ This is the equivilent of the cfitsio fits_open_file funtion.\n \
 
   octave_fits_file *fitsfile = new octave_fits_file ();
   
-  if (! fitsfile->open (infile, mode))
+  if (! fitsfile->open (infile, mode, concurrent))
     {
       error ("fits_openFile: error opening fits file '%s'", infile.c_str());
       delete fitsfile;
@@ -479,6 +785,10 @@ DEFUN_DLD(fits_closeFile, args, nargout,
 @deftypefn {Function File} {} fits_closeFile(@var{file})\n \
 Close the opened fits file\n \
 \n \
+Copies of @var{file}, such as stored in a struct or cell or passed to a function, refer to\n \
+the same open file, so closing any of them closes it for all.  A file not closed this way is\n \
+closed once the last copy of its handle is cleared.\n \
+\n \
 The is the eqivalent of the fits_close_file function.\n \
 @end deftypefn")
 {
@@ -889,6 +1199,10 @@ This is the equivalent of the cfitsio fits_delete_hdu function.\n \
       return octave_value ();
     }
 
+  // the HDUs after it are renumbered, so cached tiles may now be keyed by
+  // the number of another HDU
+  file->get_tile_cache ().clear ();
+
   std::string name = "";
   if(hdutype == IMAGE_HDU) 
     name = "IMAGE_HDU";
@@ -902,6 +1216,59 @@ This is the equivalent of the cfitsio fits_delete_hdu function.\n \
   return octave_value(name);
 }
 
+// PKG_ADD: autoload ("fits_copyHDU", "__fits__.oct");
+DEFUN_DLD(fits_copyHDU, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {} fits_copyHDU(@var{src}, @var{dst})\n \
+Copy the current HDU of file @var{src} to file @var{dst}\n \
+\n \
+The HDU is appended to @var{dst}, or written as its primary HDU if @var{dst} is empty, and becomes\n \
+its current HDU.  The header is copied card by card and the data unit as raw blocks, so no pixel\n \
+or table value is decoded.  A primary HDU copied after other HDUs is made an IMAGE extension.\n \
+\n \
+This is the equivalent of the cfitsio fits_copy_hdu function.\n \
+@seealso {fits_concat, fits_movAbsHDU}\n \
+@end deftypefn")
+{
+  if ( args.length() != 2)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  init_types ();
+
+  if ( args (0).type_id () != octave_fits_file::static_type_id ()
+       || args (1).type_id () != octave_fits_file::static_type_id ())
+    {
+      print_usage ();
+      return octave_value ();  
+    }
+
+  octave_fits_file * src = &((octave_fits_file &)args (0).get_rep ());
+  octave_fits_file * dst = &((octave_fits_file &)args (1).get_rep ());
+
+  fitsfile *infp = src->get_fp();
+  fitsfile *outfp = dst->get_fp();
+
+  if(!infp || !outfp)
+    {
+      error("fits_copyHDU: file not open");
+      return octave_value ();
+    }
+
+  int status = 0;
+
+  if(fits_copy_hdu(infp, outfp, 0, &status) > 0)
+    {
+      fits_report_error ( stderr, status );
+      error ("fits_copyHDU: couldnt copy hdu");
+      return octave_value ();
+    }
+
+  return octave_value ();
+}
+
 // PKG_ADD: autoload ("fits_writeChecksum", "__fits__.oct");
 DEFUN_DLD(fits_writeChecksum, args, nargout,
 "-*- texinfo -*-\n \
@@ -1429,84 +1796,2037 @@ This is the equivalent of the cfitsio fits_read_key_lnglng function.\n \
   return ret;
 }
 
-// PKG_ADD: autoload ("fits_getConstantValue", "__fits__.oct");
-DEFUN_DLD(fits_getConstantValue, args, nargout,
-"-*- texinfo -*-\n \
-@deftypefn {Function File} {[@var{value}]} = fits_getConstantValue(@var{name})\n \
-Return the value of a known fits constant.\n \
-@seealso {fits_getConstantNames}\n \
-@end deftypefn")
+/*
+ * turn a repeat x nrows array, as read row after row, into nrows x repeat
+ */
+template <typename AT>
+static AT
+rows_first (const AT &a, LONGLONG nrows, LONGLONG repeat)
 {
-  if ( args.length() == 0)
-    {
-      print_usage ();
-      return octave_value();
-    }
+  if (repeat == 1)
+    return AT (a.reshape (dim_vector (nrows, 1)));
 
-  if (args.length () != 1  || !args(0).is_string() )
-    {
-      error( "fits_getConstantName: constant name should be a string" );
-      return octave_value();
-    }
+  return AT (a.transpose ());
+}
 
-  std::string name = args(0).string_value();
-  std::transform (name.begin(), name.end(), name.begin(), ::toupper);
-  octave_value value;
-  for (int i=i;i<sizeof(fits_constants)/sizeof(fits_constants_type);i++)
+// number of elements read per call when null flags are returned
+static const LONGLONG null_block_elems = 1 << 16;
+
+/*
+ * read nrows x repeat values of a fixed width column.  If nan is set,
+ * nulls of floating point columns are returned as NaN.  If nullmask is
+ * not NULL, it is set to flag the null values, which are returned as
+ * NaN (or 0 for integer types).
+ */
+template <typename AT>
+static octave_value
+read_col_values (fitsfile *fp, int datatype, int colnum, LONGLONG firstrow,
+                 LONGLONG nrows, LONGLONG repeat, bool nan,
+                 octave_value *nullmask, int &status)
+{
+  typedef typename AT::element_type T;
+
+  // cfitsio returns the elements of a row one after another, so read
+  // into a repeat x nrows array and transpose to the nrows x repeat result
+  AT data (dim_vector (repeat, nrows));
+  T *out = data.fortran_vec ();
+  T nanval = T (std::numeric_limits<double>::quiet_NaN ());
+  int anynul = 0;
+
+  if (nullmask)
     {
-      if(name == fits_constants[i].name)
+      boolNDArray mask (dim_vector (repeat, nrows));
+      char *nulls = reinterpret_cast<char *> (mask.fortran_vec ());
+      LONGLONG block = std::max<LONGLONG> (1, null_block_elems / std::max<LONGLONG> (1, repeat));
+
+      // read a block of rows at a time, so the values that cfitsio
+      // leaves undefined for nulls are set while still in cache
+      for (LONGLONG r = 0; r < nrows && repeat > 0 && status <= 0; r += block)
         {
-          value = fits_constants[i].value;
-	  break;
+          LONGLONG n = std::min (block, nrows - r) * repeat;
+          T *o = out + r*repeat;
+          char *m = nulls + r*repeat;
+
+          anynul = 0;
+          if (fits_read_colnull (fp, datatype, colnum, firstrow + r, 1, n, o, m,
+                                 &anynul, &status) > 0)
+            break;
+
+          if (anynul)
+            for (LONGLONG i = 0; i < n; i++)
+              if (m[i])
+                o[i] = nanval;
         }
+
+      *nullmask = octave_value (rows_first (mask, nrows, repeat));
     }
-  if (value.isempty ())
+  else if (nrows > 0 && repeat > 0)
     {
-      error ("fits_getConstantValue: Couldnt find constant");
+      bool use_nan = nan && std::numeric_limits<T>::has_quiet_NaN;
+      fits_read_col (fp, datatype, colnum, firstrow, 1, nrows*repeat,
+                     use_nan ? &nanval : NULL, out, &anynul, &status);
     }
-  return value;
+
+  return octave_value (rows_first (data, nrows, repeat));
 }
 
-// PKG_ADD: autoload ("fits_getConstantNames", "__fits__.oct");
-DEFUN_DLD(fits_getConstantNames, args, nargout,
-"-*- texinfo -*-\n \
-@deftypefn {Function File} {[@var{namelist}]} = fits_getConstantNames()\n \
-Return the names of all known fits constants\n \
-@seealso {fits_getConstantValue}\n \
-@end deftypefn")
+/*
+ * read a variable length array column, either into a cell with one
+ * row vector per table row, or as a single flat column of values with
+ * the 1 based start index of each row in offsets (numrows+1 entries)
+ */
+template <typename AT>
+static octave_value
+read_var_col_values (fitsfile *fp, int datatype, int colnum, LONGLONG firstrow,
+                     LONGLONG nrows, bool flat, bool nan, octave_value &offsets,
+                     int &status)
 {
-  if ( args.length() != 0)
+  typedef typename AT::element_type T;
+
+  T nanval = T (std::numeric_limits<double>::quiet_NaN ());
+  T *nulval = (nan && std::numeric_limits<T>::has_quiet_NaN) ? &nanval : NULL;
+  std::vector<LONGLONG> lengths (nrows), heapaddr (nrows);
+
+  // get all descriptors with a single call
+  if (nrows > 0)
+    fits_read_descriptsll (fp, colnum, firstrow, nrows, lengths.data (),
+                           heapaddr.data (), &status);
+  if (status > 0)
+    return octave_value ();
+
+  // visit the rows in heap order, so that the heap is read from front
+  // to back instead of seeking back and forth for each row
+  std::vector<LONGLONG> order (nrows);
+  for (LONGLONG i = 0; i < nrows; i++)
+    order[i] = i;
+  std::stable_sort (order.begin (), order.end (),
+                    [&heapaddr] (LONGLONG a, LONGLONG b)
+                    { return heapaddr[a] < heapaddr[b]; });
+
+  int anynul = 0;
+
+  if (flat)
     {
-      print_usage ();
-      return octave_value();
-    }
+      NDArray starts (dim_vector (nrows+1, 1));
+      LONGLONG total = 0;
+      for (LONGLONG i = 0; i < nrows; i++)
+        {
+          starts(i) = total + 1;
+          total += lengths[i];
+        }
+      starts(nrows) = total + 1;
 
-  int cnt = sizeof(fits_constants)/sizeof(fits_constants_type);
+      // one allocation for the values of all rows
+      AT values (dim_vector (total, 1));
+      for (LONGLONG k = 0; k < nrows && status <= 0; k++)
+        {
+          LONGLONG row = order[k];
+          if (lengths[row] > 0)
+            fits_read_col (fp, datatype, colnum, firstrow + row, 1, lengths[row],
+                           nulval, values.fortran_vec () + LONGLONG (starts(row)) - 1,
+                           &anynul, &status);
+          if ((k & 0xfff) == 0)
+            octave_quit ();
+        }
 
-  Cell namelist(1, cnt);
+      offsets = octave_value (starts);
+      return octave_value (values);
+    }
 
-  for(int i=i; i<sizeof(fits_constants)/sizeof(fits_constants_type); i++)
+  Cell cells (nrows, 1);
+  for (LONGLONG k = 0; k < nrows && status <= 0; k++)
     {
-      namelist(0,i) = octave_value (fits_constants[i].name);
+      LONGLONG row = order[k];
+      AT values (dim_vector (1, lengths[row]));
+      if (lengths[row] > 0)
+        fits_read_col (fp, datatype, colnum, firstrow + row, 1, lengths[row],
+                       nulval, values.fortran_vec (), &anynul, &status);
+      cells(row) = octave_value (values);
+      if ((k & 0xfff) == 0)
+        octave_quit ();
     }
 
-  return octave_value (namelist);
+  return octave_value (cells);
 }
 
-// PKG_ADD: autoload ("fits_getVersion", "__fits__.oct");
-DEFUN_DLD(fits_getVersion, args, nargout,
-"-*- texinfo -*-\n \
-@deftypefn {Function File} {[@var{ver}]} = fits_getVersion()\n \
-Return the version number fo the cfitsio library used.\n \
-\n \
-This is the equivalent of the cfitsio fits_get_version function.\n \
-@end deftypefn")
+/*
+ * byte offset and size of a binary table column within a row
+ */
+static int
+get_bin_col_layout (fitsfile *fp, int colnum, LONGLONG &offset,
+                    LONGLONG &nbytes, int &status)
 {
-  if ( args.length() != 0)
-    {
-      print_usage ();
-      return octave_value();
-    }
+  char keyname[FLEN_KEYWORD];
+  char tform[FLEN_VALUE];
+
+  offset = 0;
+  nbytes = 0;
+
+  for (int i = 1; i <= colnum && status <= 0; i++)
+    {
+      int datacode;
+      LONGLONG repeat;
+      long width;
+
+      offset += nbytes;
+
+      fits_make_keyn ("TFORM", i, keyname, &status);
+      fits_read_key (fp, TSTRING, keyname, tform, NULL, &status);
+      if (fits_binary_tformll (tform, &datacode, &repeat, &width, &status) > 0)
+        break;
+
+      // same sizes as cfitsio uses to lay out the row
+      if (datacode == TBIT)
+        nbytes = (repeat + 7) / 8;
+      else if (datacode == TSTRING)
+        nbytes = repeat;
+      else if (datacode > 0)
+        nbytes = width * repeat;
+      else
+        nbytes = strchr (tform, 'Q') ? 16 : 8;
+    }
+
+  return status;
+}
+
+/*
+ * byte offset and width of an ascii table column within a row
+ */
+static int
+get_ascii_col_layout (fitsfile *fp, int colnum, LONGLONG &offset,
+                      LONGLONG &nbytes, int &status)
+{
+  char keyname[FLEN_KEYWORD];
+  char tform[FLEN_VALUE];
+  long tbcol;
+  int datacode, decimals;
+  long width;
+
+  fits_make_keyn ("TBCOL", colnum, keyname, &status);
+  fits_read_key_lng (fp, keyname, &tbcol, NULL, &status);
+  fits_make_keyn ("TFORM", colnum, keyname, &status);
+  fits_read_key (fp, TSTRING, keyname, tform, NULL, &status);
+  if (fits_ascii_tform (tform, &datacode, &width, &decimals, &status) > 0)
+    return status;
+
+  offset = tbcol - 1;
+  nbytes = width;
+
+  return status;
+}
+
+/*
+ * byte offset and size of a column within a row of the current table
+ */
+static int
+get_col_layout (fitsfile *fp, int colnum, LONGLONG &offset,
+                LONGLONG &nbytes, int &status)
+{
+  int hdutype;
+
+  if (fits_get_hdu_type (fp, &hdutype, &status) > 0)
+    return status;
+
+  if (hdutype == ASCII_TBL)
+    return get_ascii_col_layout (fp, colnum, offset, nbytes, status);
+
+  return get_bin_col_layout (fp, colnum, offset, nbytes, status);
+}
+
+// size of the blocks of raw rows read by read_row_blocks
+static const LONGLONG row_block_bytes = 1 << 20;
+
+/*
+ * read nrows raw table rows a block of about blockbytes at a time,
+ * passing each block to decode (rows, index of first row of the block,
+ * rows in block)
+ */
+template <typename F>
+static int
+read_row_blocks (fitsfile *fp, LONGLONG firstrow, LONGLONG nrows,
+                 LONGLONG rowlen, int &status, F decode,
+                 LONGLONG blockbytes = row_block_bytes)
+{
+  LONGLONG block = std::max<LONGLONG> (1, blockbytes / rowlen);
+  std::vector<unsigned char> buf (std::min (block, nrows) * rowlen);
+
+  for (LONGLONG r = 0; r < nrows && status <= 0; r += block)
+    {
+      LONGLONG n = std::min (block, nrows - r);
+
+      if (fits_read_tblbytes (fp, firstrow + r, 1, n*rowlen, buf.data (),
+                              &status) > 0)
+        break;
+
+      decode (buf.data (), r, n);
+
+      octave_quit ();
+    }
+
+  return status;
+}
+
+/*
+ * read a fixed width logical (L) or bit (X) column as a nrows x repeat
+ * logical array, unpacking the raw row bytes rather than converting
+ * element by element in cfitsio.  If nullmask is not NULL, it is set to
+ * flag the null logical values.
+ */
+static octave_value
+read_bool_col (fitsfile *fp, int colnum, int typecode, LONGLONG repeat,
+               LONGLONG firstrow, LONGLONG nrows, octave_value *nullmask,
+               int &status)
+{
+  LONGLONG rowlen, offset, nbytes;
+
+  fits_read_key_lnglng (fp, "NAXIS1", &rowlen, NULL, &status);
+  if (get_bin_col_layout (fp, colnum, offset, nbytes, status) > 0)
+    return octave_value ();
+
+  boolNDArray data (dim_vector (nrows, repeat));
+  bool *out = data.fortran_vec ();
+
+  // bit columns have no nulls
+  boolNDArray mask;
+  bool *nulls = NULL;
+  if (nullmask)
+    {
+      mask = boolNDArray (dim_vector (nrows, repeat), false);
+      if (typecode != TBIT)
+        nulls = mask.fortran_vec ();
+    }
+
+  read_row_blocks (fp, firstrow, nrows, rowlen, status,
+                   [&] (const unsigned char *rows, LONGLONG r0, LONGLONG n)
+                   {
+                     if (typecode == TBIT)
+                       fits_unpack_bits (rows + offset, rowlen, n, repeat,
+                                         out + r0, nrows);
+                     else
+                       fits_unpack_logicals (rows + offset, rowlen, n, repeat,
+                                             out + r0, nrows,
+                                             nulls ? nulls + r0 : NULL);
+                   });
+
+  if (nullmask)
+    *nullmask = octave_value (mask);
+
+  return octave_value (data);
+}
+
+/*
+ * read a character column of an ascii or binary table into one
+ * numrows x width char matrix, copying from the raw row bytes.  If trim
+ * is set, the trailing columns that are blank in every row are dropped.
+ */
+static octave_value
+read_char_col (fitsfile *fp, int colnum, LONGLONG firstrow, LONGLONG nrows,
+               bool trim, int &status)
+{
+  LONGLONG rowlen, offset, width;
+
+  fits_read_key_lnglng (fp, "NAXIS1", &rowlen, NULL, &status);
+  if (get_col_layout (fp, colnum, offset, width, status) > 0)
+    return octave_value ();
+
+  charNDArray data (dim_vector (nrows, width));
+  char *out = data.fortran_vec ();
+  LONGLONG maxlen = 0;
+
+  read_row_blocks (fp, firstrow, nrows, rowlen, status,
+                   [&] (const unsigned char *rows, LONGLONG r0, LONGLONG n)
+                   {
+                     LONGLONG len = fits_copy_chars (rows + offset, rowlen, n,
+                                                     width, out + r0, nrows);
+                     maxlen = std::max (maxlen, len);
+                   });
+
+  if (trim && maxlen < width)
+    data.resize (dim_vector (nrows, maxlen));
+
+  return octave_value (data, '\'');
+}
+
+/*
+ * read a variable length character column into a numrows x maxlength
+ * blank padded char matrix, reading the heap in ascending offset order
+ */
+static octave_value
+read_var_char_col (fitsfile *fp, int colnum, LONGLONG firstrow,
+                   LONGLONG nrows, bool trim, int &status)
+{
+  std::vector<LONGLONG> lengths (nrows), heapaddr (nrows);
+
+  if (nrows > 0)
+    fits_read_descriptsll (fp, colnum, firstrow, nrows, lengths.data (),
+                           heapaddr.data (), &status);
+  if (status > 0)
+    return octave_value ();
+
+  LONGLONG width = 0;
+  std::vector<LONGLONG> order (nrows);
+  for (LONGLONG i = 0; i < nrows; i++)
+    {
+      order[i] = i;
+      width = std::max (width, lengths[i]);
+    }
+  std::stable_sort (order.begin (), order.end (),
+                    [&heapaddr] (LONGLONG a, LONGLONG b)
+                    { return heapaddr[a] < heapaddr[b]; });
+
+  charNDArray data (dim_vector (nrows, width), ' ');
+  char *out = data.fortran_vec ();
+  std::vector<char> buf (width + 1);
+  char *bufp = buf.data ();
+  LONGLONG maxlen = 0;
+  int anynul = 0;
+
+  for (LONGLONG k = 0; k < nrows && status <= 0; k++)
+    {
+      LONGLONG row = order[k];
+      if (lengths[row] == 0)
+        continue;
+
+      buf[0] = '\0';
+      if (fits_read_col (fp, TSTRING, colnum, firstrow + row, 1, 1, NULL,
+                         &bufp, &anynul, &status) > 0)
+        break;
+
+      LONGLONG len = fits_copy_chars (reinterpret_cast<unsigned char *> (bufp),
+                                      width + 1, 1, lengths[row], out + row,
+                                      nrows);
+      maxlen = std::max (maxlen, len);
+
+      if ((k & 0xfff) == 0)
+        octave_quit ();
+    }
+
+  if (trim && maxlen < width)
+    data.resize (dim_vector (nrows, maxlen));
+
+  return octave_value (data, '\'');
+}
+
+/*
+ * read a numeric column of an ascii table.  Blocks of raw rows are
+ * parsed by fits_parse_ascii_field, split over worker threads, rather
+ * than field by field in cfitsio.  If a field can not be parsed, or its
+ * value does not fit in the type of the column, the column is read by
+ * cfitsio as datatype instead, which reads or reports it in its own way.
+ * If nullmask is not NULL, it is set to flag the null fields.
+ */
+template <typename AT>
+static octave_value
+read_ascii_values (fitsfile *fp, int datatype, int colnum, LONGLONG firstrow,
+                   LONGLONG nrows, octave_value *nullmask, int &status)
+{
+  typedef typename AT::element_type T;
+
+  char keyname[FLEN_KEYWORD];
+  char tform[FLEN_VALUE];
+  char tnull[FLEN_VALUE];
+  LONGLONG rowlen, offset, width;
+  double scale = 1.0, zero = 0.0;
+  int datacode, decimals;
+  long fw;
+
+  fits_read_key_lnglng (fp, "NAXIS1", &rowlen, NULL, &status);
+  if (get_ascii_col_layout (fp, colnum, offset, width, status) > 0)
+    return octave_value ();
+
+  fits_make_keyn ("TFORM", colnum, keyname, &status);
+  fits_read_key (fp, TSTRING, keyname, tform, NULL, &status);
+  fits_ascii_tform (tform, &datacode, &fw, &decimals, &status);
+
+  fits_make_keyn ("TSCAL", colnum, keyname, &status);
+  if (fits_read_key (fp, TDOUBLE, keyname, &scale, NULL, &status) == KEY_NO_EXIST)
+    status = 0;
+  fits_make_keyn ("TZERO", colnum, keyname, &status);
+  if (fits_read_key (fp, TDOUBLE, keyname, &zero, NULL, &status) == KEY_NO_EXIST)
+    status = 0;
+  fits_make_keyn ("TNULL", colnum, keyname, &status);
+  if (fits_read_key (fp, TSTRING, keyname, tnull, NULL, &status) == KEY_NO_EXIST)
+    {
+      status = 0;
+      tnull[0] = '\0';
+    }
+
+  if (status > 0)
+    return octave_value ();
+
+  std::string null = tnull;
+  null.erase (0, null.find_first_not_of (' '));
+  null.erase (null.find_last_not_of (' ') + 1);
+
+  char type = toupper (tform[0]);
+  T nullval = T (std::numeric_limits<double>::quiet_NaN ());
+
+  AT data (dim_vector (nrows, 1));
+  T *out = data.fortran_vec ();
+
+  boolNDArray mask;
+  bool *nulls = NULL;
+  if (nullmask)
+    {
+      mask = boolNDArray (dim_vector (nrows, 1));
+      nulls = mask.fortran_vec ();
+    }
+
+  int nthreads = fits_num_threads ();
+  std::mutex lock;
+  LONGLONG badrow = -1;
+
+  read_row_blocks (fp, firstrow, nrows, rowlen, status,
+                   [&] (const unsigned char *rows, LONGLONG r0, LONGLONG n)
+                   {
+                     fits_parallel_for (n, nthreads,
+                       [&] (size_t b, size_t e)
+                       {
+                         size_t bad = fits_parse_ascii_field (rows + b*rowlen + offset,
+                                                              rowlen, e - b, width,
+                                                              type, decimals,
+                                                              scale, zero, null,
+                                                              nullval, out + r0 + b,
+                                                              nulls ? nulls + r0 + b : NULL);
+                         if (bad < e - b)
+                           {
+                             std::lock_guard<std::mutex> guard (lock);
+                             LONGLONG row = r0 + b + bad;
+                             if (badrow < 0 || row < badrow)
+                               badrow = row;
+                           }
+                       });
+
+                     if (badrow >= 0)
+                       status = BAD_C2D;
+                   },
+                   row_block_bytes * nthreads);
+
+  if (badrow >= 0)
+    {
+      status = 0;
+      return read_col_values<AT> (fp, datatype, colnum, firstrow, nrows, 1,
+                                  true, nullmask, status);
+    }
+
+  if (nullmask)
+    *nullmask = octave_value (mask);
+
+  return octave_value (data);
+}
+
+/*
+ * read a numeric ascii table column in the type cfitsio reports for it
+ */
+static octave_value
+read_ascii_col (fitsfile *fp, int colnum, int typecode, LONGLONG firstrow,
+                LONGLONG nrows, octave_value *nullmask, int &status)
+{
+  switch (typecode)
+    {
+      case TSHORT:
+        return read_ascii_values<int16NDArray> (fp, TSHORT, colnum, firstrow, nrows, nullmask, status);
+      case TINT:
+      case TLONG:
+        return read_ascii_values<int32NDArray> (fp, TINT, colnum, firstrow, nrows, nullmask, status);
+      case TLONGLONG:
+        return read_ascii_values<int64NDArray> (fp, TLONGLONG, colnum, firstrow, nrows, nullmask, status);
+      case TFLOAT:
+        return read_ascii_values<FloatNDArray> (fp, TFLOAT, colnum, firstrow, nrows, nullmask, status);
+      case TDOUBLE:
+        return read_ascii_values<NDArray> (fp, TDOUBLE, colnum, firstrow, nrows, nullmask, status);
+      default:
+        status = BAD_DATATYPE;
+    }
+
+  return octave_value ();
+}
+
+/*
+ * read a numeric column in its native type
+ */
+static octave_value
+read_col (fitsfile *fp, int colnum, int typecode, LONGLONG repeat,
+          LONGLONG firstrow, LONGLONG nrows, bool flat, bool nan,
+          octave_value &offsets, octave_value *nullmask, int &status)
+{
+  bool var = (typecode < 0);
+
+#define READ_COL(AT, DATATYPE) \
+  (var ? read_var_col_values<AT> (fp, DATATYPE, colnum, firstrow, nrows, flat, nan, offsets, status) \
+       : read_col_values<AT> (fp, DATATYPE, colnum, firstrow, nrows, repeat, nan, nullmask, status))
+
+  switch (std::abs (typecode))
+    {
+      case TBYTE:
+        return READ_COL (uint8NDArray, TBYTE);
+      case TSBYTE:
+        return READ_COL (int8NDArray, TSBYTE);
+      case TSHORT:
+        return READ_COL (int16NDArray, TSHORT);
+      case TUSHORT:
+        return READ_COL (uint16NDArray, TUSHORT);
+      case TINT:
+      case TLONG:
+        // TLONG is a C long, so use TINT to get 32 bit values
+        return READ_COL (int32NDArray, TINT);
+      case TUINT:
+      case TULONG:
+        return READ_COL (uint32NDArray, TUINT);
+      case TLONGLONG:
+        return READ_COL (int64NDArray, TLONGLONG);
+      case TULONGLONG:
+        return READ_COL (uint64NDArray, TULONGLONG);
+      case TFLOAT:
+        return READ_COL (FloatNDArray, TFLOAT);
+      case TDOUBLE:
+        return READ_COL (NDArray, TDOUBLE);
+      case TCOMPLEX:
+        return READ_COL (FloatComplexNDArray, TCOMPLEX);
+      case TDBLCOMPLEX:
+        return READ_COL (ComplexNDArray, TDBLCOMPLEX);
+      case TLOGICAL:
+        if (var)
+          return read_var_col_values<boolNDArray> (fp, TLOGICAL, colnum,
+                                                   firstrow, nrows, flat, false,
+                                                   offsets, status);
+        return read_bool_col (fp, colnum, TLOGICAL, repeat, firstrow, nrows,
+                              nullmask, status);
+      case TBIT:
+        if (var)
+          {
+            status = BAD_DATATYPE;
+            break;
+          }
+        return read_bool_col (fp, colnum, TBIT, repeat, firstrow, nrows,
+                              nullmask, status);
+      default:
+        status = BAD_DATATYPE;
+    }
+
+#undef READ_COL
+
+  return octave_value ();
+}
+
+// PKG_ADD: autoload ("fits_readCol", "__fits__.oct");
+DEFUN_DLD(fits_readCol, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {[@var{coldata}, @var{nullval}] = } fits_readCol(@var{file}, @var{colnum})\n \
+@deftypefnx {Function File} {[@var{coldata}, @var{nullval}] = } fits_readCol(@var{file}, @var{colnum}, @var{firstrow}, @var{numrows})\n \
+@deftypefnx {Function File} {[@var{coldata}, @var{nullval}] = } fits_readCol(@var{file}, @var{colnum}, @var{firstrow}, @var{numrows}, @var{option}, @dots{})\n \
+@deftypefnx {Function File} {[@var{values}, @var{offsets}] = } fits_readCol(@var{file}, @var{colnum}, @var{firstrow}, @var{numrows}, 'flat')\n \
+Read @var{numrows} rows of column @var{colnum} of the current table HDU, starting at row @var{firstrow}\n \
+\n \
+If @var{firstrow} and @var{numrows} are not provided, all rows are read.\n \
+\n \
+Numeric columns are returned in their native type as a @var{numrows} by repeat count array.\n \
+\n \
+Logical (L) columns are returned as a @var{numrows} by repeat count logical array, and bit (X)\n \
+columns as a @var{numrows} by number of bits logical array, with column k holding bit k.\n \
+\n \
+Character columns are returned as a @var{numrows} by field width char matrix, blank padded\n \
+after the end of each string.  If the option 'trim' is given, trailing columns that are\n \
+blank in every row are removed, as deblank would do; use cellstr to trim each row.\n \
+\n \
+Numeric ascii table columns are parsed from the raw table rows, split over several threads.\n \
+The number of threads can be set with the environment variable OCTAVE_FITS_THREADS.\n \
+Null fields are returned as NaN for floating point columns and 0 for integer columns.\n \
+\n \
+If @var{nullval} is requested, it is a logical array the size of @var{coldata} flagging the\n \
+null (TNULL, NaN or undefined logical) values, found in the same pass that reads the data.\n \
+The null values themselves are then returned as NaN, or 0 for integer columns.\n \
+Without @var{nullval}, the option 'nan' returns the nulls of scaled and floating point\n \
+binary table columns as NaN.  Bit, character and variable length columns have no nulls.\n \
+\n \
+Variable length array columns are returned as a cell with one row vector per table row.\n \
+The descriptors are read in one pass, and the heap is read in ascending heap offset order.\n \
+If the option 'flat' is given, the values of all rows are instead returned as one column\n \
+vector @var{values}, with @var{offsets} holding the 1 based start index of each row in @var{values},\n \
+followed by numel(@var{values})+1, so row i is values(offsets(i):offsets(i+1)-1).\n \
+\n \
+This is the equivalent of the cfitsio fits_read_col function.\n \
+@end deftypefn")
+{
+  octave_value_list ret;
+
+  if ( args.length() != 2 && args.length() < 4)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  init_types ();
+
+  if ( args (0).type_id () != octave_fits_file::static_type_id ())
+    {
+      print_usage ();
+      return octave_value ();  
+    }
+
+  if (! args (1).is_scalar_type () || ! args (1).isnumeric ())
+    {
+      error ("fits_readCol: colnum should be a value");
+      return octave_value ();  
+    }
+  int colnum = args (1).int_value ();
+
+  bool flat = false;
+  bool trim = false;
+  bool nan = false;
+  for (int i = 4; i < args.length (); i++)
+    {
+      if (! args (i).is_string ())
+        {
+          error ("fits_readCol: option should be a string");
+          return octave_value ();
+        }
+      std::string opt = args (i).string_value ();
+      std::transform (opt.begin(), opt.end(), opt.begin(), ::tolower);
+      if (opt == "flat")
+        flat = true;
+      else if (opt == "trim")
+        trim = true;
+      else if (opt == "nan")
+        nan = true;
+      else
+        {
+          error ("fits_readCol: unknown option '%s'", opt.c_str ());
+          return octave_value ();
+        }
+    }
+
+  octave_fits_file * file = NULL;
+
+  const octave_base_value& rep = args (0).get_rep ();
+
+  file = &((octave_fits_file &)rep);
+
+  fitsfile *fp = file->get_fp();
+
+  if (!fp)
+    {
+      error ("fits_readCol: file not open");
+      return octave_value ();
+    }
+
+  int status = 0;
+  LONGLONG totalrows;
+
+  if (fits_get_num_rowsll (fp, &totalrows, &status) > 0)
+    {
+      fits_report_error (stderr, status);
+      error ("fits_readCol: couldnt get number of rows");
+      return octave_value ();
+    }
+
+  LONGLONG firstrow = 1;
+  LONGLONG nrows = totalrows;
+
+  if (args.length () >= 4)
+    {
+      if (! args (2).is_scalar_type () || ! args (2).isnumeric ()
+          || ! args (3).is_scalar_type () || ! args (3).isnumeric ())
+        {
+          error ("fits_readCol: firstrow and numrows should be values");
+          return octave_value ();
+        }
+      firstrow = args (2).int64_scalar_value ().value ();
+      nrows = args (3).int64_scalar_value ().value ();
+
+      if (firstrow < 1 || nrows < 0 || firstrow + nrows - 1 > totalrows)
+        {
+          error ("fits_readCol: rows %lld to %lld are outside the table of %lld rows",
+                 firstrow, firstrow + nrows - 1, totalrows);
+          return octave_value ();
+        }
+    }
+
+  int typecode;
+  LONGLONG repeat, width;
+
+  if (fits_get_eqcoltypell (fp, colnum, &typecode, &repeat, &width, &status) > 0)
+    {
+      fits_report_error (stderr, status);
+      error ("fits_readCol: couldnt get column type");
+      return octave_value ();
+    }
+
+  if (flat && (typecode > 0 || typecode == -TSTRING))
+    {
+      error ("fits_readCol: 'flat' is only valid for variable length array columns");
+      return octave_value ();
+    }
+
+  octave_value offsets;
+  octave_value data;
+  octave_value mask;
+  octave_value *nullmask = (nargout > 1 && ! flat) ? &mask : NULL;
+
+  int hdutype;
+  fits_get_hdu_type (fp, &hdutype, &status);
+
+  if (typecode == TSTRING)
+    data = read_char_col (fp, colnum, firstrow, nrows, trim, status);
+  else if (hdutype == ASCII_TBL)
+    data = read_ascii_col (fp, colnum, typecode, firstrow, nrows, nullmask,
+                           status);
+  else if (typecode == -TSTRING)
+    data = read_var_char_col (fp, colnum, firstrow, nrows, trim, status);
+  else
+    data = read_col (fp, colnum, typecode, repeat, firstrow, nrows,
+                     flat, nan, offsets, nullmask, status);
+
+  if (status == BAD_DATATYPE)
+    {
+      error ("fits_readCol: unsupported column type %d", typecode);
+      return octave_value ();
+    }
+  else if (status > 0)
+    {
+      fits_report_error (stderr, status);
+      error ("fits_readCol: couldnt read column");
+      return octave_value ();
+    }
+
+  ret(0) = data;
+  if (flat)
+    ret(1) = offsets;
+  else if (nullmask)
+    {
+      // columns without null values
+      if (mask.is_defined ())
+        ret(1) = mask;
+      else
+        ret(1) = boolNDArray (data.dims (), false);
+    }
+
+  return ret;
+}
+
+/*
+ * copy the part lo..hi (0 based, inclusive) of an image box starting
+ * at src_lo with size src_len into the box starting at dst_lo with size
+ * dst_len
+ */
+static void
+copy_image_box (const double *src, const long *src_lo, const long *src_len,
+                double *dst, const long *dst_lo, const long *dst_len,
+                const long *lo, const long *hi, int naxis)
+{
+  std::vector<long> pos (lo, lo + naxis);
+  long run = hi[0] - lo[0] + 1;
+
+  for (;;)
+    {
+      LONGLONG s = 0, d = 0, sstride = 1, dstride = 1;
+      for (int k = 0; k < naxis; k++)
+        {
+          s += (pos[k] - src_lo[k]) * sstride;
+          d += (pos[k] - dst_lo[k]) * dstride;
+          sstride *= src_len[k];
+          dstride *= dst_len[k];
+        }
+
+      std::copy (src + s, src + s + run, dst + d);
+
+      int k = 1;
+      for (; k < naxis; k++)
+        {
+          if (++pos[k] <= hi[k])
+            break;
+          pos[k] = lo[k];
+        }
+      if (k >= naxis)
+        break;
+    }
+}
+
+/*
+ * a tile of a compressed image, with its box in the image (0 based)
+ */
+struct image_tile
+{
+  LONGLONG index;
+  std::vector<long> lo, len;
+  fits_tile_cache::tile_type data;
+};
+
+/*
+ * decompress a tile by reading exactly its box from the image
+ */
+static int
+read_image_tile (fitsfile *fp, image_tile &tile, int &status)
+{
+  int naxis = tile.lo.size ();
+  std::vector<long> fpixel (naxis), lpixel (naxis), inc (naxis, 1);
+  LONGLONG n = 1;
+
+  for (int k = 0; k < naxis; k++)
+    {
+      fpixel[k] = tile.lo[k] + 1;
+      lpixel[k] = tile.lo[k] + tile.len[k];
+      n *= tile.len[k];
+    }
+
+  tile.data.resize (n);
+
+  int anynul = 0;
+  return fits_read_subset (fp, TDOUBLE, fpixel.data (), lpixel.data (),
+                           inc.data (), NULL, tile.data.data (), &anynul,
+                           &status);
+}
+
+// number of missing pixels from which tiles are decompressed on worker
+// threads, as each worker needs its own handle on the file
+static const LONGLONG parallel_tile_pixels = 1 << 16;
+
+/*
+ * decompress tiles on worker threads, each reading through its own
+ * handle on the file, from readers if the file was opened for concurrent
+ * reads.  Handles opened read write are only read on the calling thread.
+ * Tiles a worker could not read are read on the calling thread.
+ */
+static int
+read_image_tiles (fitsfile *fp, fits_reader_pool &readers,
+                  std::vector<image_tile> &tiles, int &status)
+{
+  LONGLONG npixels = 0;
+  for (size_t i = 0; i < tiles.size (); i++)
+    {
+      LONGLONG n = 1;
+      for (size_t k = 0; k < tiles[i].len.size (); k++)
+        n *= tiles[i].len[k];
+      npixels += n;
+    }
+
+  int nthreads = fits_num_threads ();
+  std::vector<char> done (tiles.size (), 0);
+
+  // a handle can only be reopened for a plain file, and only one opened
+  // read only, as writes through fp may not have reached the file yet
+  char name[FLEN_FILENAME];
+  int hdunum, mode = READWRITE, nstatus = 0;
+  fits_file_name (fp, name, &nstatus);
+  fits_file_mode (fp, &mode, &nstatus);
+  fits_get_hdu_num (fp, &hdunum);
+  bool pooled = readers.is_enabled ();
+  bool reopen = pooled || (nstatus == 0 && mode == READONLY
+                           && strchr (name, '[') == NULL
+                           && strncmp (name, "mem:", 4) != 0);
+
+  if (nthreads > 1 && tiles.size () > 1 && npixels >= parallel_tile_pixels
+      && reopen && fits_is_reentrant ())
+    {
+      fits_parallel_for (tiles.size (), nthreads,
+                         [&] (size_t b, size_t e)
+                         {
+                           fitsfile *tfp = NULL;
+                           int tstatus = 0;
+
+                           if (pooled)
+                             tfp = readers.acquire (hdunum, &tstatus);
+                           else if (fits_open_file (&tfp, name, READONLY, &tstatus) > 0)
+                             tfp = NULL;
+                           else
+                             fits_movabs_hdu (tfp, hdunum, NULL, &tstatus);
+
+                           if (! tfp)
+                             return;
+
+                           for (size_t i = b; i < e && tstatus <= 0; i++)
+                             {
+                               if (read_image_tile (tfp, tiles[i], tstatus) > 0)
+                                 break;
+                               done[i] = 1;
+                             }
+
+                           tstatus = 0;
+                           if (pooled)
+                             readers.release (tfp);
+                           else
+                             fits_close_file (tfp, &tstatus);
+                         });
+    }
+
+  for (size_t i = 0; i < tiles.size () && status <= 0; i++)
+    {
+      if (! done[i])
+        read_image_tile (fp, tiles[i], status);
+      octave_quit ();
+    }
+
+  return status;
+}
+
+// PKG_ADD: autoload ("fits_readCutout", "__fits__.oct");
+DEFUN_DLD(fits_readCutout, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {@var{image} = } fits_readCutout(@var{file}, @var{fpixel}, @var{lpixel})\n \
+Read the part of the image of the current HDU from pixel @var{fpixel} to pixel @var{lpixel}\n \
+\n \
+@var{fpixel} and @var{lpixel} are vectors of the 1 based first and last pixel along each axis.\n \
+The cutout is returned as a double array.\n \
+\n \
+For a tile compressed image, only the tiles that intersect the cutout are decompressed,\n \
+on several threads if there are many and the file is open read only.  The decompressed\n \
+tiles are kept in a least recently used cache of the file, so further cutouts reuse them;\n \
+see fits_setTileCache.  The number of threads can be set with the environment variable\n \
+OCTAVE_FITS_THREADS.\n \
+\n \
+This is the equivalent of the cfitsio fits_read_subset function.\n \
+@seealso {fits_setTileCache}\n \
+@end deftypefn")
+{
+  if ( args.length() != 3)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  init_types ();
+
+  if ( args (0).type_id () != octave_fits_file::static_type_id ())
+    {
+      print_usage ();
+      return octave_value ();  
+    }
+
+  if (! args (1).isnumeric () || ! args (2).isnumeric ())
+    {
+      error ("fits_readCutout: fpixel and lpixel should be vectors");
+      return octave_value ();  
+    }
+
+  octave_fits_file * file = NULL;
+
+  const octave_base_value& rep = args (0).get_rep ();
+
+  file = &((octave_fits_file &)rep);
+
+  fitsfile *fp = file->get_fp();
+
+  if(!fp)
+    {
+      error("fits_readCutout: file not open");
+      return octave_value ();
+    }
+
+  int status = 0;
+  int naxis = 0;
+
+  if (fits_get_img_dim (fp, &naxis, &status) > 0 || naxis < 1)
+    {
+      if (status > 0)
+        fits_report_error( stderr, status );
+      error("fits_readCutout: current HDU is not an image");
+      return octave_value ();
+    }
+
+  std::vector<long> naxes (naxis);
+  fits_get_img_size (fp, naxis, naxes.data (), &status);
+
+  NDArray first = args (1).array_value ();
+  NDArray last = args (2).array_value ();
+
+  if (first.numel () != naxis || last.numel () != naxis)
+    {
+      error ("fits_readCutout: fpixel and lpixel should have %d elements", naxis);
+      return octave_value ();
+    }
+
+  // cutout box, 0 based
+  std::vector<long> lo (naxis), hi (naxis), len (naxis);
+  dim_vector dims;
+  dims.resize (std::max (naxis, 2));
+  dims(1) = 1;
+
+  for (int k = 0; k < naxis; k++)
+    {
+      lo[k] = long (first(k)) - 1;
+      hi[k] = long (last(k)) - 1;
+      if (lo[k] < 0 || hi[k] < lo[k] || hi[k] >= naxes[k])
+        {
+          error ("fits_readCutout: pixels %ld to %ld are outside axis %d of length %ld",
+                 lo[k] + 1, hi[k] + 1, k + 1, naxes[k]);
+          return octave_value ();
+        }
+      len[k] = hi[k] - lo[k] + 1;
+      dims(k) = len[k];
+    }
+
+  NDArray image (dims);
+  double *out = image.fortran_vec ();
+
+  int compressed = fits_is_compressed_image (fp, &status);
+  std::vector<long> tiledim (naxis, 1);
+
+  if (! compressed || fits_get_tile_dim (fp, naxis, tiledim.data (), &status) > 0)
+    {
+      std::vector<long> fpixel (naxis), lpixel (naxis), inc (naxis, 1);
+      for (int k = 0; k < naxis; k++)
+        {
+          fpixel[k] = lo[k] + 1;
+          lpixel[k] = hi[k] + 1;
+        }
+
+      status = 0;
+      int anynul = 0;
+      if (fits_read_subset (fp, TDOUBLE, fpixel.data (), lpixel.data (),
+                            inc.data (), NULL, out, &anynul, &status) > 0)
+        {
+          fits_report_error( stderr, status );
+          error("fits_readCutout: couldnt read image");
+          return octave_value ();
+        }
+
+      return octave_value (image);
+    }
+
+  // the tiles that intersect the cutout, taken from the cache if there
+  fits_tile_cache &cache = file->get_tile_cache ();
+  int hdunum;
+  fits_get_hdu_num (fp, &hdunum);
+
+  std::vector<long> t0 (naxis), t1 (naxis), ntiles (naxis), tpos (naxis);
+  for (int k = 0; k < naxis; k++)
+    {
+      tiledim[k] = std::max (1L, std::min (tiledim[k], naxes[k]));
+      ntiles[k] = (naxes[k] + tiledim[k] - 1) / tiledim[k];
+      t0[k] = tpos[k] = lo[k] / tiledim[k];
+      t1[k] = hi[k] / tiledim[k];
+    }
+
+  std::vector<image_tile> missing;
+  std::vector<long> tlo (naxis), tlen (naxis), olo (naxis), ohi (naxis);
+
+  for (;;)
+    {
+      LONGLONG index = 0, stride = 1;
+      for (int k = 0; k < naxis; k++)
+        {
+          index += tpos[k] * stride;
+          stride *= ntiles[k];
+          tlo[k] = tpos[k] * tiledim[k];
+          tlen[k] = std::min (tiledim[k], naxes[k] - tlo[k]);
+          olo[k] = std::max (lo[k], tlo[k]);
+          ohi[k] = std::min (hi[k], tlo[k] + tlen[k] - 1);
+        }
+
+      const fits_tile_cache::tile_type *cached
+        = cache.find (fits_tile_cache::key_type (hdunum, index));
+
+      if (cached)
+        copy_image_box (cached->data (), tlo.data (), tlen.data (), out,
+                        lo.data (), len.data (), olo.data (), ohi.data (),
+                        naxis);
+      else
+        {
+          image_tile tile;
+          tile.index = index;
+          tile.lo = tlo;
+          tile.len = tlen;
+          missing.push_back (tile);
+        }
+
+      int k = 0;
+      for (; k < naxis; k++)
+        {
+          if (++tpos[k] <= t1[k])
+            break;
+          tpos[k] = t0[k];
+        }
+      if (k >= naxis)
+        break;
+    }
+
+  if (read_image_tiles (fp, file->get_readers (), missing, status) > 0)
+    {
+      fits_report_error( stderr, status );
+      error("fits_readCutout: couldnt read image");
+      return octave_value ();
+    }
+
+  for (size_t i = 0; i < missing.size (); i++)
+    {
+      image_tile &tile = missing[i];
+      for (int k = 0; k < naxis; k++)
+        {
+          olo[k] = std::max (lo[k], tile.lo[k]);
+          ohi[k] = std::min (hi[k], tile.lo[k] + tile.len[k] - 1);
+        }
+
+      copy_image_box (tile.data.data (), tile.lo.data (), tile.len.data (),
+                      out, lo.data (), len.data (), olo.data (), ohi.data (),
+                      naxis);
+
+      cache.insert (fits_tile_cache::key_type (hdunum, tile.index), tile.data);
+    }
+
+  return octave_value (image);
+}
+
+// PKG_ADD: autoload ("fits_setTileCache", "__fits__.oct");
+DEFUN_DLD(fits_setTileCache, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {@var{oldsize} = } fits_setTileCache(@var{file}, @var{nbytes})\n \
+Set the memory budget of the cache of decompressed tiles used by fits_readCutout\n \
+\n \
+The least recently used tiles are dropped to keep the cache within @var{nbytes}.\n \
+A size of 0 disables the cache.  The default is 64 MiB per file.\n \
+The previous size is returned.\n \
+@seealso {fits_readCutout}\n \
+@end deftypefn")
+{
+  if ( args.length() != 2)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  init_types ();
+
+  if ( args (0).type_id () != octave_fits_file::static_type_id ())
+    {
+      print_usage ();
+      return octave_value ();  
+    }
+
+  if (! args (1).is_scalar_type () || ! args (1).isnumeric ()
+      || args (1).double_value () < 0)
+    {
+      error ("fits_setTileCache: nbytes should be a non-negative value");
+      return octave_value ();  
+    }
+
+  octave_fits_file * file = NULL;
+
+  const octave_base_value& rep = args (0).get_rep ();
+
+  file = &((octave_fits_file &)rep);
+
+  fits_tile_cache &cache = file->get_tile_cache ();
+  double oldsize = cache.get_budget ();
+
+  cache.set_budget (size_t (args (1).double_value ()));
+
+  return octave_value (oldsize);
+}
+
+/*
+ * the cfitsio datatype to read the pixels of an image of the given
+ * equivalent type in, with BSCALE and BZERO applied
+ */
+static int
+image_datatype (int equivtype)
+{
+  switch (equivtype)
+    {
+      case BYTE_IMG:
+        return TBYTE;
+      case SBYTE_IMG:
+        return TSBYTE;
+      case SHORT_IMG:
+        return TSHORT;
+      case USHORT_IMG:
+        return TUSHORT;
+      case LONG_IMG:
+        return TINT;
+      case ULONG_IMG:
+        return TUINT;
+      case LONGLONG_IMG:
+        return TLONGLONG;
+      case ULONGLONG_IMG:
+        return TULONGLONG;
+      case FLOAT_IMG:
+        return TFLOAT;
+      default:
+        return TDOUBLE;
+    }
+}
+
+// number of pixels from which fits_readImg and fits_readSubset read a
+// file opened 'CONCURRENT' through several handles of its pool
+static const LONGLONG parallel_read_pixels = 1 << 16;
+
+/*
+ * read pixels of the current image HDU into an array of dims: the
+ * subset from fpixel to lpixel every inc pixels along each of naxis axes
+ * if fpixel is not NULL, else numel of dims pixels from the 1 based
+ * element first.  If readers is enabled, large reads are split along the
+ * last axis of the subset, or into runs of pixels, each read on a worker
+ * thread through a handle of the pool.
+ */
+template <typename AT>
+static octave_value
+read_img_values (fitsfile *fp, fits_reader_pool *readers, int datatype,
+                 const dim_vector &dims, LONGLONG first, int naxis,
+                 long *fpixel, long *lpixel, long *inc, int &status)
+{
+  AT data (dims);
+  int anynul = 0;
+
+  if (data.numel () == 0)
+    return octave_value (data);
+
+  int nthreads = fits_num_threads ();
+  if (readers && readers->is_enabled () && nthreads > 1
+      && data.numel () >= parallel_read_pixels && fits_is_reentrant ())
+    {
+      auto out = data.fortran_vec ();
+      LONGLONG nparts = data.numel (), part = 1;
+      if (fpixel)
+        {
+          nparts = (lpixel[naxis-1] - fpixel[naxis-1]) / inc[naxis-1] + 1;
+          part = data.numel () / nparts;
+        }
+
+      int hdunum;
+      fits_get_hdu_num (fp, &hdunum);
+      std::mutex lock;
+
+      fits_parallel_for (nparts, nthreads, [&] (size_t b, size_t e)
+        {
+          int tstatus = 0, tanynul = 0;
+          fitsfile *tfp = readers->acquire (hdunum, &tstatus);
+
+          if (tfp && fpixel)
+            {
+              std::vector<long> f (fpixel, fpixel + naxis);
+              std::vector<long> l (lpixel, lpixel + naxis);
+              f[naxis-1] = fpixel[naxis-1] + b * inc[naxis-1];
+              l[naxis-1] = fpixel[naxis-1] + (e - 1) * inc[naxis-1];
+              fits_read_subset (tfp, datatype, f.data (), l.data (), inc,
+                                NULL, out + b*part, &tanynul, &tstatus);
+            }
+          else if (tfp)
+            fits_read_img (tfp, datatype, first + b, e - b, NULL, out + b,
+                           &tanynul, &tstatus);
+
+          if (tfp)
+            readers->release (tfp);
+
+          std::lock_guard<std::mutex> guard (lock);
+          if (tstatus > 0 && status <= 0)
+            status = tstatus;
+        });
+
+      return octave_value (data);
+    }
+
+  if (fpixel)
+    fits_read_subset (fp, datatype, fpixel, lpixel, inc, NULL,
+                      data.fortran_vec (), &anynul, &status);
+  else
+    fits_read_img (fp, datatype, first, data.numel (), NULL,
+                   data.fortran_vec (), &anynul, &status);
+
+  return octave_value (data);
+}
+
+/*
+ * read pixels of the current image HDU in their native type, as
+ * read_img_values
+ */
+static octave_value
+read_img (fitsfile *fp, fits_reader_pool *readers, const dim_vector &dims,
+          LONGLONG first, int naxis, long *fpixel, long *lpixel, long *inc,
+          int &status)
+{
+  int equivtype = DOUBLE_IMG;
+
+  if (fits_get_img_equivtype (fp, &equivtype, &status) > 0)
+    return octave_value ();
+
+  int datatype = image_datatype (equivtype);
+
+#define READ_IMG(AT) \
+  read_img_values<AT> (fp, readers, datatype, dims, first, naxis, fpixel, \
+                       lpixel, inc, status)
+
+  switch (datatype)
+    {
+      case TBYTE:
+        return READ_IMG (uint8NDArray);
+      case TSBYTE:
+        return READ_IMG (int8NDArray);
+      case TSHORT:
+        return READ_IMG (int16NDArray);
+      case TUSHORT:
+        return READ_IMG (uint16NDArray);
+      case TINT:
+        return READ_IMG (int32NDArray);
+      case TUINT:
+        return READ_IMG (uint32NDArray);
+      case TLONGLONG:
+        return READ_IMG (int64NDArray);
+      case TULONGLONG:
+        return READ_IMG (uint64NDArray);
+      case TFLOAT:
+        return READ_IMG (FloatNDArray);
+      default:
+        return READ_IMG (NDArray);
+    }
+
+#undef READ_IMG
+}
+
+/*
+ * write the values of an array to the current image HDU: to the subset
+ * from fpixel to lpixel if fpixel is not NULL, else from the 1 based
+ * element first.  The values are converted by cfitsio from their own
+ * type to that of the image.
+ */
+template <typename AT>
+static int
+write_img_values (fitsfile *fp, int datatype, const AT &data, LONGLONG first,
+                  long *fpixel, long *lpixel, int &status)
+{
+  void *values = const_cast<typename AT::element_type *> (data.data ());
+
+  if (data.numel () == 0)
+    return status;
+
+  if (fpixel)
+    return fits_write_subset (fp, datatype, fpixel, lpixel, values, &status);
+
+  return fits_write_img (fp, datatype, first, data.numel (), values, &status);
+}
+
+/*
+ * write the values of an octave array of any real numeric or logical type
+ */
+static int
+write_img (fitsfile *fp, const octave_value &v, LONGLONG first, long *fpixel,
+           long *lpixel, int &status)
+{
+#define WRITE_IMG(VALUE, DATATYPE) \
+  write_img_values (fp, DATATYPE, v.VALUE (), first, fpixel, lpixel, status)
+
+  if (v.is_uint8_type ())
+    return WRITE_IMG (uint8_array_value, TBYTE);
+  else if (v.is_int8_type ())
+    return WRITE_IMG (int8_array_value, TSBYTE);
+  else if (v.is_int16_type ())
+    return WRITE_IMG (int16_array_value, TSHORT);
+  else if (v.is_uint16_type ())
+    return WRITE_IMG (uint16_array_value, TUSHORT);
+  else if (v.is_int32_type ())
+    return WRITE_IMG (int32_array_value, TINT);
+  else if (v.is_uint32_type ())
+    return WRITE_IMG (uint32_array_value, TUINT);
+  else if (v.is_int64_type ())
+    return WRITE_IMG (int64_array_value, TLONGLONG);
+  else if (v.is_uint64_type ())
+    return WRITE_IMG (uint64_array_value, TULONGLONG);
+  else if (v.is_single_type ())
+    return WRITE_IMG (float_array_value, TFLOAT);
+  else
+    return WRITE_IMG (array_value, TDOUBLE);
+
+#undef WRITE_IMG
+}
+
+/*
+ * get the 1 based pixel vectors of a subset of the current image,
+ * checking them against its size.  inc may be NULL.
+ */
+static bool
+get_subset (fitsfile *fp, const char *fname, const octave_value &fpix,
+            const octave_value &lpix, const octave_value *incval,
+            std::vector<long> &fpixel, std::vector<long> &lpixel,
+            std::vector<long> &inc, dim_vector &dims, int &status)
+{
+  int naxis = 0;
+
+  if (fits_get_img_dim (fp, &naxis, &status) > 0 || naxis < 1)
+    {
+      if (status > 0)
+        fits_report_error( stderr, status );
+      error ("%s: current HDU is not an image", fname);
+      return false;
+    }
+
+  std::vector<LONGLONG> naxes (naxis);
+  fits_get_img_sizell (fp, naxis, naxes.data (), &status);
+
+  if (! fpix.isnumeric () || ! lpix.isnumeric ()
+      || (incval && ! incval->isnumeric ()))
+    {
+      error ("%s: fpixel, lpixel and inc should be vectors", fname);
+      return false;
+    }
+
+  NDArray f = fpix.array_value ();
+  NDArray l = lpix.array_value ();
+  NDArray in = incval ? incval->array_value () : NDArray (dim_vector (naxis, 1), 1);
+
+  if (f.numel () != naxis || l.numel () != naxis || in.numel () != naxis)
+    {
+      error ("%s: fpixel, lpixel and inc should have %d elements", fname, naxis);
+      return false;
+    }
+
+  fpixel.resize (naxis);
+  lpixel.resize (naxis);
+  inc.resize (naxis);
+  dims.resize (std::max (naxis, 2));
+  dims(0) = dims(1) = 1;
+
+  for (int k = 0; k < naxis; k++)
+    {
+      if (f(k) < 1 || l(k) > naxes[k] || f(k) > l(k) || in(k) < 1)
+        {
+          error ("%s: pixels %g to %g outside axis %d", fname, f(k), l(k), k + 1);
+          return false;
+        }
+      fpixel[k] = long (f(k));
+      lpixel[k] = long (l(k));
+      inc[k] = long (in(k));
+      dims(k) = (lpixel[k] - fpixel[k]) / inc[k] + 1;
+    }
+
+  return true;
+}
+
+/*
+ * get the BITPIX of an image, from a name or number, or the name of an
+ * Octave class
+ */
+static bool
+get_bitpix (const octave_value &arg, int &bitpix)
+{
+  static const char *names[] = { "BYTE_IMG", "SBYTE_IMG", "SHORT_IMG",
+                                 "USHORT_IMG", "LONG_IMG", "ULONG_IMG",
+                                 "LONGLONG_IMG", "ULONGLONG_IMG",
+                                 "FLOAT_IMG", "DOUBLE_IMG" };
+  static const char *classes[] = { "UINT8", "INT8", "INT16", "UINT16",
+                                   "INT32", "UINT32", "INT64", "UINT64",
+                                   "SINGLE", "DOUBLE" };
+  static const int values[] = { BYTE_IMG, SBYTE_IMG, SHORT_IMG, USHORT_IMG,
+                                LONG_IMG, ULONG_IMG, LONGLONG_IMG,
+                                ULONGLONG_IMG, FLOAT_IMG, DOUBLE_IMG };
+
+  std::string name = arg.is_string () ? arg.string_value () : "";
+  std::transform (name.begin (), name.end (), name.begin (), ::toupper);
+
+  for (int i = 0; i < 10; i++)
+    {
+      if (arg.is_string () ? (name == names[i] || name == classes[i])
+          : (arg.is_scalar_type () && arg.double_value () == values[i]))
+        {
+          bitpix = values[i];
+          return true;
+        }
+    }
+
+  return false;
+}
+
+// PKG_ADD: autoload ("fits_createImg", "__fits__.oct");
+DEFUN_DLD(fits_createImg, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {} fits_createImg(@var{file}, @var{bitpix}, @var{naxes})\n \
+Append an image HDU of type @var{bitpix} and size @var{naxes} to the file, and make it the current HDU\n \
+\n \
+@var{bitpix} is a name such as 'SHORT_IMG' or 'FLOAT_IMG' (including the unsigned 'USHORT_IMG',\n \
+'ULONG_IMG' and 'ULONGLONG_IMG' and the signed 'SBYTE_IMG'), its value, or the name of the Octave class\n \
+to store, such as 'uint16'.  Unsigned and signed byte types are stored with BZERO as usual.\n \
+\n \
+This is the equivalent of the cfitsio fits_create_imgll function.\n \
+@seealso {fits_writeImg, fits_writeSubset}\n \
+@end deftypefn")
+{
+  if ( args.length() != 3)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  init_types ();
+
+  if ( args (0).type_id () != octave_fits_file::static_type_id ())
+    {
+      print_usage ();
+      return octave_value ();  
+    }
+
+  int bitpix;
+  if (! get_bitpix (args (1), bitpix))
+    {
+      error ("fits_createImg: invalid bitpix");
+      return octave_value ();
+    }
+
+  if (! args (2).isnumeric ())
+    {
+      error ("fits_createImg: naxes should be a vector");
+      return octave_value ();
+    }
+
+  NDArray sz = args (2).array_value ();
+  std::vector<LONGLONG> naxes (sz.numel ());
+  for (octave_idx_type k = 0; k < sz.numel (); k++)
+    {
+      if (sz(k) < 0 || OCTAVE__D_NINT (sz(k)) != sz(k))
+        {
+          error ("fits_createImg: naxes should be non-negative integers");
+          return octave_value ();
+        }
+      naxes[k] = LONGLONG (sz(k));
+    }
+
+  octave_fits_file * file = NULL;
+
+  const octave_base_value& rep = args (0).get_rep ();
+
+  file = &((octave_fits_file &)rep);
+
+  fitsfile *fp = file->get_fp();
+
+  if(!fp)
+    {
+      error("fits_createImg: file not open");
+      return octave_value ();
+    }
+
+  int status = 0;
+
+  if (fits_create_imgll (fp, bitpix, naxes.size (), naxes.data (), &status) > 0)
+    {
+      fits_report_error( stderr, status );
+      error("fits_createImg: couldnt create image");
+      return octave_value ();
+    }
+
+  return octave_value ();
+}
+
+/*
+ * get the scalar v as a 64 bit pixel offset.  Integer types are taken
+ * whole, and doubles only if they hold an integer in the range of int64,
+ * so that neither is rounded.
+ */
+static bool
+get_pixel_offset (const octave_value &v, LONGLONG &val)
+{
+  if (! v.is_scalar_type () || ! v.isnumeric () || v.iscomplex ())
+    return false;
+
+  if (v.isinteger ())
+    {
+      val = v.int64_scalar_value ().value ();
+      return true;
+    }
+
+  double d = v.double_value ();
+  if (d != std::floor (d) || std::fabs (d) >= 9223372036854775808.0)
+    return false;
+
+  val = LONGLONG (d);
+  return true;
+}
+
+// PKG_ADD: autoload ("fits_readImg", "__fits__.oct");
+DEFUN_DLD(fits_readImg, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {@var{image} = } fits_readImg(@var{file})\n \
+@deftypefnx {Function File} {@var{pixels} = } fits_readImg(@var{file}, @var{firstelem}, @var{nelements})\n \
+Read the image of the current HDU, in the Octave type of its pixels\n \
+\n \
+The image is returned with the type that holds its values with BSCALE and BZERO applied,\n \
+such as uint16 for a SHORT_IMG with BZERO 32768, or single for a FLOAT_IMG.\n \
+\n \
+If @var{firstelem} and @var{nelements} are given, @var{nelements} pixels from the 1 based\n \
+pixel @var{firstelem} of the image, counted with the first axis varying fastest, are returned\n \
+as a column vector.  Offsets may exceed 2^32.\n \
+\n \
+This is the equivalent of the cfitsio fits_read_img function.\n \
+@seealso {fits_readSubset, fits_writeImg, fits_readCutout}\n \
+@end deftypefn")
+{
+  if ( args.length() != 1 && args.length() != 3)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  init_types ();
+
+  if ( args (0).type_id () != octave_fits_file::static_type_id ())
+    {
+      print_usage ();
+      return octave_value ();  
+    }
+
+  octave_fits_file * file = NULL;
+
+  const octave_base_value& rep = args (0).get_rep ();
+
+  file = &((octave_fits_file &)rep);
+
+  fitsfile *fp = file->get_fp();
+
+  if(!fp)
+    {
+      error("fits_readImg: file not open");
+      return octave_value ();
+    }
+
+  int status = 0;
+  int naxis = 0;
+
+  if (fits_get_img_dim (fp, &naxis, &status) > 0)
+    {
+      fits_report_error( stderr, status );
+      error("fits_readImg: current HDU is not an image");
+      return octave_value ();
+    }
+
+  std::vector<LONGLONG> naxes (naxis);
+  fits_get_img_sizell (fp, naxis, naxes.data (), &status);
+
+  LONGLONG total = naxis > 0 ? 1 : 0;
+  for (int k = 0; k < naxis; k++)
+    total *= naxes[k];
+
+  LONGLONG first = 1;
+  dim_vector dims;
+
+  if (args.length () == 3)
+    {
+      LONGLONG n;
+      if (! get_pixel_offset (args (1), first)
+          || ! get_pixel_offset (args (2), n))
+        {
+          error ("fits_readImg: firstelem and nelements should be integers");
+          return octave_value ();
+        }
+
+      if (first < 1 || n < 0 || n > total - first + 1)
+        {
+          error ("fits_readImg: pixels outside of image");
+          return octave_value ();
+        }
+
+      dims = dim_vector (octave_idx_type (n), 1);
+    }
+  else
+    {
+      dims.resize (std::max (naxis, 2));
+      dims(0) = dims(1) = naxis > 0 ? 1 : 0;
+      for (int k = 0; k < naxis; k++)
+        dims(k) = naxes[k];
+    }
+
+  octave_value image = read_img (fp, &file->get_readers (), dims, first, 0,
+                                 NULL, NULL, NULL, status);
+
+  if (status > 0)
+    {
+      fits_report_error( stderr, status );
+      error("fits_readImg: couldnt read image");
+      return octave_value ();
+    }
+
+  return image;
+}
+
+// PKG_ADD: autoload ("fits_readSubset", "__fits__.oct");
+DEFUN_DLD(fits_readSubset, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {@var{image} = } fits_readSubset(@var{file}, @var{fpixel}, @var{lpixel})\n \
+@deftypefnx {Function File} {@var{image} = } fits_readSubset(@var{file}, @var{fpixel}, @var{lpixel}, @var{inc})\n \
+Read the part of the image of the current HDU from pixel @var{fpixel} to pixel @var{lpixel}, in the Octave type of its pixels\n \
+\n \
+@var{fpixel} and @var{lpixel} are vectors of the 1 based first and last pixel along each axis,\n \
+and @var{inc} the step along each axis (default 1).  The type is chosen as by fits_readImg.\n \
+\n \
+This is the equivalent of the cfitsio fits_read_subset function.\n \
+@seealso {fits_readImg, fits_writeSubset, fits_readCutout}\n \
+@end deftypefn")
+{
+  if ( args.length() != 3 && args.length() != 4)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  init_types ();
+
+  if ( args (0).type_id () != octave_fits_file::static_type_id ())
+    {
+      print_usage ();
+      return octave_value ();  
+    }
+
+  octave_fits_file * file = NULL;
+
+  const octave_base_value& rep = args (0).get_rep ();
+
+  file = &((octave_fits_file &)rep);
+
+  fitsfile *fp = file->get_fp();
+
+  if(!fp)
+    {
+      error("fits_readSubset: file not open");
+      return octave_value ();
+    }
+
+  int status = 0;
+  std::vector<long> fpixel, lpixel, inc;
+  dim_vector dims;
+
+  octave_value incval = args.length () > 3 ? args (3) : octave_value ();
+
+  if (! get_subset (fp, "fits_readSubset", args (1), args (2),
+                    args.length () > 3 ? &incval : NULL,
+                    fpixel, lpixel, inc, dims, status))
+    return octave_value ();
+
+  octave_value image = read_img (fp, &file->get_readers (), dims, 1,
+                                 fpixel.size (), fpixel.data (),
+                                 lpixel.data (), inc.data (), status);
+
+  if (status > 0)
+    {
+      fits_report_error( stderr, status );
+      error("fits_readSubset: couldnt read image");
+      return octave_value ();
+    }
+
+  return image;
+}
+
+// PKG_ADD: autoload ("fits_writeImg", "__fits__.oct");
+DEFUN_DLD(fits_writeImg, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {} fits_writeImg(@var{file}, @var{data})\n \
+@deftypefnx {Function File} {} fits_writeImg(@var{file}, @var{data}, @var{firstelem})\n \
+Write the values of @var{data} to the image of the current HDU\n \
+\n \
+The values are written from the 1 based pixel @var{firstelem} of the image (default 1),\n \
+counted with the first axis varying fastest; offsets may exceed 2^32.  The values are passed to\n \
+cfitsio in their own type, and converted by it to the type of the image.\n \
+\n \
+This is the equivalent of the cfitsio fits_write_img function.\n \
+@seealso {fits_createImg, fits_writeSubset, fits_readImg}\n \
+@end deftypefn")
+{
+  if ( args.length() != 2 && args.length() != 3)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  init_types ();
+
+  if ( args (0).type_id () != octave_fits_file::static_type_id ())
+    {
+      print_usage ();
+      return octave_value ();  
+    }
+
+  if ((! args (1).isnumeric () && ! args (1).islogical ()) || args (1).iscomplex ())
+    {
+      error ("fits_writeImg: data should be a real numeric array");
+      return octave_value ();
+    }
+
+  LONGLONG first = 1;
+  if (args.length () > 2)
+    {
+      if (! get_pixel_offset (args (2), first) || first < 1)
+        {
+          error ("fits_writeImg: firstelem should be a positive integer");
+          return octave_value ();
+        }
+    }
+
+  octave_fits_file * file = NULL;
+
+  const octave_base_value& rep = args (0).get_rep ();
+
+  file = &((octave_fits_file &)rep);
+
+  fitsfile *fp = file->get_fp();
+
+  if(!fp)
+    {
+      error("fits_writeImg: file not open");
+      return octave_value ();
+    }
+
+  int status = 0;
+
+  if (write_img (fp, args (1), first, NULL, NULL, status) > 0)
+    {
+      fits_report_error( stderr, status );
+      error("fits_writeImg: couldnt write image");
+      return octave_value ();
+    }
+
+  // cached tiles of the image may have changed
+  file->get_tile_cache ().clear ();
+
+  return octave_value ();
+}
+
+// PKG_ADD: autoload ("fits_writeSubset", "__fits__.oct");
+DEFUN_DLD(fits_writeSubset, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {} fits_writeSubset(@var{file}, @var{fpixel}, @var{lpixel}, @var{data})\n \
+Write the values of @var{data} to the part of the image of the current HDU from pixel @var{fpixel} to pixel @var{lpixel}\n \
+\n \
+@var{fpixel} and @var{lpixel} are vectors of the 1 based first and last pixel along each axis, and\n \
+@var{data} has as many elements as the part of the image.  The values are passed to cfitsio in their\n \
+own type, and converted by it to the type of the image.\n \
+\n \
+This is the equivalent of the cfitsio fits_write_subset function.\n \
+@seealso {fits_createImg, fits_writeImg, fits_readSubset}\n \
+@end deftypefn")
+{
+  if ( args.length() != 4)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  init_types ();
+
+  if ( args (0).type_id () != octave_fits_file::static_type_id ())
+    {
+      print_usage ();
+      return octave_value ();  
+    }
+
+  if ((! args (3).isnumeric () && ! args (3).islogical ()) || args (3).iscomplex ())
+    {
+      error ("fits_writeSubset: data should be a real numeric array");
+      return octave_value ();
+    }
+
+  octave_fits_file * file = NULL;
+
+  const octave_base_value& rep = args (0).get_rep ();
+
+  file = &((octave_fits_file &)rep);
+
+  fitsfile *fp = file->get_fp();
+
+  if(!fp)
+    {
+      error("fits_writeSubset: file not open");
+      return octave_value ();
+    }
+
+  int status = 0;
+  std::vector<long> fpixel, lpixel, inc;
+  dim_vector dims;
+
+  if (! get_subset (fp, "fits_writeSubset", args (1), args (2), NULL,
+                    fpixel, lpixel, inc, dims, status))
+    return octave_value ();
+
+  if (args (3).numel () != dims.numel ())
+    {
+      error ("fits_writeSubset: data should have %ld elements",
+             long (dims.numel ()));
+      return octave_value ();
+    }
+
+  if (write_img (fp, args (3), 1, fpixel.data (), lpixel.data (), status) > 0)
+    {
+      fits_report_error( stderr, status );
+      error("fits_writeSubset: couldnt write image");
+      return octave_value ();
+    }
+
+  // cached tiles of the image may have changed
+  file->get_tile_cache ().clear ();
+
+  return octave_value ();
+}
+
+// PKG_ADD: autoload ("fits_getConstantValue", "__fits__.oct");
+DEFUN_DLD(fits_getConstantValue, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {[@var{value}]} = fits_getConstantValue(@var{name})\n \
+Return the value of a known fits constant.\n \
+@seealso {fits_getConstantNames}\n \
+@end deftypefn")
+{
+  if ( args.length() == 0)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  if (args.length () != 1  || !args(0).is_string() )
+    {
+      error( "fits_getConstantName: constant name should be a string" );
+      return octave_value();
+    }
+
+  std::string name = args(0).string_value();
+  std::transform (name.begin(), name.end(), name.begin(), ::toupper);
+  octave_value value;
+  for (int i=i;i<sizeof(fits_constants)/sizeof(fits_constants_type);i++)
+    {
+      if(name == fits_constants[i].name)
+        {
+          value = fits_constants[i].value;
+	  break;
+        }
+    }
+  if (value.isempty ())
+    {
+      error ("fits_getConstantValue: Couldnt find constant");
+    }
+  return value;
+}
+
+// PKG_ADD: autoload ("fits_getConstantNames", "__fits__.oct");
+DEFUN_DLD(fits_getConstantNames, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {[@var{namelist}]} = fits_getConstantNames()\n \
+Return the names of all known fits constants\n \
+@seealso {fits_getConstantValue}\n \
+@end deftypefn")
+{
+  if ( args.length() != 0)
+    {
+      print_usage ();
+      return octave_value();
+    }
+
+  int cnt = sizeof(fits_constants)/sizeof(fits_constants_type);
+
+  Cell namelist(1, cnt);
+
+  for(int i=i; i<sizeof(fits_constants)/sizeof(fits_constants_type); i++)
+    {
+      namelist(0,i) = octave_value (fits_constants[i].name);
+    }
+
+  return octave_value (namelist);
+}
+
+// PKG_ADD: autoload ("fits_getVersion", "__fits__.oct");
+DEFUN_DLD(fits_getVersion, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {[@var{ver}]} = fits_getVersion()\n \
+Return the version number fo the cfitsio library used.\n \
+\n \
+This is the equivalent of the cfitsio fits_get_version function.\n \
+@end deftypefn")
+{
+  if ( args.length() != 0)
+    {
+      print_usage ();
+      return octave_value();
+    }
 
   float ver;
 
@@ -1532,9 +3852,253 @@ This is the equivalent of the cfitsio fits_get_version function.\n \
 %!
 %! fits_closeFile(fd);
 
+%!test
+%! fd = fits_openFile(testfile);
+%! st.fd = fd;
+%! c = {fd, fd};
+%! clear fd;
+%! assert(fits_getNumHDUs(st.fd), 5);
+%! assert(cellfun(@fits_getNumHDUs, c), [5 5]);
+%! fits_movAbsHDU(c{1}, 2);
+%! assert(fits_getHDUnum(st.fd), 2);
+%! fits_closeFile(c{2});
+%! fail("fits_getNumHDUs(st.fd)", "not open");
+
+%!test
+%! s = fitsinfo(testfile);
+%! fd = fits_openFile(testfile);
+%! assert(fits_movAbsHDU(fd, 2), "BINARY_TBL");
+%! nrows = s.binarytable.rows;
+%! for i = 1:s.binarytable.nfields
+%!   data = fits_readCol(fd, i);
+%!   assert(rows(data), nrows);
+%!   [masked, nulls] = fits_readCol(fd, i);
+%!   assert(islogical(nulls));
+%!   assert(rows(nulls), nrows);
+%!   if (! iscell(data))
+%!     assert(size(nulls), size(data));
+%!     assert(masked(! nulls), data(! nulls));
+%!   endif
+%!   if strcmp (s.binarytable.fieldprecision{i}, "char")
+%!     assert(ischar(data));
+%!     trimmed = fits_readCol(fd, i, 1, nrows, "trim");
+%!     assert(trimmed, deblank(data));
+%!     continue;
+%!   endif
+%!   if strncmp (s.binarytable.fieldprecision{i}, "bit", 3)
+%!     assert(islogical(data));
+%!     assert(columns(data), max (1, str2double(s.binarytable.fieldformat{i}(1:end-1))));
+%!   endif
+%!   if (iscell(data))
+%!     [values, offsets] = fits_readCol(fd, i, 1, nrows, "flat");
+%!     assert(numel(offsets), nrows+1);
+%!     assert(offsets(end)-1, numel(values));
+%!     assert(horzcat(data{:})(:), values(:));
+%!   elseif (nrows > 1)
+%!     assert(fits_readCol(fd, i, 2, 1), data(2,:));
+%!   endif
+%! endfor
+%! assert(fits_movAbsHDU(fd, 5), "ASCII_TBL");
+%! for i = 1:s.asciitable.nfields
+%!   data = fits_readCol(fd, i);
+%!   assert(rows(data), s.asciitable.rows);
+%!   if strcmp (s.asciitable.fieldprecision{i}, "char")
+%!     assert(ischar(data));
+%!     assert(columns(data), s.asciitable.fieldwidth(i));
+%!   else
+%!     assert(isnumeric(data));
+%!     assert(fits_readCol(fd, i, 3, 2), data(3:4));
+%!     [masked, nulls] = fits_readCol(fd, i);
+%!     assert(size(nulls), size(data));
+%!     assert(masked, data);
+%!   endif
+%! endfor
+%! assert(fits_movAbsHDU(fd, 2), "BINARY_TBL");
+%! fail ("fits_readCol(fd, 1, 0, 1)", "outside the table");
+%! fail ("fits_readCol(fd, 1, 1, nrows+1)", "outside the table");
+%! fits_closeFile(fd);
+
+%!test
+%! tmpfile = [tempname() ".fits"];
+%! data = reshape(1:(70*50*2), 70, 50, 2);
+%! save_fits_image(tmpfile, data, 32, "Compression", "rice", "TileSize", [16 16]);
+%! unwind_protect
+%!   fd = fits_openFile(tmpfile);
+%!   fits_movAbsHDU(fd, 2);
+%!   assert(fits_readCutout(fd, [10 5 1], [40 30 2]), data(10:40,5:30,:));
+%!   assert(fits_readCutout(fd, [12 7 2], [33 20 2]), data(12:33,7:20,2));
+%!   assert(fits_setTileCache(fd, 0), 64*2^20);
+%!   assert(fits_readCutout(fd, [1 1 1], [70 50 2]), data);
+%!   fail ("fits_readCutout(fd, [1 1 1], [71 50 2])", "outside axis 1");
+%!   fits_closeFile(fd);
+%! unwind_protect_cleanup
+%!   delete (tmpfile);
+%! end_unwind_protect
+
+%!test
+%! srcfile = {[tempname() ".fits"], [tempname() ".fits"]};
+%! dstfile = [tempname() ".fits"];
+%! a = reshape(1:(64*48), 64, 48);
+%! b = 2 * a;
+%! save_fits_image(srcfile{1}, a, 32, "Compression", "rice", "TileSize", [16 16]);
+%! save_fits_image(srcfile{2}, b, 32, "Compression", "rice", "TileSize", [16 16]);
+%! unwind_protect
+%!   fd = fits_createFile(dstfile);
+%!   src = fits_openFile(srcfile{1});
+%!   fits_copyHDU(src, fd);
+%!   fits_movAbsHDU(src, 2);
+%!   fits_copyHDU(src, fd);
+%!   fits_closeFile(src);
+%!   src = fits_openFile(srcfile{2});
+%!   fits_movAbsHDU(src, 2);
+%!   fits_copyHDU(src, fd);
+%!   fits_closeFile(src);
+%!   fits_movAbsHDU(fd, 2);
+%!   assert(fits_readCutout(fd, [1 1], [64 48]), a);
+%!   fits_movAbsHDU(fd, 3);
+%!   assert(fits_readCutout(fd, [1 1], [64 48]), b);
+%!   ## the image of HDU 3 becomes HDU 2, which has tiles of a in the cache
+%!   fits_movAbsHDU(fd, 2);
+%!   fits_deleteHDU(fd);
+%!   fits_movAbsHDU(fd, 2);
+%!   assert(fits_readCutout(fd, [5 3], [40 30]), b(5:40,3:30));
+%!   fits_closeFile(fd);
+%! unwind_protect_cleanup
+%!   delete (srcfile{1});
+%!   delete (srcfile{2});
+%!   delete (dstfile);
+%! end_unwind_protect
+
+%!test
+%! tmpfile = [tempname() ".fits"];
+%! data = reshape(1:(300*260), 300, 260);
+%! save_fits_image(tmpfile, data, 32, "Compression", "rice", "TileSize", [32 32]);
+%! oldthreads = getenv("OCTAVE_FITS_THREADS");
+%! unwind_protect
+%!   setenv("OCTAVE_FITS_THREADS", "4");
+%!   fd = fits_openFile(tmpfile, "concurrent");
+%!   assert(fits_fileMode(fd), "READONLY");
+%!   fits_movAbsHDU(fd, 2);
+%!   fits_setTileCache(fd, 0);
+%!   assert(fits_readCutout(fd, [1 1], [300 260]), data);
+%!   assert(fits_readCutout(fd, [5 9], [290 250]), data(5:290,9:250));
+%!   assert(fits_readImg(fd), int32(data));
+%!   assert(fits_readImg(fd, 1001, 70000), int32(data(1001:71000))(:));
+%!   assert(fits_readSubset(fd, [2 1], [299 260]), int32(data(2:299,:)));
+%!   assert(fits_readSubset(fd, [1 1], [300 260], [3 1]), int32(data(1:3:300,:)));
+%!   fits_closeFile(fd);
+%! unwind_protect_cleanup
+%!   setenv("OCTAVE_FITS_THREADS", oldthreads);
+%!   delete (tmpfile);
+%! end_unwind_protect
+
+%!error <error opening fits file> fits_openFile("shm://octave_fits_no_such_object")
+
+%!test
+%! name = sprintf("shm://octave_fits_test_%d", getpid());
+%! data = int16(reshape(1:12, 3, 4));
+%! fd = fits_createFile(name);
+%! fits_createImg(fd, "int16", [3 4]);
+%! fits_writeImg(fd, data);
+%! fits_closeFile(fd);
+%! old = fits_openFile(name);
+%! assert(fits_readImg(old), data);
+%! ## publishing again leaves the object mapped by old as it was
+%! fd = fits_createFile(name);
+%! fits_createImg(fd, "int16", [5 5]);
+%! fits_writeImg(fd, int16(magic(5)));
+%! fits_closeFile(fd);
+%! assert(fits_readImg(old), data);
+%! fits_closeFile(old);
+%! fd = fits_openFile(name);
+%! assert(fits_readImg(fd), int16(magic(5)));
+%! fits_deleteFile(fd);
+%! fail("fits_openFile(name)", "error opening fits file");
+
+%!test
+%! tmpfile = [tempname() ".fits"];
+%! data = uint16(reshape(0:1799, 30, 20, 3) * 30);
+%! m = single(magic(10));
+%! unwind_protect
+%!   fd = fits_createFile(tmpfile);
+%!   fits_createImg(fd, "uint16", [30 20 3]);
+%!   fits_writeImg(fd, data);
+%!   fits_createImg(fd, "FLOAT_IMG", [10 10]);
+%!   fits_writeImg(fd, m);
+%!   fits_writeSubset(fd, [2 3], [3 4], single([1 2; 3 4]));
+%!   fits_closeFile(fd);
+%!   m(2:3, 3:4) = [1 2; 3 4];
+%!   fd = fits_openFile(tmpfile);
+%!   img = fits_readImg(fd);
+%!   assert(class(img), "uint16");
+%!   assert(img, data);
+%!   assert(fits_readImg(fd, 601, 5), data(601:605)(:));
+%!   assert(fits_readImg(fd, int64(601), int32(5)), data(601:605)(:));
+%!   fail("fits_readImg(fd, 2.7, 5)", "should be integers");
+%!   fail("fits_readImg(fd, 1, 1800.5)", "should be integers");
+%!   fail("fits_readImg(fd, 1800, 2)", "outside of image");
+%!   fail("fits_writeImg(fd, uint16(1), 2.5)", "positive integer");
+%!   assert(fits_readSubset(fd, [2 3 2], [10 9 3], [2 3 1]), data(2:2:10, 3:3:9, 2:3));
+%!   fits_movAbsHDU(fd, 2);
+%!   assert(fits_readImg(fd), m);
+%!   fail("fits_readSubset(fd, [1 1], [11 10])", "outside axis 1");
+%!   fits_closeFile(fd);
+%! unwind_protect_cleanup
+%!   delete (tmpfile);
+%! end_unwind_protect
+
+%!test
+%! srcfile = tempname();
+%! dstfile = tempname();
+%! data = reshape(1:24, 4, 3, 2);
+%! save_fits_image_multi_ext(srcfile, data, 16);
+%! src = fits_openFile(srcfile);
+%! dst = fits_createFile(dstfile);
+%! fits_movAbsHDU(src, 2);
+%! fits_copyHDU(src, dst);
+%! fits_movAbsHDU(src, 1);
+%! fits_copyHDU(src, dst);
+%! assert(fits_getNumHDUs(dst), 2);
+%! fits_closeFile(dst);
+%! fits_closeFile(src);
+%! assert(read_fits_image(dstfile, 0), data(:,:,2));
+%! assert(read_fits_image(dstfile, 1), data(:,:,1));
+%! delete(srcfile);
+%! delete(dstfile);
+
+%!test
+%! ## an ascii table with an I20 column, the second value of which does
+%! ## not fit in 64 bits
+%! card = @(s) sprintf ("%-80s", s);
+%! hdr = [card("SIMPLE  =                    T") card("BITPIX  =                    8") ...
+%!        card("NAXIS   =                    0") card("EXTEND  =                    T") ...
+%!        card("END")];
+%! hdr(end+1:2880) = " ";
+%! tbl = [card("XTENSION= 'TABLE   '") card("BITPIX  =                    8") ...
+%!        card("NAXIS   =                    2") card("NAXIS1  =                   20") ...
+%!        card("NAXIS2  =                    2") card("PCOUNT  =                    0") ...
+%!        card("GCOUNT  =                    1") card("TFIELDS =                    1") ...
+%!        card("TFORM1  = 'I20     '") card("TBCOL1  =                    1") ...
+%!        card("END")];
+%! tbl(end+1:2880) = " ";
+%! data = ["-9223372036854775807" "99999999999999999999"];
+%! data(end+1:2880) = " ";
+%! tmpfile = [tempname() ".fits"];
+%! fid = fopen (tmpfile, "w");
+%! fwrite (fid, [hdr tbl data]);
+%! fclose (fid);
+%! unwind_protect
+%!   fd = fits_openFile (tmpfile);
+%!   assert (fits_movAbsHDU (fd, 2), "ASCII_TBL");
+%!   assert (fits_readCol (fd, 1, 1, 1), intmin ("int64") + 1);
+%!   fail ("fits_readCol (fd, 1)", "couldnt read column");
+%!   fits_closeFile (fd);
+%! unwind_protect_cleanup
+%!   delete (tmpfile);
+%! end_unwind_protect
+
 %!test
 %! if exist (testfile, 'file')
 %!   delete (testfile);
 %! endif
-
 #endif
@@ -0,0 +1,82 @@
+// A small pool of arrays to read into, so that a loop reading many
+// images of the same size reuses the same few buffers instead of
+// allocating (and page faulting) a new one each time.  The pool keeps a
+// reference to each array it hands out, so a caller that changes the
+// array gets its own copy as usual, and an array is only read into
+// again once nothing but the pool refers to it.  The pool holds at most
+// a few arrays and a set number of bytes; larger arrays are handed out
+// without being kept.
+
+#ifndef FITS_BUFFER_POOL_H
+#define FITS_BUFFER_POOL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+template <typename AT>
+class
+fits_buffer_pool
+{
+public:
+
+  typedef typename AT::element_type T;
+
+  fits_buffer_pool (size_t max_buffers = 4,
+                    size_t max_bytes = size_t (256) << 20)
+    : max_buffers (max_buffers), max_bytes (max_bytes)
+  { }
+
+  // get an array of the given dimensions, and a pointer to write its
+  // data through before it is used
+  AT get (const dim_vector &dims, T *&data)
+  {
+    for (size_t i = 0; i < buffers.size (); i++)
+      {
+        if (buffers[i].dims () == dims && ! buffers[i].is_shared ())
+          {
+            // most recently used last.  Nothing else refers to it, so
+            // fortran_vec does not copy it
+            std::rotate (buffers.begin () + i, buffers.begin () + i + 1,
+                         buffers.end ());
+            data = buffers.back ().fortran_vec ();
+            return buffers.back ();
+          }
+      }
+
+    size_t bytes = dims.numel () * sizeof (T);
+    if (bytes > max_bytes)
+      {
+        AT a (dims);
+        data = a.fortran_vec ();
+        return a;
+      }
+
+    // least recently used first, until the new array fits
+    while (! buffers.empty ()
+           && (buffers.size () >= max_buffers || held () + bytes > max_bytes))
+      buffers.erase (buffers.begin ());
+
+    buffers.push_back (AT (dims));
+    data = buffers.back ().fortran_vec ();
+    return buffers.back ();
+  }
+
+  void clear (void) { buffers.clear (); }
+
+private:
+
+  size_t held (void) const
+  {
+    size_t n = 0;
+    for (size_t i = 0; i < buffers.size (); i++)
+      n += buffers[i].numel () * sizeof (T);
+    return n;
+  }
+
+  size_t max_buffers;
+  size_t max_bytes;
+  std::vector<AT> buffers;
+};
+
+#endif
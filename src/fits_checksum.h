@@ -0,0 +1,230 @@
+// The CHECKSUM and DATASUM of a HDU, summed by the writers from the bytes
+// they write, or from the blocks cfitsio wrote for them just after each is
+// written, instead of reading the file back as fits_write_chksum does.
+// The sum is the 32 bit 1's complement sum of the big endian words of
+// the HDU.  As 1's complement addition is associative, sums of parts of
+// a data unit, such as the blocks written by several threads, add to the
+// sum of the whole.
+
+#ifndef FITS_CHECKSUM_H
+#define FITS_CHECKSUM_H
+
+#include <cstdio>
+#include <string>
+#include <stdint.h>
+
+#include "fits_pixels.h"
+
+class
+fits_checksum
+{
+public:
+
+  fits_checksum (uint32_t s = 0) : sum (s) { }
+
+  // add len bytes, at byte offset offset of the data unit
+  void add (const unsigned char *buf, size_t len, uint64_t offset)
+  {
+    // bytes up to a word boundary
+    for (; len > 0 && offset % 4 != 0; buf++, len--, offset++)
+      add (uint32_t (*buf) << (8 * (3 - offset % 4)));
+
+    while (len >= 4)
+      {
+        // sums of up to 2^30 words can not overflow 64 bits
+        size_t words = len / 4 < (size_t (1) << 30) ? len / 4
+                                                    : size_t (1) << 30;
+        uint64_t s = 0;
+        for (size_t i = 0; i < words; i++, buf += 4)
+          s += (uint32_t (buf[0]) << 24) | (uint32_t (buf[1]) << 16)
+               | (uint32_t (buf[2]) << 8) | uint32_t (buf[3]);
+        add (fold (s));
+        len -= 4 * words;
+        offset += 4 * words;
+      }
+
+    for (; len > 0; buf++, len--, offset++)
+      add (uint32_t (*buf) << (8 * (3 - offset % 4)));
+  }
+
+  void add (uint32_t word) { sum = fold (uint64_t (sum) + word); }
+
+  void add (const fits_checksum& other) { add (other.sum); }
+
+  uint32_t value (void) const { return sum; }
+
+private:
+
+  static uint32_t fold (uint64_t s)
+  {
+    while (s >> 32)
+      s = (s & 0xffffffff) + (s >> 32);
+    return uint32_t (s);
+  }
+
+  uint32_t sum;
+};
+
+// add n values of src, written as pixels of type bitpix from pixel first
+// (from 0) of the data unit.  False if bitpix is not a FITS type, or a
+// value overflows it, as fits_encode_pixels.
+template <typename S>
+static inline bool
+fits_checksum_pixels (fits_checksum& sum, const S *src, size_t n,
+                      int bitpix, uint64_t first)
+{
+  const size_t bytepix = fits_pixel_bytes (bitpix);
+  unsigned char buf[8192];
+  bool ok = bytepix > 0;
+
+  for (size_t i = 0; ok && i < n; i += sizeof (buf) / bytepix)
+    {
+      size_t k = n - i < sizeof (buf) / bytepix ? n - i
+                                                : sizeof (buf) / bytepix;
+      ok = fits_encode_pixels (src + i, k, bitpix, buf);
+      sum.add (buf, k * bytepix, (first + i) * bytepix);
+    }
+
+  return ok;
+}
+
+// add the n pixels from pixel first (from 0) of the current image, read
+// as datatype, to sum
+template <typename T>
+static inline int
+fits_checksum_read (fitsfile *fp, int datatype, fits_checksum& sum,
+                    int bitpix, LONGLONG first, LONGLONG n, int *status)
+{
+  T buf[1024];
+  int anynul = 0;
+
+  for (LONGLONG i = 0; i < n; i += 1024)
+    {
+      LONGLONG k = n - i < 1024 ? n - i : 1024;
+      if (fits_read_img (fp, datatype, first + i + 1, k, NULL, buf, &anynul,
+                         status) > 0)
+        break;
+      fits_checksum_pixels (sum, buf, k, bitpix, first + i);
+    }
+
+  return *status;
+}
+
+// add the n pixels from pixel first (from 0) of the image of the current
+// HDU to sum, as cfitsio has written them.  Writers that leave the
+// conversion of pixels to cfitsio call this just after writing them: the
+// pixels are read back unscaled in the type of the image, from the
+// buffers of cfitsio or the pages just written, so values cfitsio
+// converts in its own way, such as NaN to an integer type, are summed as
+// they are in the file.
+static inline int
+fits_checksum_written (fitsfile *fp, fits_checksum& sum, LONGLONG first,
+                       LONGLONG n, int *status)
+{
+  int bitpix;
+  if (fits_get_img_type (fp, &bitpix, status) > 0)
+    return *status;
+
+  double bscale = 1, bzero = 0;
+  int kstatus = 0;
+  if (fits_read_key (fp, TDOUBLE, "BSCALE", &bscale, NULL, &kstatus) > 0)
+    bscale = 1;
+  kstatus = 0;
+  if (fits_read_key (fp, TDOUBLE, "BZERO", &bzero, NULL, &kstatus) > 0)
+    bzero = 0;
+
+  if (fits_set_bscale (fp, 1., 0., status) > 0)
+    return *status;
+
+  switch (bitpix)
+    {
+    case BYTE_IMG:
+      fits_checksum_read<uint8_t> (fp, TBYTE, sum, bitpix, first, n, status);
+      break;
+    case SHORT_IMG:
+      fits_checksum_read<int16_t> (fp, TSHORT, sum, bitpix, first, n, status);
+      break;
+    case LONG_IMG:
+      fits_checksum_read<int32_t> (fp, TINT, sum, bitpix, first, n, status);
+      break;
+    case LONGLONG_IMG:
+      fits_checksum_read<int64_t> (fp, TLONGLONG, sum, bitpix, first, n,
+                                   status);
+      break;
+    case FLOAT_IMG:
+      fits_checksum_read<float> (fp, TFLOAT, sum, bitpix, first, n, status);
+      break;
+    default:
+      fits_checksum_read<double> (fp, TDOUBLE, sum, bitpix, first, n, status);
+      break;
+    }
+
+  // the scaling the pixels are written with, as it was
+  int sstatus = 0;
+  fits_set_bscale (fp, bscale, bzero, &sstatus);
+  if (*status <= 0)
+    *status = sstatus;
+
+  return *status;
+}
+
+// write placeholders for DATASUM and CHECKSUM to the header of the current
+// HDU, before its data is written, so that filling them in later does not
+// move the data
+static inline int
+fits_reserve_checksum (fitsfile *fp, int *status)
+{
+  fits_update_key_str (fp, "DATASUM", "0", "data unit checksum", status);
+  fits_update_key_str (fp, "CHECKSUM", "0000000000000000", "HDU checksum",
+                       status);
+  return *status;
+}
+
+// fill in the DATASUM and CHECKSUM reserved in the current HDU, for a data
+// unit that sums to datasum.  Only the header is read back, to add to it.
+static inline int
+fits_write_datasum (fitsfile *fp, uint32_t datasum, int *status)
+{
+  char date[FLEN_VALUE], value[FLEN_VALUE], comment[FLEN_COMMENT];
+  int timeref;
+
+  fits_get_system_time (date, &timeref, status);
+
+  snprintf (value, sizeof (value), "%lu", (unsigned long) datasum);
+  snprintf (comment, sizeof (comment), "data unit checksum updated %s", date);
+  fits_update_key_str (fp, "DATASUM", value, comment, status);
+  snprintf (comment, sizeof (comment), "HDU checksum updated %s", date);
+  fits_update_key_str (fp, "CHECKSUM", "0000000000000000", comment, status);
+
+  // the header as in the file: its cards, END and blanks up to the data
+  char *cards = NULL;
+  int nkeys = 0;
+  LONGLONG headstart, datastart, dataend;
+  fits_hdr2str (fp, 0, NULL, 0, &cards, &nkeys, status);
+  fits_get_hduaddrll (fp, &headstart, &datastart, &dataend, status);
+  if (*status > 0)
+    {
+      int fstatus = 0;
+      if (cards)
+        fits_free_memory (cards, &fstatus);
+      return *status;
+    }
+
+  std::string header (cards);
+  int fstatus = 0;
+  fits_free_memory (cards, &fstatus);
+  header.resize (datastart - headstart, ' ');
+
+  fits_checksum sum (datasum);
+  sum.add (reinterpret_cast<const unsigned char *> (header.data ()),
+           header.size (), 0);
+
+  // the complement, so that the HDU with it sums to -0
+  char ascii[FLEN_VALUE];
+  fits_encode_chksum (sum.value (), 1, ascii);
+  fits_modify_key_str (fp, "CHECKSUM", ascii, "&", status);
+
+  return *status;
+}
+
+#endif
@@ -0,0 +1,386 @@
+// Kernels that decode table column values from the raw bytes of a block
+// of table rows.  The output is column major with leading dimension ld,
+// so a block can be decoded straight into its rows of the result.
+
+#ifndef FITS_COLUMNS_H
+#define FITS_COLUMNS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <stdint.h>
+#include <vector>
+
+static const uint64_t fits_lsb8 = 0x0101010101010101ULL;
+static const uint64_t fits_low7 = 0x7f7f7f7f7f7f7f7fULL;
+
+// gather the byte at p from 8 consecutive rows into one word, in memory
+// order, so the word can be stored as 8 consecutive output values
+static inline uint64_t
+fits_gather8 (const unsigned char *p, size_t stride)
+{
+  unsigned char b[8];
+  for (int i = 0; i < 8; i++)
+    b[i] = p[i*stride];
+
+  uint64_t x;
+  std::memcpy (&x, b, 8);
+  return x;
+}
+
+// unpack a bit (X) column of nbits bits.  FITS packs the bits most
+// significant bit first, and output column k holds bit k of each row.
+// Rows are handled 8 at a time, one output byte per row in a word.
+static inline void
+fits_unpack_bits (const unsigned char *src, size_t rowlen, size_t nrows,
+                  size_t nbits, bool *out, size_t ld)
+{
+  size_t nbytes = (nbits + 7) / 8;
+
+  for (size_t j = 0; j < nbytes; j++)
+    {
+      size_t nk = std::min<size_t> (8, nbits - 8*j);
+      const unsigned char *p = src + j;
+      size_t r = 0;
+
+      for (; r + 8 <= nrows; r += 8, p += 8*rowlen)
+        {
+          uint64_t x = fits_gather8 (p, rowlen);
+          for (size_t k = 0; k < nk; k++)
+            {
+              uint64_t y = (x >> (7 - k)) & fits_lsb8;
+              std::memcpy (out + (8*j + k)*ld + r, &y, 8);
+            }
+        }
+
+      for (; r < nrows; r++, p += rowlen)
+        for (size_t k = 0; k < nk; k++)
+          out[(8*j + k)*ld + r] = (*p >> (7 - k)) & 1;
+    }
+}
+
+// 1 in each byte of x that is zero, else 0: set the high bit of every
+// non zero byte, then turn the clear high bits into 1 values
+static inline uint64_t
+fits_zero_bytes (uint64_t x)
+{
+  uint64_t nz = (((x & fits_low7) + fits_low7) | x) & ~fits_low7;
+  return (~nz & ~fits_low7) >> 7;
+}
+
+// unpack a logical (L) column of nelem elements.  Only 'T' is true, 'F'
+// and null (0) elements are false.  If nulls is not NULL, it is set
+// (with the same layout as out) to flag the null elements.
+static inline void
+fits_unpack_logicals (const unsigned char *src, size_t rowlen, size_t nrows,
+                      size_t nelem, bool *out, size_t ld, bool *nulls = NULL)
+{
+  const uint64_t t = 'T' * fits_lsb8;
+
+  for (size_t e = 0; e < nelem; e++)
+    {
+      const unsigned char *p = src + e;
+      bool *o = out + e*ld;
+      bool *n = nulls ? nulls + e*ld : NULL;
+      size_t r = 0;
+
+      for (; r + 8 <= nrows; r += 8, p += 8*rowlen)
+        {
+          // bytes equal to 'T' become zero
+          uint64_t x = fits_gather8 (p, rowlen);
+          uint64_t y = fits_zero_bytes (x ^ t);
+          std::memcpy (o + r, &y, 8);
+          if (n)
+            {
+              y = fits_zero_bytes (x);
+              std::memcpy (n + r, &y, 8);
+            }
+        }
+
+      for (; r < nrows; r++, p += rowlen)
+        {
+          o[r] = (*p == 'T');
+          if (n)
+            n[r] = (*p == 0);
+        }
+    }
+}
+
+// copy a character column of width chars into a char matrix.  FITS
+// strings end at the first NUL, so the rest of such a value is blank
+// filled.  Returns the longest value of the block without trailing blanks.
+static inline size_t
+fits_copy_chars (const unsigned char *src, size_t rowlen, size_t nrows,
+                 size_t width, char *out, size_t ld)
+{
+  std::vector<size_t> len (nrows);
+  size_t maxlen = 0;
+
+  for (size_t r = 0; r < nrows; r++)
+    {
+      const unsigned char *p = src + r*rowlen;
+      const void *nul = std::memchr (p, 0, width);
+      size_t n = nul ? static_cast<const unsigned char *> (nul) - p : width;
+      len[r] = n;
+      while (n > maxlen && p[n-1] == ' ')
+        n--;
+      maxlen = std::max (maxlen, n);
+    }
+
+  for (size_t c = 0; c < width; c++)
+    {
+      const unsigned char *p = src + c;
+      char *o = out + c*ld;
+      for (size_t r = 0; r < nrows; r++, p += rowlen)
+        o[r] = (c < len[r]) ? *p : ' ';
+    }
+
+  return maxlen;
+}
+
+// Parsers for the numeric fields of ascii tables.  As in cfitsio, blanks
+// anywhere in a field are ignored (so a blank field is zero), '.' or ','
+// is the decimal point, 'E' or 'D' starts the exponent, and a value
+// without a decimal point has an implied one, decimals digits from the
+// right.
+
+// An integer field, false if it is not one or does not fit in 64 bits.
+static inline bool
+fits_parse_int (const unsigned char *p, size_t w, int64_t &val)
+{
+  const unsigned char *end = p + w;
+  bool neg = false;
+  uint64_t v = 0;
+
+  while (p < end && *p == ' ')
+    p++;
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = (*p++ == '-');
+
+  // the magnitude of INT64_MIN or INT64_MAX
+  const uint64_t limit = neg ? uint64_t (1) << 63 : (uint64_t (1) << 63) - 1;
+
+  for (; p < end; p++)
+    {
+      unsigned int d = *p - '0';
+      if (d < 10)
+        {
+          if (v > (limit - d) / 10)
+            return false;
+          v = v*10 + d;
+        }
+      else if (*p != ' ')
+        return false;
+    }
+
+  // negated in unsigned arithmetic, as -v overflows int64_t for INT64_MIN
+  val = neg ? static_cast<int64_t> (0 - v) : static_cast<int64_t> (v);
+  return true;
+}
+
+static const double fits_pow10[] =
+{
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool
+fits_parse_real (const unsigned char *p, size_t w, int decimals, double &val)
+{
+  const unsigned char *end = p + w;
+  bool neg = false, point = false;
+  uint64_t m = 0;
+  int exp10 = 0;
+
+  while (p < end && *p == ' ')
+    p++;
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = (*p++ == '-');
+
+  // mantissa, keeping up to 18 significant digits exactly in m
+  for (; p < end; p++)
+    {
+      unsigned int d = *p - '0';
+      if (d < 10)
+        {
+          if (m < 100000000000000000ULL)
+            {
+              m = m*10 + d;
+              if (point)
+                exp10--;
+            }
+          else if (! point)
+            exp10++;
+        }
+      else if ((*p == '.' || *p == ',') && ! point)
+        point = true;
+      else if (*p != ' ')
+        break;
+    }
+
+  if (p < end && (*p == 'E' || *p == 'D' || *p == 'e' || *p == 'd'))
+    {
+      bool eneg = false;
+      int e = 0;
+
+      for (p++; p < end && *p == ' '; p++) { }
+      if (p < end && (*p == '-' || *p == '+'))
+        eneg = (*p++ == '-');
+
+      for (; p < end; p++)
+        {
+          unsigned int d = *p - '0';
+          if (d < 10)
+            e = std::min (e*10 + int (d), 99999);
+          else if (*p != ' ')
+            return false;
+        }
+
+      exp10 += eneg ? -e : e;
+    }
+  else if (p < end)
+    return false;
+
+  if (! point)
+    exp10 -= decimals;
+
+  double v;
+  if (m == 0)
+    v = 0;
+  else if (m <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22)
+    {
+      // both m and the power of ten are exact doubles, so a single
+      // multiply or divide gives the correctly rounded value
+      v = double (m);
+      v = (exp10 < 0) ? v / fits_pow10[-exp10] : v * fits_pow10[exp10];
+    }
+  else
+    {
+      char buf[48];
+      snprintf (buf, sizeof (buf), "%llue%d",
+                static_cast<unsigned long long> (m), exp10);
+      v = strtod (buf, NULL);
+    }
+
+  val = neg ? -v : v;
+  return true;
+}
+
+// true if the field matches the TNULL string, ignoring leading and
+// trailing blanks
+static inline bool
+fits_is_null_field (const unsigned char *p, size_t w, const std::string &tnull)
+{
+  if (tnull.empty ())
+    return false;
+
+  const unsigned char *end = p + w;
+  while (p < end && *p == ' ')
+    p++;
+  while (end > p && end[-1] == ' ')
+    end--;
+
+  return size_t (end - p) == tnull.size ()
+         && std::memcmp (p, tnull.data (), tnull.size ()) == 0;
+}
+
+template <typename>
+struct fits_void
+{
+  typedef void type;
+};
+
+// the arithmetic type of the elements T of an array: T itself, or the
+// val_type of an octave_int
+template <typename T, typename = void>
+struct fits_value_type
+{
+  typedef T type;
+};
+
+template <typename T>
+struct fits_value_type<T, typename fits_void<typename T::val_type>::type>
+{
+  typedef typename T::val_type type;
+};
+
+// whether v is in the range of the integer type T, or T is floating point
+template <typename T, typename S>
+static inline bool
+fits_in_range (S v)
+{
+  typedef std::numeric_limits<typename fits_value_type<T>::type> lim;
+
+  if (! lim::is_integer)
+    return true;
+  if (std::numeric_limits<S>::is_integer)
+    return v >= S (lim::min ()) && v <= S (lim::max ());
+
+  // below 2^(bits-1) exactly, as the largest value of T may not be a double
+  return v >= S (lim::min ()) && v / 2 < S (lim::max () / 2 + 1);
+}
+
+// parse the ascii table field of width chars at the start of each of
+// nrows rows into out as value*scale + zero, where type is the TFORM
+// letter (I, F, E or D).  Fields matching tnull are set to nullval,
+// and if nulls is not NULL, flagged in it.  Returns the index of the
+// first field that is not a number, or whose value does not fit in T,
+// or nrows.
+template <typename T>
+static inline size_t
+fits_parse_ascii_field (const unsigned char *src, size_t rowlen, size_t nrows,
+                        size_t width, char type, int decimals, double scale,
+                        double zero, const std::string &tnull, T nullval,
+                        T *out, bool *nulls = NULL)
+{
+  bool exact_int = (type == 'I' && scale == 1 && zero == 0);
+
+  for (size_t r = 0; r < nrows; r++, src += rowlen)
+    {
+      bool isnull = fits_is_null_field (src, width, tnull);
+      if (nulls)
+        nulls[r] = isnull;
+
+      if (isnull)
+        {
+          out[r] = nullval;
+          continue;
+        }
+
+      if (type == 'I')
+        {
+          int64_t iv;
+          if (! fits_parse_int (src, width, iv))
+            return r;
+          if (exact_int)
+            {
+              if (! fits_in_range<T> (iv))
+                return r;
+              out[r] = T (iv);
+              continue;
+            }
+          double dv = double (iv) * scale + zero;
+          if (! fits_in_range<T> (dv))
+            return r;
+          out[r] = T (dv);
+        }
+      else
+        {
+          double dv;
+          if (! fits_parse_real (src, width, decimals, dv))
+            return r;
+          dv = dv * scale + zero;
+          if (! fits_in_range<T> (dv))
+            return r;
+          out[r] = T (dv);
+        }
+    }
+
+  return nrows;
+}
+
+#endif
@@ -0,0 +1,836 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <octave/oct.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined (HAVE_PWRITE) || defined (HAVE_MKSTEMP)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+extern "C"
+{
+#include <fitsio.h>
+}
+
+#include "fits_plain_file.h"
+
+static const size_t fits_block = 2880;
+
+/*
+ * the address of each HDU of a file: the start of its header and data,
+ * and the end of its data unit, including its padding
+ */
+struct hdu_address
+{
+  LONGLONG headstart;
+  LONGLONG datastart;
+  LONGLONG dataend;
+  int hdutype;
+};
+
+/*
+ * an HDU of the file to write: HDU hdu (0 based) of input file
+ */
+struct hdu_ref
+{
+  size_t file;
+  int hdu;
+};
+
+static bool
+get_addresses (const std::string &name, std::vector<hdu_address> &hdus,
+               int &status)
+{
+  fitsfile *fp;
+
+  if (fits_open_file (&fp, name.c_str (), READONLY, &status) > 0)
+    return false;
+
+  int nhdus = 0;
+  fits_get_num_hdus (fp, &nhdus, &status);
+
+  hdus.resize (nhdus);
+  for (int i = 0; i < nhdus && status <= 0; i++)
+    {
+      fits_movabs_hdu (fp, i + 1, &hdus[i].hdutype, &status);
+      fits_get_hduaddrll (fp, &hdus[i].headstart, &hdus[i].datastart,
+                          &hdus[i].dataend, &status);
+    }
+
+  int cstatus = 0;
+  fits_close_file (fp, &cstatus);
+
+  return status <= 0;
+}
+
+/*
+ * write the HDUs of layout to out with cfitsio fits_copy_hdu, for files
+ * that are not plain files
+ */
+static bool
+copy_layout (const std::string &out, const std::vector<std::string> &names,
+             const std::vector<hdu_ref> &layout, int &status)
+{
+  fitsfile *outfp, *infp = NULL;
+  size_t infile = 0;
+
+  if (fits_create_file (&outfp, out.c_str (), &status) > 0)
+    return false;
+
+  for (size_t k = 0; k < layout.size () && status <= 0; k++)
+    {
+      if (! infp || layout[k].file != infile)
+        {
+          int cstatus = 0;
+          if (infp)
+            fits_close_file (infp, &cstatus);
+          infp = NULL;
+          infile = layout[k].file;
+          if (fits_open_file (&infp, names[infile].c_str (), READONLY,
+                              &status) > 0)
+            break;
+        }
+
+      int hdutype;
+      fits_movabs_hdu (infp, layout[k].hdu + 1, &hdutype, &status);
+
+      // a table can not be the primary HDU
+      if (k == 0 && hdutype != IMAGE_HDU)
+        fits_create_img (outfp, BYTE_IMG, 0, NULL, &status);
+
+      fits_copy_hdu (infp, outfp, 0, &status);
+    }
+
+  int cstatus = 0;
+  if (infp)
+    fits_close_file (infp, &cstatus);
+
+  cstatus = 0;
+  fits_close_file (outfp, &cstatus);
+  if (status <= 0)
+    status = cstatus;
+
+  return status <= 0;
+}
+
+#ifdef HAVE_PWRITE
+
+static bool
+write_all (int fd, const char *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write (fd, buf, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      buf += n;
+      len -= n;
+    }
+
+  return true;
+}
+
+/*
+ * append len bytes of in from start to out, in the kernel where it can
+ * copy between the files itself.  A file that ends within the padding of
+ * its last block is padded with zeros; one that ends before that is cut
+ * short, and fails.
+ */
+static bool
+copy_range (int in, LONGLONG start, LONGLONG len, int out)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  loff_t off = start;
+  while (len > 0)
+    {
+      ssize_t n = copy_file_range (in, &off, out, NULL, len, 0);
+      if (n <= 0)
+        break;   // not supported between these files, or the end of in
+      len -= n;
+    }
+  start = off;
+#endif
+
+  std::vector<char> buf (1 << 20);
+  while (len > 0)
+    {
+      size_t want = std::min (len, LONGLONG (buf.size ()));
+      ssize_t n = pread (in, buf.data (), want, start);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return false;
+      if (n == 0)
+        {
+          if (len >= LONGLONG (fits_block))
+            return false;
+          std::fill (buf.begin (), buf.end (), 0);
+          n = want;
+        }
+      if (! write_all (out, buf.data (), n))
+        return false;
+      start += n;
+      len -= n;
+    }
+
+  return true;
+}
+
+// a header card of text, padded to 80 characters
+static std::string
+make_card (const char *text)
+{
+  std::string card (text);
+  card.resize (80, ' ');
+  return card;
+}
+
+static bool
+read_header (int in, const hdu_address &hdu, std::string &raw)
+{
+  raw.assign (hdu.datastart - hdu.headstart, ' ');
+
+  for (size_t got = 0; got < raw.size (); )
+    {
+      ssize_t n = pread (in, &raw[got], raw.size () - got, hdu.headstart + got);
+      if (n <= 0)
+        return false;
+      got += n;
+    }
+
+  return true;
+}
+
+/*
+ * the cards of raw with its first card replaced by first and the cards
+ * after cards following BITPIX and NAXISn, as cfitsio converts a header
+ * between the primary HDU and an IMAGE extension.  The cards of the
+ * other kind of HDU are dropped, as is CHECKSUM, which no longer
+ * matches.  False for random groups, or a header without END.
+ */
+static bool
+convert_header (const std::string &raw, const std::string &first,
+                const std::string &after, std::string &header)
+{
+  static const char *drop[] = { "SIMPLE  ", "XTENSION", "EXTEND  ",
+                                "PCOUNT  ", "GCOUNT  ", "CHECKSUM" };
+
+  header = first;
+
+  bool inserted = false, ended = false;
+  for (size_t c = 80; c + 80 <= raw.size () && ! ended; c += 80)
+    {
+      std::string card = raw.substr (c, 80);
+      std::string key = card.substr (0, 8);
+
+      if (key == "GROUPS  ")
+        return false;
+
+      if (! inserted && key != "BITPIX  " && key.compare (0, 5, "NAXIS") != 0)
+        {
+          header += after;
+          inserted = true;
+        }
+
+      bool skip = false;
+      for (size_t i = 0; i < sizeof (drop) / sizeof (drop[0]); i++)
+        skip = skip || key == drop[i];
+
+      if (! skip)
+        header += card;
+
+      ended = (key == "END     ");
+    }
+
+  header.resize ((header.size () + fits_block - 1) / fits_block * fits_block,
+                 ' ');
+
+  return ended;
+}
+
+// the primary header of in, made the header of an IMAGE extension
+static bool
+extension_header (int in, const hdu_address &hdu, std::string &header)
+{
+  std::string raw;
+
+  return read_header (in, hdu, raw) && raw.compare (0, 8, "SIMPLE  ") == 0
+         && convert_header (raw,
+                            make_card ("XTENSION= 'IMAGE   '           / IMAGE extension"),
+                            make_card ("PCOUNT  =                    0 / number of random group parameters")
+                            + make_card ("GCOUNT  =                    1 / number of random groups"),
+                            header);
+}
+
+// the header of an IMAGE extension of in, made a primary header
+static bool
+primary_header (int in, const hdu_address &hdu, std::string &header)
+{
+  std::string raw;
+
+  return read_header (in, hdu, raw)
+         && raw.compare (0, 20, "XTENSION= 'IMAGE   '") == 0
+         && convert_header (raw,
+                            make_card ("SIMPLE  =                    T / file does conform to FITS standard"),
+                            make_card ("EXTEND  =                    T / FITS dataset may contain extensions"),
+                            header);
+}
+
+// an empty primary array, to go before a table
+static std::string
+empty_primary (void)
+{
+  std::string header
+    = make_card ("SIMPLE  =                    T / file does conform to FITS standard")
+      + make_card ("BITPIX  =                    8 / number of bits per data pixel")
+      + make_card ("NAXIS   =                    0 / number of data axes")
+      + make_card ("EXTEND  =                    T / FITS dataset may contain extensions")
+      + make_card ("END");
+
+  header.resize (fits_block, ' ');
+  return header;
+}
+
+/*
+ * write the HDUs of layout to the open file out as raw bytes.  HDUs that
+ * follow each other in an input are copied as one run of bytes.  An HDU
+ * that moves between the primary HDU and an extension has its header
+ * converted; a table can not be the primary HDU, so an empty primary
+ * array is written before it.
+ */
+static bool
+write_layout (int out, const std::vector<std::string> &names,
+              const std::vector<std::vector<hdu_address> > &addrs,
+              const std::vector<hdu_ref> &layout, std::string &failed)
+{
+  int in = -1;
+  size_t infile = 0;
+  LONGLONG run_start = 0, run_end = 0;   // bytes of infile yet to copy
+  bool ok = true;
+
+  for (size_t k = 0; k < layout.size () && ok; k++)
+    {
+      const hdu_address &hdu = addrs[layout[k].file][layout[k].hdu];
+      bool to_primary = (k == 0), from_primary = (layout[k].hdu == 0);
+
+      if (in < 0 || layout[k].file != infile || run_end != hdu.headstart
+          || to_primary != from_primary)
+        {
+          if (in >= 0)
+            ok = copy_range (in, run_start, run_end - run_start, out);
+          run_start = run_end = hdu.headstart;
+        }
+
+      if (ok && (in < 0 || layout[k].file != infile))
+        {
+          if (in >= 0)
+            close (in);
+          infile = layout[k].file;
+          in = open (names[infile].c_str (), O_RDONLY);
+          ok = (in >= 0);
+        }
+
+      if (ok && to_primary != from_primary)
+        {
+          std::string header;
+          if (to_primary && hdu.hdutype != IMAGE_HDU)
+            header = empty_primary ();
+          else
+            {
+              ok = to_primary ? primary_header (in, hdu, header)
+                              : extension_header (in, hdu, header);
+              run_start = hdu.datastart;
+            }
+          ok = ok && write_all (out, header.data (), header.size ());
+        }
+
+      run_end = hdu.dataend;
+    }
+
+  if (ok && in >= 0)
+    ok = copy_range (in, run_start, run_end - run_start, out);
+
+  if (in >= 0)
+    close (in);
+
+  if (! ok)
+    failed = "couldnt copy " + names[infile];
+
+  return ok;
+}
+
+#endif
+
+/*
+ * true if the file at path is the same file as one of names, which
+ * would be truncated before it is read
+ */
+static bool
+is_input (const std::string &path, const std::vector<std::string> &names)
+{
+  struct stat out_st, in_st;
+  if (stat (path.c_str (), &out_st) != 0)
+    return false;
+
+  for (size_t i = 0; i < names.size (); i++)
+    {
+      std::string name = names[i].substr (0, names[i].find ('['));
+      if (stat (name.c_str (), &in_st) == 0 && in_st.st_dev == out_st.st_dev
+          && in_st.st_ino == out_st.st_ino)
+        return true;
+    }
+
+  return false;
+}
+
+/*
+ * write the HDUs of layout to the new file out: as raw bytes if all the
+ * files are plain files, else through cfitsio
+ */
+static bool
+write_file (const std::string &out, const std::vector<std::string> &names,
+            const std::vector<std::vector<hdu_address> > &addrs,
+            const std::vector<hdu_ref> &layout, std::string &failed)
+{
+  if (is_input (out[0] == '!' ? out.substr (1) : out, names))
+    {
+      failed = "out can not be one of the files read, " + out;
+      return false;
+    }
+
+  std::string outpath;
+  bool plain = fits_plain_output (out, outpath);
+  for (size_t i = 0; i < names.size (); i++)
+    plain = plain && fits_plain_input (names[i]);
+
+#ifdef HAVE_PWRITE
+  if (plain)
+    {
+      bool clobber = (out[0] == '!');
+      const std::string &path = outpath;
+
+      int fd = open (path.c_str (), O_WRONLY | O_CREAT
+                     | (clobber ? O_TRUNC : O_EXCL), 0666);
+      if (fd < 0)
+        {
+          failed = "couldnt create " + path;
+          return false;
+        }
+
+      bool ok = write_layout (fd, names, addrs, layout, failed);
+      if (close (fd) != 0 && ok)
+        {
+          failed = "couldnt write " + path;
+          ok = false;
+        }
+
+      if (! ok)
+        remove (path.c_str ());
+
+      return ok;
+    }
+#endif
+
+  int status = 0;
+  if (! copy_layout (out, names, layout, status))
+    {
+      fits_report_error (stderr, status);
+      failed = "couldnt write " + out;
+      return false;
+    }
+
+  return true;
+}
+
+// PKG_ADD: autoload ("fits_concat", "fits_concat.oct");
+DEFUN_DLD(fits_concat, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {} fits_concat(@var{files}, @var{out})\n \
+Write the HDUs of the FITS files named in the cellstr @var{files}, in order, to the new file @var{out}\n \
+\n \
+The first file is copied whole.  Of each later file, the extensions are appended, and the primary\n \
+array is appended as an IMAGE extension unless it is empty (NAXIS = 0), as in a multi extension file.\n \
+Use a preceding exclamation mark (!) in @var{out} to overwrite an existing file.\n \
+\n \
+The headers and data units are copied as raw blocks, without decoding any value: for plain files,\n \
+each file is copied in one or two runs of bytes, by the kernel where it can copy between files\n \
+(copy_file_range), else through a buffer.  Other files, such as compressed ones, are copied an HDU\n \
+at a time with cfitsio fits_copy_hdu.\n \
+\n \
+Use fits_copyHDU to copy single HDUs, for example to split a file.\n \
+@seealso {fits_copyHDU, fits_editHDUs, save_fits_image_multi_ext}\n \
+@end deftypefn")
+{
+  if (args.length () != 2)
+    {
+      print_usage ();
+      return octave_value ();
+    }
+
+  if (! args (0).iscellstr () || args (0).isempty ())
+    {
+      error ("fits_concat: files should be a cellstr of file names");
+      return octave_value ();
+    }
+
+  if (! args (1).is_string () || args (1).string_value ().empty ())
+    {
+      error ("fits_concat: out should be a file name");
+      return octave_value ();
+    }
+
+  string_vector files (args (0).cellstr_value ());
+  std::vector<std::string> names;
+  std::vector<std::vector<hdu_address> > addrs (files.numel ());
+  std::vector<hdu_ref> layout;
+
+  for (octave_idx_type f = 0; f < files.numel (); f++)
+    {
+      int status = 0;
+      names.push_back (files[f]);
+      if (! get_addresses (names[f], addrs[f], status))
+        {
+          fits_report_error (stderr, status);
+          error ("fits_concat: couldnt read %s", names[f].c_str ());
+          return octave_value ();
+        }
+
+      for (size_t i = 0; i < addrs[f].size (); i++)
+        {
+          // an empty primary array after the first file is left out
+          if (f > 0 && i == 0 && addrs[f][0].dataend == addrs[f][0].datastart)
+            continue;
+          hdu_ref ref = { size_t (f), int (i) };
+          layout.push_back (ref);
+        }
+    }
+
+  std::string failed;
+  if (! write_file (args (1).string_value (), names, addrs, layout, failed))
+    error ("fits_concat: %s", failed.c_str ());
+
+  return octave_value ();
+}
+
+// PKG_ADD: autoload ("fits_editHDUs", "fits_concat.oct");
+DEFUN_DLD(fits_editHDUs, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {} fits_editHDUs(@var{filename}, @var{deletions})\n \
+@deftypefnx {Function File} {} fits_editHDUs(@var{filename}, @var{deletions}, @var{insertions})\n \
+@deftypefnx {Function File} {} fits_editHDUs(@var{filename}, @var{deletions}, @var{insertions}, @var{out})\n \
+Delete and insert HDUs of the FITS file @var{filename} in one pass over the file\n \
+\n \
+@var{deletions} is a vector of the (1 based) numbers of the HDUs to delete.  @var{insertions} is a\n \
+cell array with a row @{@var{before}, @var{srcfile}, @var{srchdu}@} for each HDU to insert: HDU\n \
+@var{srchdu} of file @var{srcfile} is inserted before HDU @var{before} of @var{filename}, or appended\n \
+if @var{before} is one more than its number of HDUs.  HDUs inserted before the same HDU keep their\n \
+order.  All numbers refer to the files as they are before the edit.\n \
+\n \
+The layout of the edited file is planned first, then the file is written once, copying runs of\n \
+HDUs that stay together as raw blocks, to a temporary file next to @var{filename} that then replaces\n \
+it, so there must be room for a copy of the file.  If @var{out} is given, the edited file is written\n \
+there instead and @var{filename} is left as it is; use a preceding exclamation mark (!) to overwrite\n \
+an existing file.\n \
+\n \
+An HDU that becomes the primary HDU, or stops being it, is converted between a primary array and an\n \
+IMAGE extension; an empty primary array is added before a table that would be the first HDU.\n \
+Unlike repeated calls of fits_deleteHDU, which move the rest of the file for each HDU deleted,\n \
+each byte of the file is copied only once.\n \
+@seealso {fits_deleteHDU, fits_copyHDU, fits_concat}\n \
+@end deftypefn")
+{
+  if (args.length () < 2 || args.length () > 4)
+    {
+      print_usage ();
+      return octave_value ();
+    }
+
+  if (! args (0).is_string () || ! fits_plain_input (args (0).string_value ()))
+    {
+      error ("fits_editHDUs: filename should be the name of a plain FITS file");
+      return octave_value ();
+    }
+
+  if (! args (1).isempty () && ! args (1).isnumeric ())
+    {
+      error ("fits_editHDUs: deletions should be a vector of HDU numbers");
+      return octave_value ();
+    }
+
+  Cell inserts;
+  if (args.length () > 2 && ! args (2).isempty ())
+    {
+      if (args (2).iscell ())
+        inserts = args (2).cell_value ();
+      if (! args (2).iscell () || inserts.columns () != 3)
+        {
+          error ("fits_editHDUs: insertions should be a cell array of {before, srcfile, srchdu} rows");
+          return octave_value ();
+        }
+    }
+
+  std::string out;
+  if (args.length () > 3)
+    {
+      if (! args (3).is_string () || args (3).string_value ().empty ())
+        {
+          error ("fits_editHDUs: out should be a file name");
+          return octave_value ();
+        }
+      out = args (3).string_value ();
+    }
+
+  std::string filename = args (0).string_value ();
+  std::vector<std::string> names (1, filename);
+  std::vector<std::vector<hdu_address> > addrs (1);
+
+  int status = 0;
+  if (! get_addresses (filename, addrs[0], status))
+    {
+      fits_report_error (stderr, status);
+      error ("fits_editHDUs: couldnt read %s", filename.c_str ());
+      return octave_value ();
+    }
+
+  int nhdus = addrs[0].size ();
+  std::vector<bool> deleted (nhdus, false);
+
+  NDArray del = args (1).isempty () ? NDArray () : args (1).array_value ();
+  for (octave_idx_type i = 0; i < del.numel (); i++)
+    {
+      if (del(i) != int (del(i)) || del(i) < 1 || del(i) > nhdus)
+        {
+          error ("fits_editHDUs: no HDU %g to delete", del(i));
+          return octave_value ();
+        }
+      deleted[int (del(i)) - 1] = true;
+    }
+
+  // the HDUs to insert before each HDU, and after the last
+  std::vector<std::vector<hdu_ref> > before (nhdus + 1);
+  for (octave_idx_type r = 0; r < inserts.rows (); r++)
+    {
+      const octave_value pos = inserts (r, 0);
+      const octave_value src = inserts (r, 1);
+      const octave_value srchdu = inserts (r, 2);
+
+      if (! pos.is_scalar_type () || ! src.is_string ()
+          || ! srchdu.is_scalar_type ())
+        {
+          error ("fits_editHDUs: insertions should be a cell array of {before, srcfile, srchdu} rows");
+          return octave_value ();
+        }
+
+      double b = pos.double_value ();
+      if (b != int (b) || b < 1 || b > nhdus + 1)
+        {
+          error ("fits_editHDUs: no HDU %g to insert before", b);
+          return octave_value ();
+        }
+
+      size_t f = std::find (names.begin (), names.end (), src.string_value ())
+                 - names.begin ();
+      if (f == names.size ())
+        {
+          names.push_back (src.string_value ());
+          addrs.push_back (std::vector<hdu_address> ());
+          if (! get_addresses (names[f], addrs[f], status))
+            {
+              fits_report_error (stderr, status);
+              error ("fits_editHDUs: couldnt read %s", names[f].c_str ());
+              return octave_value ();
+            }
+        }
+
+      double h = srchdu.double_value ();
+      if (h != int (h) || h < 1 || h > addrs[f].size ())
+        {
+          error ("fits_editHDUs: %s has no HDU %g", names[f].c_str (), h);
+          return octave_value ();
+        }
+
+      hdu_ref ref = { f, int (h) - 1 };
+      before[int (b) - 1].push_back (ref);
+    }
+
+  std::vector<hdu_ref> layout;
+  for (int i = 0; i <= nhdus; i++)
+    {
+      layout.insert (layout.end (), before[i].begin (), before[i].end ());
+      if (i < nhdus && ! deleted[i])
+        {
+          hdu_ref ref = { 0, i };
+          layout.push_back (ref);
+        }
+    }
+
+  if (layout.empty ())
+    {
+      error ("fits_editHDUs: no HDUs would be left");
+      return octave_value ();
+    }
+
+  std::string failed;
+  if (! out.empty ())
+    {
+      if (! write_file (out, names, addrs, layout, failed))
+        error ("fits_editHDUs: %s", failed.c_str ());
+      return octave_value ();
+    }
+
+  // write next to filename, then replace it
+  struct stat st;
+  if (stat (filename.c_str (), &st) != 0 || ! S_ISREG (st.st_mode))
+    {
+      error ("fits_editHDUs: couldnt edit %s in place, it is not a plain file",
+             filename.c_str ());
+      return octave_value ();
+    }
+
+  // a name of its own, so that concurrent edits do not share it
+  std::string tmp;
+#ifdef HAVE_MKSTEMP
+  std::vector<char> tmpl (filename.begin (), filename.end ());
+  const char suffix[] = ".XXXXXX";
+  tmpl.insert (tmpl.end (), suffix, suffix + sizeof (suffix));
+  int fd = mkstemp (tmpl.data ());
+  if (fd >= 0)
+    {
+      close (fd);
+      tmp = tmpl.data ();
+    }
+#else
+  for (int i = 0; i < 1000 && tmp.empty (); i++)
+    {
+      std::ostringstream name;
+      name << filename << ".edit" << i;
+      FILE *f = fopen (name.str ().c_str (), "wx");
+      if (f)
+        {
+          fclose (f);
+          tmp = name.str ();
+        }
+    }
+#endif
+  if (tmp.empty ())
+    {
+      error ("fits_editHDUs: couldnt create a file next to %s", filename.c_str ());
+      return octave_value ();
+    }
+
+  if (! write_file ("!" + tmp, names, addrs, layout, failed))
+    {
+      remove (tmp.c_str ());
+      error ("fits_editHDUs: %s", failed.c_str ());
+      return octave_value ();
+    }
+
+  chmod (tmp.c_str (), st.st_mode & 07777);
+
+  if (rename (tmp.c_str (), filename.c_str ()) != 0)
+    {
+      remove (tmp.c_str ());
+      error ("fits_editHDUs: couldnt replace %s", filename.c_str ());
+    }
+
+  return octave_value ();
+}
+
+#if 0
+%!error <fits_concat: files should be a cellstr> fits_concat("a.fits", "b.fits")
+
+%!error <fits_concat: out should be a file name> fits_concat({"a.fits"}, 1)
+
+%!test
+%! file1 = tempname();
+%! file2 = tempname();
+%! file3 = tempname();
+%! out = tempname();
+%! out2 = tempname();
+%! data1 = reshape(1:24, 4, 3, 2);
+%! data2 = int16([1 -2; 3 -4]);
+%! data3 = single(magic(5));
+%! save_fits_image_multi_ext(file1, data1, 16);
+%! save_fits_image_multi_ext(file2, {data2});
+%! save_fits_image(file3, data3, "FLOAT_IMG");
+%! fits_concat({file1, file2, file3}, out);
+%! fd = fits_openFile(out);
+%! assert(fits_getNumHDUs(fd), 4);
+%! fits_closeFile(fd);
+%! assert(read_fits_image(out, 0), data1(:,:,1));
+%! assert(read_fits_image(out, 1), data1(:,:,2));
+%! assert(read_fits_image(out, 2), double(data2));
+%! assert(read_fits_image(out, 3), double(data3));
+%! fits_concat({out, file2}, out2);
+%! fits_concat({file2, out}, ["!" out2]);
+%! fd = fits_openFile(out2);
+%! assert(fits_getNumHDUs(fd), 5);
+%! fits_closeFile(fd);
+%! assert(read_fits_image(out2, 0), double(data2));
+%! assert(read_fits_image(out2, 4), double(data3));
+%! fail("fits_concat({file1, out}, [\"!\" out])", "out can not be one of the files read");
+%! assert(read_fits_image(out, 3), double(data3));
+%! ## an input cut short within its data is not padded out with zeros
+%! fid = fopen(file1, "r");
+%! bytes = fread(fid, Inf, "uint8=>uint8");
+%! fclose(fid);
+%! fid = fopen(file1, "w");
+%! fwrite(fid, bytes(1:end-2880));
+%! fclose(fid);
+%! out3 = tempname();
+%! fail("fits_concat({file1, file2}, out3)", "couldnt");
+%! assert(! exist(out3, "file"));
+%! delete(file1);
+%! delete(file2);
+%! delete(file3);
+%! delete(out);
+%! delete(out2);
+
+%!error <fits_editHDUs: filename should be> fits_editHDUs("a.fits.gz", 1)
+
+%!test
+%! testfile = tempname();
+%! other = tempname();
+%! copy = tempname();
+%! data = reshape(1:60, 3, 4, 5);
+%! odata = int16([7 8; 9 10]);
+%! save_fits_image_multi_ext(testfile, data);
+%! save_fits_image_multi_ext(other, {odata});
+%! fits_editHDUs(testfile, [2 4], {1, other, 1; 6, other, 1; 6, testfile, 1}, copy);
+%! fd = fits_openFile(testfile);
+%! assert(fits_getNumHDUs(fd), 5);
+%! fits_closeFile(fd);
+%! fd = fits_openFile(copy);
+%! assert(fits_getNumHDUs(fd), 6);
+%! fits_closeFile(fd);
+%! expect = {odata, data(:,:,1), data(:,:,3), data(:,:,5), odata, data(:,:,1)};
+%! for i = 1:6
+%!   assert(read_fits_image(copy, i-1), double(expect{i}));
+%! endfor
+%! fail("fits_editHDUs(testfile, 1, {}, [\"!\" testfile])", "out can not be one of the files read");
+%! fits_editHDUs(testfile, 1);
+%! assert(isempty(glob([testfile ".*"])));
+%! fd = fits_openFile(testfile);
+%! assert(fits_getNumHDUs(fd), 4);
+%! fits_closeFile(fd);
+%! for i = 1:4
+%!   assert(read_fits_image(testfile, i-1), data(:,:,i+1));
+%! endfor
+%! delete(testfile);
+%! delete(other);
+%! delete(copy);
+#endif
@@ -0,0 +1,51 @@
+// The identity of a file on disk, as stat describes it: its device and
+// inode, size and modification time, to the nanosecond where stat has
+// it.  Caches of what was read from a file (open handles, gzip indexes)
+// are only used while the file has the same identity, so a file that is
+// changed, or replaced by another, is read again.
+
+#ifndef FITS_FILE_ID_H
+#define FITS_FILE_ID_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+struct
+fits_file_id
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime;
+  uint64_t mtime_nsec;
+
+  fits_file_id (void)
+    : dev (0), ino (0), size (0), mtime (0), mtime_nsec (0) { }
+
+  fits_file_id (const struct stat &st)
+    : dev (st.st_dev), ino (st.st_ino), size (st.st_size),
+      mtime (st.st_mtime), mtime_nsec (nsec (st)) { }
+
+  bool operator == (const fits_file_id &other) const
+  {
+    return dev == other.dev && ino == other.ino && size == other.size
+           && mtime == other.mtime && mtime_nsec == other.mtime_nsec;
+  }
+
+  bool operator != (const fits_file_id &other) const
+  { return ! (*this == other); }
+
+  // the nanoseconds of the modification time of st, 0 if not known
+  static uint64_t nsec (const struct stat &st)
+  {
+#if defined (HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+    return st.st_mtim.tv_nsec;
+#elif defined (HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+    return st.st_mtimespec.tv_nsec;
+#else
+    return 0;
+#endif
+  }
+};
+
+#endif
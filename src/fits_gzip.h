@@ -0,0 +1,268 @@
+// Parallel gzip of output files.  cfitsio writes a '.gz' file by
+// building the whole file in memory and deflating it on one thread when
+// it is closed.  Instead, the file is written uncompressed to a temporary
+// file next to the target (fits_gzip_temp), then deflated in independent
+// 1 MiB blocks on worker threads, each primed with the 32 KiB before it
+// as dictionary, and written out in order as one gzip stream (the scheme
+// used by pigz).  Only a batch of blocks is held in memory at a time.
+
+#ifndef FITS_GZIP_H
+#define FITS_GZIP_H
+
+#ifdef HAVE_ZLIB_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "fits_threads.h"
+
+// deflate a block as raw deflate data, ending at a byte boundary unless
+// it is the last block
+static inline bool
+fits_deflate_block (const unsigned char *dict, size_t dictlen,
+                    const unsigned char *src, size_t len, bool last,
+                    int level, std::vector<unsigned char> &out)
+{
+  z_stream strm;
+  memset (&strm, 0, sizeof (strm));
+
+  if (deflateInit2 (&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+
+  if (dictlen > 0)
+    deflateSetDictionary (&strm, dict, dictlen);
+
+  // room for the sync flush marker too
+  out.resize (deflateBound (&strm, len) + 64);
+  strm.next_in = const_cast<unsigned char *> (src);
+  strm.avail_in = len;
+  strm.next_out = out.data ();
+  strm.avail_out = out.size ();
+
+  int ret = deflate (&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+  bool ok = (last ? ret == Z_STREAM_END : ret == Z_OK) && strm.avail_in == 0;
+
+  out.resize (strm.total_out);
+  deflateEnd (&strm);
+
+  return ok;
+}
+
+// gzip the stream in to out.  Returns false on failure.
+static inline bool
+fits_gzip_stream (FILE *in, FILE *out, int nthreads, int level)
+{
+  const size_t block = 1 << 20;
+  const size_t window = 1 << 15;
+  const size_t nblocks = 2 * std::max (nthreads, 1);
+
+  // gzip header: deflate, no flags or time, unix
+  static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+  bool ok = fwrite (header, 1, sizeof (header), out) == sizeof (header);
+
+  // the window before the batch is kept in front of it
+  std::vector<unsigned char> buf (window + nblocks * block);
+  unsigned char *data = buf.data () + window;
+  std::vector<std::vector<unsigned char> > packed (nblocks);
+  std::vector<uLong> crcs (nblocks);
+  std::vector<char> done (nblocks);
+
+  uLong crc = crc32 (0L, Z_NULL, 0);
+  unsigned long long total = 0;
+  size_t history = 0;
+  bool last = false;
+
+  while (ok && ! last)
+    {
+      size_t n = fread (data, 1, nblocks * block, in);
+      if (ferror (in))
+        {
+          ok = false;
+          break;
+        }
+
+      int c = (n < nblocks * block) ? EOF : fgetc (in);
+      if (c == EOF)
+        last = true;
+      else
+        ungetc (c, in);
+
+      // an empty file still needs a final block
+      size_t nb = std::max<size_t> ((n + block - 1) / block, 1);
+
+      fits_parallel_for (nb, nthreads,
+                         [&] (size_t b, size_t e)
+                         {
+                           for (size_t i = b; i < e; i++)
+                             {
+                               size_t start = i * block;
+                               size_t len = std::min (block, n - std::min (n, start));
+                               size_t dictlen = (i == 0) ? history : window;
+                               crcs[i] = crc32 (0L, data + start, len);
+                               done[i] = fits_deflate_block (data + start - dictlen,
+                                                             dictlen, data + start,
+                                                             len, last && i == nb - 1,
+                                                             level, packed[i]);
+                             }
+                         });
+
+      for (size_t i = 0; i < nb && ok; i++)
+        {
+          size_t len = std::min (block, n - std::min (n, i * block));
+          ok = done[i] && fwrite (packed[i].data (), 1, packed[i].size (), out)
+                          == packed[i].size ();
+          crc = crc32_combine (crc, crcs[i], len);
+        }
+
+      total += n;
+
+      // keep the last window of data as dictionary for the next batch
+      size_t keep = std::min (window, history + n);
+      memmove (data - keep, data + n - keep, keep);
+      history = keep;
+    }
+
+  unsigned char trailer[8];
+  for (int i = 0; i < 4; i++)
+    {
+      trailer[i] = (crc >> (8 * i)) & 0xff;
+      trailer[4 + i] = (total >> (8 * i)) & 0xff;
+    }
+  return ok && fwrite (trailer, 1, sizeof (trailer), out) == sizeof (trailer);
+}
+
+// gzip the file src to dst.  The gzip stream is written to a temporary
+// file next to dst and renamed over it once complete, so a file dst
+// already has is only replaced by a whole one, and is kept on failure.
+// Returns false on failure.
+static inline bool
+fits_gzip_file (const std::string &src, const std::string &dst,
+                int nthreads, int level = Z_DEFAULT_COMPRESSION)
+{
+  FILE *in = fopen (src.c_str (), "rb");
+  if (! in)
+    return false;
+
+#ifdef HAVE_MKSTEMP
+  std::string pattern = dst + ".XXXXXX";
+  std::vector<char> buf (pattern.begin (), pattern.end ());
+  buf.push_back ('\0');
+  int fd = mkstemp (buf.data ());
+  std::string tmpname = buf.data ();
+  FILE *out = (fd < 0) ? NULL : fdopen (fd, "wb");
+  if (fd >= 0 && ! out)
+    {
+      ::close (fd);
+      remove (tmpname.c_str ());
+    }
+#else
+  std::string tmpname = dst + ".gztmp";
+  FILE *out = fopen (tmpname.c_str (), "wb");
+#endif
+  if (! out)
+    {
+      fclose (in);
+      return false;
+    }
+
+  bool ok = fits_gzip_stream (in, out, nthreads, level);
+
+  fclose (in);
+  ok = (fclose (out) == 0) && ok;
+
+#ifdef HAVE_MKSTEMP
+  // the permissions of a file made by fopen, rather than mkstemp's 0600
+  mode_t mask = umask (0);
+  umask (mask);
+  ok = ok && chmod (tmpname.c_str (), 0666 & ~mask) == 0;
+#endif
+
+  ok = ok && rename (tmpname.c_str (), dst.c_str ()) == 0;
+
+  if (! ok)
+    remove (tmpname.c_str ());
+
+  return ok;
+}
+
+// The uncompressed file a '.gz' target is written to first.  It is made
+// with a unique name by mkstemp, so writers of the same target each have
+// their own, and is removed when the object goes out of scope, on every
+// return and error alike.
+class
+fits_gzip_temp
+{
+public:
+
+  fits_gzip_temp (void) { }
+
+  ~fits_gzip_temp (void)
+  {
+    if (! tmpname.empty ())
+      remove (tmpname.c_str ());
+  }
+
+  // If name is a plain file name ending in '.gz', make the temporary file
+  // and return the name to have cfitsio write it instead, over the empty
+  // file made.  Else return name unchanged.
+  std::string target (const std::string &name)
+  {
+    bool clobber = (! name.empty () && name[0] == '!');
+    std::string path = clobber ? name.substr (1) : name;
+
+    if (path.size () < 4 || path.compare (path.size () - 3, 3, ".gz") != 0
+        || path.find ('[') != std::string::npos
+        || path.find ("://") != std::string::npos)
+      return name;
+
+    // leave cfitsio to report an existing file
+    struct stat st;
+    if (! clobber && stat (path.c_str (), &st) == 0)
+      return name;
+
+#ifdef HAVE_MKSTEMP
+    std::string pattern = path + ".XXXXXX";
+    std::vector<char> buf (pattern.begin (), pattern.end ());
+    buf.push_back ('\0');
+    int fd = mkstemp (buf.data ());
+    // where it can not be made, cfitsio writes the '.gz' itself
+    if (fd < 0)
+      return name;
+    ::close (fd);
+    tmpname = buf.data ();
+#else
+    tmpname = path + ".tmp";
+#endif
+
+    gzname = path;
+    return "!" + tmpname;
+  }
+
+  // the '.gz' file, empty if name was returned unchanged
+  const std::string &gzfile (void) const { return gzname; }
+
+  // compress the temporary file to the '.gz' file on nthreads threads
+  bool compress (int nthreads) const
+  {
+    return fits_gzip_file (tmpname, gzname, nthreads);
+  }
+
+private:
+
+  // no copying
+  fits_gzip_temp (const fits_gzip_temp &);
+  fits_gzip_temp &operator = (const fits_gzip_temp &);
+
+  std::string gzname;
+  std::string tmpname;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,426 @@
+// Reads of parts of a gzip file, without decompressing all of it into
+// memory.  By default the file is read in one streaming pass: each read
+// inflates on from where the one before ended, skipping what lies
+// between, so reads must come in order.  If the environment variable
+// OCTAVE_FITS_GZ_INDEX is set to 1, reads are random access instead,
+// after the zran example of zlib: one pass over the file records an
+// access point every 16 MiB of uncompressed data (the compressed offset,
+// the bit offset within that byte, and the 32 KiB of data before it),
+// and a read inflates from the nearest access point at or before it.
+// The access points are kept in a sidecar file, name.gzidx, which is
+// reused while the gzip file has the same identity (fits_file_id), so
+// later reads of a large file cost at most one span of decompression.
+// The sidecar is written to a temporary file and renamed into place, so
+// a reader never loads one that is partly written.
+
+#ifndef FITS_GZREAD_H
+#define FITS_GZREAD_H
+
+#ifdef HAVE_ZLIB_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "fits_file_id.h"
+
+class
+fits_gz_reader
+{
+public:
+
+  enum { window = 1 << 15 };
+  static const uint64_t span = 1 << 24;
+
+  fits_gz_reader (void)
+    : in (NULL), total (0), streaming (false),
+      pos (0), sret (Z_OK)
+  { }
+
+  ~fits_gz_reader (void)
+  {
+    if (streaming)
+      inflateEnd (&strm);
+    if (in)
+      fclose (in);
+  }
+
+  // whether reads are random access through an index, see above
+  static bool use_index (void)
+  {
+    const char *env = getenv ("OCTAVE_FITS_GZ_INDEX");
+    return env && atoi (env) > 0;
+  }
+
+  // open a gzip file, to stream it or to read it through its index, which
+  // is loaded or built.  Returns false if the file can not be read this
+  // way, e.g. it holds several gzip members.
+  bool open (const std::string &name)
+  {
+    struct stat st;
+
+    in = fopen (name.c_str (), "rb");
+    if (! in)
+      return false;
+
+    if (fstat (fileno (in), &st) != 0)
+      return false;
+
+    path = name;
+    gzid = fits_file_id (st);
+
+    if (! use_index ())
+      {
+        memset (&strm, 0, sizeof (strm));
+        streaming = (inflateInit2 (&strm, 47) == Z_OK);
+        input.resize (1 << 16);
+        return streaming;
+      }
+
+    if (load_index ())
+      return true;
+
+    if (! build_index ())
+      return false;
+
+    save_index ();
+    return true;
+  }
+
+  // read len bytes at uncompressed offset into buf.  When streaming,
+  // offset may not be before the end of the last read.
+  bool read (uint64_t offset, unsigned char *buf, size_t len)
+  {
+    if (streaming)
+      return stream (offset, buf, len);
+
+    if (offset + len > total)
+      return false;
+    if (len == 0)
+      return true;
+
+    size_t p = 0;
+    while (p + 1 < points.size () && points[p + 1].out <= offset)
+      p++;
+    const access_point &pt = points[p];
+
+    z_stream strm;
+    memset (&strm, 0, sizeof (strm));
+    if (inflateInit2 (&strm, pt.out == 0 ? 47 : -15) != Z_OK)
+      return false;
+
+    bool ok = fseeko (in, pt.in - (pt.bits ? 1 : 0), SEEK_SET) == 0;
+    if (ok && pt.bits)
+      {
+        int c = fgetc (in);
+        ok = (c != EOF)
+             && inflatePrime (&strm, pt.bits, c >> (8 - pt.bits)) == Z_OK;
+      }
+    if (ok && pt.out > 0)
+      ok = inflateSetDictionary (&strm, pt.window.data (), window) == Z_OK;
+
+    // skip to the offset, then read into buf
+    std::vector<unsigned char> input (1 << 16), discard (window);
+    uint64_t skip = offset - pt.out;
+    int ret = Z_OK;
+
+    while (ok && len > 0)
+      {
+        if (skip > 0)
+          {
+            strm.next_out = discard.data ();
+            strm.avail_out = std::min<uint64_t> (skip, window);
+          }
+        else
+          {
+            strm.next_out = buf;
+            strm.avail_out = std::min<size_t> (len, 1 << 30);
+          }
+        unsigned int want = strm.avail_out;
+
+        while (strm.avail_out > 0 && ret != Z_STREAM_END)
+          {
+            if (strm.avail_in == 0)
+              {
+                strm.avail_in = fread (input.data (), 1, input.size (), in);
+                strm.next_in = input.data ();
+                if (strm.avail_in == 0)
+                  break;
+              }
+            ret = inflate (&strm, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END)
+              break;
+          }
+
+        unsigned int got = want - strm.avail_out;
+        if (got == 0)
+          ok = false;
+        else if (skip > 0)
+          skip -= got;
+        else
+          {
+            buf += got;
+            len -= got;
+          }
+      }
+
+    inflateEnd (&strm);
+    return ok && len == 0;
+  }
+
+private:
+
+  // inflate on to offset, then read len bytes into buf
+  bool stream (uint64_t offset, unsigned char *buf, size_t len)
+  {
+    if (offset < pos)
+      return false;
+
+    std::vector<unsigned char> discard (window);
+
+    while (pos < offset + len)
+      {
+        if (pos < offset)
+          {
+            strm.next_out = discard.data ();
+            strm.avail_out = std::min<uint64_t> (offset - pos, window);
+          }
+        else
+          {
+            strm.next_out = buf + (pos - offset);
+            strm.avail_out = std::min<uint64_t> (offset + len - pos, 1 << 30);
+          }
+        unsigned int want = strm.avail_out;
+
+        while (strm.avail_out > 0 && sret == Z_OK)
+          {
+            if (strm.avail_in == 0)
+              {
+                strm.avail_in = fread (input.data (), 1, input.size (), in);
+                strm.next_in = input.data ();
+                if (strm.avail_in == 0)
+                  break;
+              }
+            sret = inflate (&strm, Z_NO_FLUSH);
+          }
+
+        unsigned int got = want - strm.avail_out;
+        if (got == 0)
+          return false;
+        pos += got;
+      }
+
+    return true;
+  }
+
+  struct access_point
+  {
+    uint64_t out;
+    uint64_t in;
+    int bits;
+    std::vector<unsigned char> window;
+  };
+
+  std::string index_name (void) const { return path + ".gzidx"; }
+
+  // one pass over the file, adding an access point at the first deflate
+  // block boundary after each span of output
+  bool build_index (void)
+  {
+    z_stream strm;
+    memset (&strm, 0, sizeof (strm));
+    if (inflateInit2 (&strm, 47) != Z_OK)
+      return false;
+
+    std::vector<unsigned char> input (1 << 16), ring (window);
+    uint64_t totin = 0, totout = 0, last = 0;
+    int ret = Z_OK;
+    bool ok = true;
+
+    points.clear ();
+    access_point start = { 0, 0, 0, std::vector<unsigned char> () };
+    points.push_back (start);
+
+    rewind (in);
+    while (ok && ret != Z_STREAM_END)
+      {
+        strm.avail_in = fread (input.data (), 1, input.size (), in);
+        if (strm.avail_in == 0)
+          {
+            ok = false;
+            break;
+          }
+        strm.next_in = input.data ();
+
+        while (strm.avail_in > 0 && ret != Z_STREAM_END)
+          {
+            if (strm.avail_out == 0)
+              {
+                strm.avail_out = window;
+                strm.next_out = ring.data ();
+              }
+
+            totin += strm.avail_in;
+            totout += strm.avail_out;
+            ret = inflate (&strm, Z_BLOCK);
+            totin -= strm.avail_in;
+            totout -= strm.avail_out;
+
+            if (ret != Z_OK && ret != Z_STREAM_END)
+              {
+                ok = false;
+                break;
+              }
+
+            // at the end of a deflate block, that is not the last one
+            if ((strm.data_type & 128) && ! (strm.data_type & 64)
+                && totout - last > span && totout >= window)
+              {
+                access_point pt;
+                pt.out = totout;
+                pt.in = totin;
+                pt.bits = strm.data_type & 7;
+                pt.window.resize (window);
+                size_t used = window - strm.avail_out;
+                memcpy (pt.window.data (), ring.data () + used, window - used);
+                memcpy (pt.window.data () + window - used, ring.data (), used);
+                points.push_back (pt);
+                last = totout;
+              }
+          }
+      }
+
+    inflateEnd (&strm);
+
+    // data after the end of the first gzip member is not indexed
+    if (ok && (strm.avail_in > 0 || fgetc (in) != EOF))
+      ok = false;
+
+    total = totout;
+    return ok;
+  }
+
+  bool load_index (void)
+  {
+    FILE *f = fopen (index_name ().c_str (), "rb");
+    if (! f)
+      return false;
+
+    char magic[8];
+    uint64_t head[7];
+    fits_file_id id;
+    bool ok = fread (magic, 1, 8, f) == 8 && memcmp (magic, "FITSGZI2", 8) == 0
+              && fread (head, sizeof (uint64_t), 7, f) == 7;
+    if (ok)
+      {
+        id.dev = head[0];
+        id.ino = head[1];
+        id.size = head[2];
+        id.mtime = head[3];
+        id.mtime_nsec = head[4];
+        ok = id == gzid && head[6] > 0;
+      }
+
+    if (ok)
+      {
+        total = head[5];
+        points.resize (head[6]);
+        for (size_t i = 0; i < points.size () && ok; i++)
+          {
+            uint64_t v[3];
+            ok = fread (v, sizeof (uint64_t), 3, f) == 3;
+            points[i].out = v[0];
+            points[i].in = v[1];
+            points[i].bits = int (v[2]);
+            if (ok && i > 0)
+              {
+                points[i].window.resize (window);
+                ok = fread (points[i].window.data (), 1, window, f) == window;
+              }
+          }
+      }
+
+    fclose (f);
+    if (! ok)
+      points.clear ();
+
+    return ok;
+  }
+
+  // the index is only a cache, so failing to write it is not an error
+  void save_index (void)
+  {
+    std::string name = index_name ();
+#ifdef HAVE_MKSTEMP
+    std::string pattern = name + ".XXXXXX";
+    std::vector<char> buf (pattern.begin (), pattern.end ());
+    buf.push_back ('\0');
+    int fd = mkstemp (buf.data ());
+    if (fd < 0)
+      return;
+    std::string tmpname = buf.data ();
+    FILE *f = fdopen (fd, "wb");
+    if (! f)
+      {
+        ::close (fd);
+        remove (tmpname.c_str ());
+        return;
+      }
+#else
+    std::string tmpname = name + ".tmp";
+    FILE *f = fopen (tmpname.c_str (), "wb");
+    if (! f)
+      return;
+#endif
+
+    uint64_t head[7] = { gzid.dev, gzid.ino, gzid.size, gzid.mtime,
+                         gzid.mtime_nsec, total, points.size () };
+    bool ok = fwrite ("FITSGZI2", 1, 8, f) == 8
+              && fwrite (head, sizeof (uint64_t), 7, f) == 7;
+
+    for (size_t i = 0; i < points.size () && ok; i++)
+      {
+        uint64_t v[3] = { points[i].out, points[i].in, uint64_t (points[i].bits) };
+        ok = fwrite (v, sizeof (uint64_t), 3, f) == 3;
+        if (ok && i > 0)
+          ok = fwrite (points[i].window.data (), 1, window, f) == window;
+      }
+
+    ok = (fclose (f) == 0) && ok;
+
+#ifdef HAVE_MKSTEMP
+    // the permissions of a file made by fopen, rather than mkstemp's 0600
+    mode_t mask = umask (0);
+    umask (mask);
+    ok = ok && chmod (tmpname.c_str (), 0666 & ~mask) == 0;
+#endif
+
+    if (! ok || rename (tmpname.c_str (), name.c_str ()) != 0)
+      remove (tmpname.c_str ());
+  }
+
+  FILE *in;
+  std::string path;
+  uint64_t total;
+  fits_file_id gzid;
+  std::vector<access_point> points;
+
+  // the state of a streaming read: uncompressed bytes read so far, and
+  // the last return of inflate
+  bool streaming;
+  z_stream strm;
+  std::vector<unsigned char> input;
+  uint64_t pos;
+  int sret;
+};
+
+#endif
+
+#endif
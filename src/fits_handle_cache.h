@@ -0,0 +1,220 @@
+// Read only handles on FITS files kept open between calls, so reading
+// planes of the same file again and again does not reopen it and parse
+// its primary header each time.  Caching is off unless the environment
+// variable OCTAVE_FITS_OPEN_FILES gives the number of files that may be
+// kept open.  A cached handle is only reused while its path names the
+// same file (device and inode) with the same size and modification time,
+// to the nanosecond where stat has it.  Each .oct file keeps its own
+// cache, which fits_flushOpenFiles closes, as does clearing the function
+// or the next call once the variable is unset.
+
+#ifndef FITS_HANDLE_CACHE_H
+#define FITS_HANDLE_CACHE_H
+
+#include <cstdlib>
+#include <cctype>
+#include <list>
+#include <string>
+#include <sys/stat.h>
+
+#include "fits_file_id.h"
+
+class
+fits_handle_cache
+{
+public:
+
+  fits_handle_cache (void) { }
+
+  ~fits_handle_cache (void) { flush (); }
+
+  // number of files that may be kept open, 0 if caching is off
+  static size_t max_open (void)
+  {
+    const char *env = getenv ("OCTAVE_FITS_OPEN_FILES");
+    int n = env ? atoi (env) : 0;
+
+    return n > 0 ? n : 0;
+  }
+
+  // As fits_open_image, for a file name with at most an extension
+  // number in brackets, e.g. "file.fits[2]"; other names, such as those
+  // with image sections or filters, or of other drivers, are opened by
+  // cfitsio as usual, each time.
+  int open_image (fitsfile **fp, const std::string &name, int *status)
+  {
+    std::string path;
+    int ext = -1;
+
+    if (! split_name (name, path, ext) || ! open_file (fp, path, status))
+      return fits_open_image (fp, name.c_str (), READONLY, status);
+
+    if (*status > 0)
+      return *status;
+
+    int hdutype = IMAGE_HDU, naxis = 0;
+    if (ext >= 0)
+      fits_movabs_hdu (*fp, ext + 1, &hdutype, status);
+    else
+      {
+        // past an empty primary array, the first image or compressed
+        // image HDU, as fits_open_image
+        fits_movabs_hdu (*fp, 1, &hdutype, status);
+        fits_get_img_dim (*fp, &naxis, status);
+        for (int hdu = 2; naxis == 0 && *status <= 0; hdu++)
+          {
+            if (fits_movabs_hdu (*fp, hdu, &hdutype, status) > 0)
+              break;
+            if (hdutype == IMAGE_HDU || fits_is_compressed_image (*fp, status))
+              break;
+          }
+        if (*status == END_OF_FILE)
+          *status = NOT_IMAGE;
+      }
+
+    if (*status <= 0 && hdutype != IMAGE_HDU
+        && ! fits_is_compressed_image (*fp, status))
+      *status = NOT_IMAGE;
+
+    if (*status > 0)
+      {
+        int cstatus = *status;
+        close (*fp, &cstatus);
+      }
+
+    return *status;
+  }
+
+  // As fits_close_file, for a handle from open_image.  A cached handle
+  // is kept open unless status is an error.
+  int close (fitsfile *fp, int *status)
+  {
+    for (std::list<entry>::iterator it = entries.begin ();
+         it != entries.end (); it++)
+      {
+        if (it->fp == fp)
+          {
+            it->in_use = false;
+            if (*status > 0)
+              {
+                fits_close_file (fp, status);
+                entries.erase (it);
+              }
+            else
+              trim (max_open ());
+            return *status;
+          }
+      }
+
+    return fits_close_file (fp, status);
+  }
+
+  // close the files not in use, returning how many were closed
+  size_t flush (void)
+  {
+    size_t n = entries.size ();
+    trim (0);
+    return n - entries.size ();
+  }
+
+private:
+
+  struct entry
+  {
+    std::string path;
+    fits_file_id id;
+    fitsfile *fp;
+    bool in_use;
+  };
+
+  // split "path[n]" into the path and extension number.  False if the
+  // name is not a plain file name.
+  static bool split_name (const std::string &name, std::string &path, int &ext)
+  {
+    path = name;
+    ext = -1;
+
+    size_t open = name.find ('[');
+    if (open != std::string::npos)
+      {
+        if (open == 0 || name[name.size () - 1] != ']'
+            || open + 2 >= name.size ())
+          return false;
+        for (size_t i = open + 1; i < name.size () - 1; i++)
+          if (! isdigit (name[i]))
+            return false;
+        path = name.substr (0, open);
+        ext = atoi (name.c_str () + open + 1);
+      }
+
+    return ! path.empty () && path[0] != '-' && path[0] != '!'
+           && path.find ("://") == std::string::npos
+           && path.compare (0, 4, "mem:") != 0
+           && path.find_first_of ("[]+") == std::string::npos;
+  }
+
+  // open path from the cache.  False if caching is off or the file can
+  // not be found, to leave cfitsio to open or report it.
+  bool open_file (fitsfile **fp, const std::string &path, int *status)
+  {
+    size_t limit = max_open ();
+    struct stat st;
+
+    if (limit == 0)
+      flush ();
+
+    if (limit == 0 || stat (path.c_str (), &st) != 0)
+      return false;
+
+    for (std::list<entry>::iterator it = entries.begin ();
+         it != entries.end (); it++)
+      {
+        if (it->path != path || it->in_use)
+          continue;
+
+        if (it->id == fits_file_id (st))
+          {
+            // most recently used first
+            entries.splice (entries.begin (), entries, it);
+            it->in_use = true;
+            *fp = it->fp;
+            return true;
+          }
+
+        // the file has changed, or been replaced, since it was opened
+        int cstatus = 0;
+        fits_close_file (it->fp, &cstatus);
+        entries.erase (it);
+        break;
+      }
+
+    if (fits_open_file (fp, path.c_str (), READONLY, status) > 0)
+      return true;
+
+    entry e = { path, fits_file_id (st), *fp, true };
+    entries.push_front (e);
+    trim (limit);
+
+    return true;
+  }
+
+  // close the least recently used files not in use, down to limit files
+  void trim (size_t limit)
+  {
+    std::list<entry>::iterator it = entries.end ();
+    while (entries.size () > limit && it != entries.begin ())
+      {
+        it--;
+        if (! it->in_use)
+          {
+            int cstatus = 0;
+            fits_close_file (it->fp, &cstatus);
+            it = entries.erase (it);
+          }
+      }
+  }
+
+  std::list<entry> entries;
+};
+
+#endif
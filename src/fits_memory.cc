@@ -0,0 +1,330 @@
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <octave/oct.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+extern "C"
+{
+#include <fitsio.h>
+}
+
+/*
+ * get the BITPIX of an argument, as a name or a number
+ */
+static bool
+get_bitpix (const octave_value &arg, int &bitpix)
+{
+  static const char *names[] = { "BYTE_IMG", "SHORT_IMG", "LONG_IMG",
+                                 "LONGLONG_IMG", "FLOAT_IMG", "DOUBLE_IMG" };
+  static const int values[] = { BYTE_IMG, SHORT_IMG, LONG_IMG,
+                                LONGLONG_IMG, FLOAT_IMG, DOUBLE_IMG };
+
+  for (int i = 0; i < 6; i++)
+    {
+      if (arg.is_string () ? arg.string_value () == names[i]
+          : (arg.is_scalar_type () && arg.double_value () == values[i]))
+        {
+          bitpix = values[i];
+          return true;
+        }
+    }
+
+  return false;
+}
+
+/*
+ * true for the keywords that cfitsio writes for the image itself, or
+ * that would change the meaning of the values written
+ */
+static bool
+is_image_keyword (const std::string &card)
+{
+  static const char *keys[] = { "SIMPLE", "BITPIX", "NAXIS", "EXTEND",
+                                "XTENSION", "PCOUNT", "GCOUNT", "BSCALE",
+                                "BZERO", "CHECKSUM", "DATASUM", "END" };
+
+  std::string key = card.substr (0, 8);
+  key.erase (key.find_last_not_of (" \n") + 1);
+
+  if (key.empty ())
+    return true;
+
+  // NAXISn
+  if (key.compare (0, 5, "NAXIS") == 0)
+    return true;
+
+  for (size_t i = 0; i < sizeof (keys) / sizeof (keys[0]); i++)
+    if (key == keys[i])
+      return true;
+
+  return false;
+}
+
+// PKG_ADD: autoload ("fits_encode", "fits_memory.oct");
+DEFUN_DLD(fits_encode, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {@var{bytes} = } fits_encode(@var{image})\n \
+@deftypefnx {Function File} {@var{bytes} = } fits_encode(@var{image}, @var{bit_per_pixel})\n \
+@deftypefnx {Function File} {@var{bytes} = } fits_encode(@var{image}, @var{bit_per_pixel}, @var{header})\n \
+Encode @var{image} as a FITS file in memory, returned as a uint8 column vector\n \
+\n \
+@var{bit_per_pixel} is as for save_fits_image, DOUBLE_IMG (-64) by default.\n \
+\n \
+@var{header} is a cellstr or char matrix of header cards, as returned by read_fits_image.\n \
+Cards that describe the image itself (SIMPLE, BITPIX, NAXISn, EXTEND, BSCALE, BZERO, ...)\n \
+are skipped, as they are written for @var{image}.\n \
+\n \
+The file is built with the cfitsio memory driver, so nothing is written to disk.\n \
+@seealso {fits_decode, save_fits_image}\n \
+@end deftypefn")
+{
+  if (args.length () < 1 || args.length () > 3)
+    {
+      print_usage ();
+      return octave_value ();
+    }
+
+  if (! args (0).isnumeric () && ! args (0).islogical ())
+    {
+      error ("fits_encode: image should be a numeric array");
+      return octave_value ();
+    }
+
+  int bitpix = DOUBLE_IMG;
+  if (args.length () > 1 && ! get_bitpix (args (1), bitpix))
+    {
+      error ("fits_encode: invalid bit_per_pixel");
+      return octave_value ();
+    }
+
+  string_vector header;
+  if (args.length () > 2)
+    {
+      if (args (2).iscellstr ())
+        header = string_vector (args (2).cellstr_value ());
+      else if (args (2).is_string ())
+        header = args (2).string_vector_value ();
+      else
+        {
+          error ("fits_encode: header should be a cellstr or char matrix");
+          return octave_value ();
+        }
+    }
+
+  const NDArray image = args (0).array_value ();
+  dim_vector dims = image.dims ();
+  int naxis = dims.length ();
+  std::vector<long> naxes (naxis);
+  for (int i = 0; i < naxis; i++)
+    naxes[i] = dims(i);
+
+  int status = 0;
+  fitsfile *fp;
+  void *buf = NULL;
+  size_t bufsize = 0;
+
+  if (fits_create_memfile (&fp, &buf, &bufsize, 0, realloc, &status) > 0)
+    {
+      fits_report_error (stderr, status);
+      error ("fits_encode: couldnt create memory file");
+      return octave_value ();
+    }
+
+  fits_create_img (fp, bitpix, naxis, naxes.data (), &status);
+
+  for (octave_idx_type i = 0; i < header.numel () && status <= 0; i++)
+    {
+      std::string card = header[i];
+      if (! is_image_keyword (card))
+        fits_write_record (fp, card.c_str (), &status);
+    }
+
+  if (image.numel () > 0)
+    fits_write_img (fp, TDOUBLE, 1, image.numel (),
+                    const_cast<double *> (image.fortran_vec ()), &status);
+
+  // the end of the data, padded to a whole block, is the size of the file
+  LONGLONG headstart, datastart, dataend = 0;
+  fits_flush_file (fp, &status);
+  fits_get_hduaddrll (fp, &headstart, &datastart, &dataend, &status);
+
+  int cstatus = 0;
+  fits_close_file (fp, &cstatus);
+
+  if (status <= 0)
+    status = cstatus;
+
+  if (status > 0)
+    {
+      free (buf);
+      fits_report_error (stderr, status);
+      error ("fits_encode: couldnt encode image");
+      return octave_value ();
+    }
+
+  uint8NDArray bytes (dim_vector (dataend, 1));
+  memcpy (bytes.fortran_vec (), buf, dataend);
+  free (buf);
+
+  return octave_value (bytes);
+}
+
+// PKG_ADD: autoload ("fits_decode", "fits_memory.oct");
+DEFUN_DLD(fits_decode, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {[@var{image}, @var{header}] = } fits_decode(@var{bytes})\n \
+@deftypefnx {Function File} {[@var{image}, @var{header}] = } fits_decode(@var{bytes}, @var{hdu})\n \
+Decode a FITS file held in memory as the uint8 vector @var{bytes}\n \
+\n \
+The first HDU containing an image, or HDU @var{hdu} (0 for the primary HDU), is read\n \
+into @var{image} as a double array, with its header cards in @var{header},\n \
+as read_fits_image does.\n \
+\n \
+The bytes are read in place with cfitsio fits_open_memfile, so nothing is written to disk.\n \
+@seealso {fits_encode, read_fits_image}\n \
+@end deftypefn")
+{
+  octave_value_list ret;
+
+  if (args.length () < 1 || args.length () > 2)
+    {
+      print_usage ();
+      return octave_value ();
+    }
+
+  if (! args (0).is_uint8_type ())
+    {
+      error ("fits_decode: bytes should be a uint8 vector");
+      return octave_value ();
+    }
+
+  int hdu = -1;
+  if (args.length () > 1)
+    {
+      if (! args (1).is_scalar_type () || args (1).double_value () < 0)
+        {
+          error ("fits_decode: hdu should be a non-negative value");
+          return octave_value ();
+        }
+      hdu = args (1).int_value ();
+    }
+
+  const uint8NDArray bytes = args (0).uint8_array_value ();
+
+  // opened read only, so cfitsio neither writes to nor frees the buffer
+  void *buf = const_cast<octave_uint8 *> (bytes.fortran_vec ());
+  size_t bufsize = bytes.numel ();
+  int status = 0;
+  fitsfile *fp;
+
+  if (fits_open_memfile (&fp, "fits_decode", READONLY, &buf, &bufsize, 0,
+                         NULL, &status) > 0)
+    {
+      fits_report_error (stderr, status);
+      error ("fits_decode: couldnt open FITS data");
+      return octave_value ();
+    }
+
+  // move to the requested HDU, or the first holding an image
+  int naxis = 0;
+  if (hdu >= 0)
+    fits_movabs_hdu (fp, hdu + 1, NULL, &status);
+  else
+    {
+      int hdutype = IMAGE_HDU;
+      fits_get_img_dim (fp, &naxis, &status);
+      while (status <= 0 && naxis == 0)
+        {
+          if (fits_movrel_hdu (fp, 1, &hdutype, &status) > 0)
+            break;
+          if (hdutype == IMAGE_HDU || fits_is_compressed_image (fp, &status))
+            fits_get_img_dim (fp, &naxis, &status);
+        }
+    }
+
+  int bitpix;
+  std::vector<long> naxes (999);
+  fits_get_img_param (fp, naxes.size (), &bitpix, &naxis, naxes.data (), &status);
+
+  if (status > 0)
+    {
+      int cstatus = 0;
+      fits_report_error (stderr, status);
+      fits_close_file (fp, &cstatus);
+      error ("fits_decode: couldnt find an image");
+      return octave_value ();
+    }
+
+  // header cards, terminated by END as in read_fits_image
+  int nkeys;
+  char card[FLEN_CARD];
+  string_vector header;
+  fits_get_hdrspace (fp, &nkeys, NULL, &status);
+  for (int i = 1; i <= nkeys && status <= 0; i++)
+    {
+      fits_read_record (fp, i, card, &status);
+      header.append (std::string (card));
+    }
+  header.append (std::string ("END\n"));
+
+  dim_vector dims;
+  dims.resize (std::max (naxis, 2));
+  dims(0) = dims(1) = 1;
+  for (int i = 0; i < naxis; i++)
+    dims(i) = naxes[i];
+
+  NDArray image (dims);
+  int anynul = 0;
+  if (image.numel () > 0)
+    fits_read_img (fp, TDOUBLE, 1, image.numel (), NULL, image.fortran_vec (),
+                   &anynul, &status);
+
+  int cstatus = 0;
+  fits_close_file (fp, &cstatus);
+
+  if (status > 0)
+    {
+      fits_report_error (stderr, status);
+      error ("fits_decode: couldnt read image");
+      return octave_value ();
+    }
+
+  ret(0) = image;
+  ret(1) = header;
+
+  return ret;
+}
+
+#if 0
+%!error <fits_encode: image> fits_encode("abc")
+%!error <fits_decode: bytes> fits_decode([1 2 3])
+
+%!test
+%! data = reshape(1:24, 4, 3, 2);
+%! bytes = fits_encode(data, 16, {"OBJECT  = 'test    '", "EXPTIME =                 30.0"});
+%! assert(class(bytes), "uint8");
+%! assert(mod(numel(bytes), 2880), 0);
+%! [rd, hdr] = fits_decode(bytes);
+%! assert(rd, data);
+%! assert(any(strncmp(cellstr(hdr), "OBJECT  = 'test    '", 20)));
+%! assert(any(strncmp(cellstr(hdr), "BITPIX  =                   16", 30)));
+%! [rd2, hdr2] = fits_decode(fits_encode(rd, -64, hdr));
+%! assert(rd2, data);
+%! assert(any(strncmp(cellstr(hdr2), "EXPTIME =", 9)));
+
+%!test
+%! testfile = [tempname() ".fits"];
+%! data = magic(5);
+%! save_fits_image(testfile, data);
+%! fid = fopen(testfile, "r");
+%! bytes = fread(fid, Inf, "uint8=>uint8");
+%! fclose(fid);
+%! delete(testfile);
+%! assert(fits_decode(bytes), data);
+%! assert(fits_decode(bytes, 0), data);
+#endif
@@ -0,0 +1,201 @@
+// Conversion of pixel values to the big endian form of a FITS data unit,
+// for writers that fill data units themselves rather than through
+// cfitsio.  Values are converted as cfitsio does, so a file is the same
+// whichever writes it: floating point values are truncated towards zero
+// for integer types, or rounded to the nearest integer for the types
+// stored with BZERO (SBYTE_IMG, USHORT_IMG and ULONG_IMG), and values
+// more than 0.49 beyond the range of the type are an overflow, set to its
+// smallest or largest value and reported as cfitsio reports NUM_OVERFLOW.
+// NaN is left to the C conversion, as cfitsio leaves it.
+
+#ifndef FITS_PIXELS_H
+#define FITS_PIXELS_H
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdint.h>
+
+template <size_t N> struct fits_uint_bits;
+template <> struct fits_uint_bits<1> { typedef uint8_t type; };
+template <> struct fits_uint_bits<2> { typedef uint16_t type; };
+template <> struct fits_uint_bits<4> { typedef uint32_t type; };
+template <> struct fits_uint_bits<8> { typedef uint64_t type; };
+
+// the type T is stored as with BZERO
+template <typename T> struct fits_stored { typedef T type; };
+template <> struct fits_stored<int8_t> { typedef uint8_t type; };
+template <> struct fits_stored<uint16_t> { typedef int16_t type; };
+template <> struct fits_stored<uint32_t> { typedef int32_t type; };
+template <> struct fits_stored<uint64_t> { typedef int64_t type; };
+
+// the value v in type T, setting overflow if it is out of range
+template <typename T, typename S>
+static inline T
+fits_convert_value (S v, bool& overflow)
+{
+  typedef std::numeric_limits<T> lim;
+
+  if (! lim::is_integer)
+    return T (v);
+
+  if (! std::numeric_limits<S>::is_integer)
+    {
+      if (v != v)
+        return T (v);
+      if (double (v) < double (lim::min ()) - 0.49)
+        {
+          overflow = true;
+          return lim::min ();
+        }
+      // 64 bit types to 2^bits, or 2^(bits-1) if signed, exactly
+      if (sizeof (T) == 8 ? double (v) >= double (lim::max () / 2 + 1) * 2
+                          : double (v) > double (lim::max ()) + 0.49)
+        {
+          overflow = true;
+          return lim::max ();
+        }
+      return T (v);
+    }
+
+  if (v < 0 && (! lim::is_signed || (long long) v < (long long) lim::min ()))
+    {
+      overflow = true;
+      return lim::min ();
+    }
+  if (v > 0 && (unsigned long long) v > (unsigned long long) lim::max ())
+    {
+      overflow = true;
+      return lim::max ();
+    }
+
+  return T (v);
+}
+
+// the value d, less BZERO, as stored in type R, rounded as cfitsio rounds
+// it, halves away from zero
+template <typename R>
+static inline R
+fits_round_stored (double d, bool& overflow)
+{
+  typedef std::numeric_limits<R> lim;
+
+  if (d != d)
+    return R (d);
+  if (d < double (lim::min ()) - 0.49)
+    {
+      overflow = true;
+      return lim::min ();
+    }
+  if (d > double (lim::max ()) + 0.49)
+    {
+      overflow = true;
+      return lim::max ();
+    }
+
+  return d >= 0 ? R (d + 0.5) : R (d - 0.5);
+}
+
+// convert n values to type T, stored big endian at out.  With offset,
+// T is stored with BZERO: its sign bit is flipped, storing an unsigned T
+// as the signed type of its size, or a signed byte as an unsigned one.
+// Returns false if any value overflows T.
+template <typename T, typename S>
+static inline bool
+fits_encode_as (const S *src, size_t n, unsigned char *out,
+                bool offset = false)
+{
+  typedef typename fits_uint_bits<sizeof (T)>::type U;
+  typedef typename fits_stored<T>::type R;
+  typedef std::numeric_limits<T> lim;
+
+  const U sign = offset ? U (1) << (8 * sizeof (T) - 1) : 0;
+  // 64 bit values are truncated as they are, as double can not hold them
+  // less BZERO
+  const bool round = offset && ! std::numeric_limits<S>::is_integer
+                     && sizeof (T) < 8;
+  const double zero = lim::is_signed ? double (lim::min ())
+                                     : double (lim::max () / 2 + 1);
+  bool overflow = false;
+
+  for (size_t i = 0; i < n; i++, out += sizeof (T))
+    {
+      U u;
+      if (round)
+        {
+          R r = fits_round_stored<R> (double (src[i]) - zero, overflow);
+          memcpy (&u, &r, sizeof (T));
+        }
+      else
+        {
+          T t = fits_convert_value<T> (src[i], overflow);
+          memcpy (&u, &t, sizeof (T));
+          u ^= sign;
+        }
+      for (size_t k = 0; k < sizeof (T); k++)
+        out[k] = (u >> (8 * (sizeof (T) - 1 - k))) & 0xff;
+    }
+
+  return ! overflow;
+}
+
+// bytes per pixel of an image of type bitpix, 0 if it is not a FITS type
+static inline size_t
+fits_pixel_bytes (int bitpix)
+{
+  switch (bitpix)
+    {
+      case BYTE_IMG:
+      case SBYTE_IMG:
+        return 1;
+      case SHORT_IMG:
+      case USHORT_IMG:
+        return 2;
+      case LONG_IMG:
+      case ULONG_IMG:
+      case FLOAT_IMG:
+        return 4;
+      case LONGLONG_IMG:
+      case ULONGLONG_IMG:
+      case DOUBLE_IMG:
+        return 8;
+      default:
+        return 0;
+    }
+}
+
+// convert n values to the pixels of an image of type bitpix, stored at
+// out.  Returns false for a bitpix that is not one of the FITS types, or
+// if any value overflows it; all n pixels are still converted.
+template <typename S>
+static inline bool
+fits_encode_pixels (const S *src, size_t n, int bitpix, unsigned char *out)
+{
+  switch (bitpix)
+    {
+      case BYTE_IMG:
+        return fits_encode_as<uint8_t> (src, n, out);
+      case SBYTE_IMG:
+        return fits_encode_as<int8_t> (src, n, out, true);
+      case SHORT_IMG:
+        return fits_encode_as<int16_t> (src, n, out);
+      case USHORT_IMG:
+        return fits_encode_as<uint16_t> (src, n, out, true);
+      case LONG_IMG:
+        return fits_encode_as<int32_t> (src, n, out);
+      case ULONG_IMG:
+        return fits_encode_as<uint32_t> (src, n, out, true);
+      case LONGLONG_IMG:
+        return fits_encode_as<int64_t> (src, n, out);
+      case ULONGLONG_IMG:
+        return fits_encode_as<uint64_t> (src, n, out, true);
+      case FLOAT_IMG:
+        return fits_encode_as<float> (src, n, out);
+      case DOUBLE_IMG:
+        return fits_encode_as<double> (src, n, out);
+      default:
+        return false;
+    }
+}
+
+#endif
@@ -0,0 +1,45 @@
+// Whether a file name given to cfitsio is a plain file on disk, whose
+// HDUs are at the byte offsets cfitsio reports for them, so they can be
+// read or written with read, pread and pwrite.  Names of compressed
+// files, of files in memory or on other cfitsio drivers, of the standard
+// streams, and names with filters or sections in brackets are not.  The
+// writers (save_fits_image_multi_ext, fits_concat) and the readers
+// (fits_concat, fits_verifyChecksum, fits_editHDUs) all decide with this.
+
+#ifndef FITS_PLAIN_FILE_H
+#define FITS_PLAIN_FILE_H
+
+#include <string>
+#include <strings.h>
+
+// whether path, without a leading '!', is a plain file
+static inline bool
+fits_is_plain_path (const std::string &path)
+{
+  return ! path.empty () && path != "-"
+         && path.find_first_of ("[]") == std::string::npos
+         && path.find ("://") == std::string::npos
+         && strncasecmp (path.c_str (), "mem:", 4) != 0
+         && strncasecmp (path.c_str (), "stdin", 5) != 0
+         && strncasecmp (path.c_str (), "stdout", 6) != 0
+         && ! (path.size () > 3 && path.compare (path.size () - 3, 3, ".gz") == 0)
+         && ! (path.size () > 2 && path.compare (path.size () - 2, 2, ".Z") == 0);
+}
+
+// whether the name of a file to write is a plain file, setting path to it
+// without the leading '!' that has cfitsio overwrite it
+static inline bool
+fits_plain_output (const std::string &name, std::string &path)
+{
+  path = (! name.empty () && name[0] == '!') ? name.substr (1) : name;
+  return fits_is_plain_path (path);
+}
+
+// whether the name of a file to read is a plain file
+static inline bool
+fits_plain_input (const std::string &name)
+{
+  return ! name.empty () && name[0] != '!' && fits_is_plain_path (name);
+}
+
+#endif
@@ -0,0 +1,89 @@
+// Read only handles on one file for worker threads, used by the image
+// reads of fits_readImg, fits_readSubset and fits_readCutout on files
+// opened 'CONCURRENT'.  cfitsio keeps the current HDU and the I/O buffers
+// in each fitsfile, so threads can not read through one handle at the
+// same time.  Instead each reader takes a handle of its own from the pool
+// for as long as it reads, positioned at the HDU it asks for.  A handle
+// is opened the first time there is no idle one, and kept until the pool
+// is closed, so later parallel reads of the file do not reopen it.
+
+#ifndef FITS_READER_POOL_H
+#define FITS_READER_POOL_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+class
+fits_reader_pool
+{
+public:
+
+  fits_reader_pool (void) { }
+
+  ~fits_reader_pool (void) { close (); }
+
+  // the file to open handles on, or "" for none
+  void set_file (const std::string &name)
+  {
+    close ();
+    filename = name;
+  }
+
+  bool is_enabled (void) const { return ! filename.empty (); }
+
+  // a handle on the file at HDU hdunum, for the calling thread only until
+  // it is released.  NULL if it could not be opened.
+  fitsfile * acquire (int hdunum, int *status)
+  {
+    fitsfile *fp = NULL;
+
+    {
+      std::lock_guard<std::mutex> guard (lock);
+      if (! idle.empty ())
+        {
+          fp = idle.back ();
+          idle.pop_back ();
+        }
+    }
+
+    // opened outside the lock, so threads can open theirs together
+    if (! fp && fits_open_file (&fp, filename.c_str (), READONLY, status) > 0)
+      return NULL;
+
+    if (fits_movabs_hdu (fp, hdunum, NULL, status) > 0)
+      {
+        release (fp);
+        return NULL;
+      }
+
+    return fp;
+  }
+
+  void release (fitsfile *fp)
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    idle.push_back (fp);
+  }
+
+  // close the handles, once no reader holds one
+  void close (void)
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    for (size_t i = 0; i < idle.size (); i++)
+      {
+        int status = 0;
+        fits_close_file (idle[i], &status);
+      }
+    idle.clear ();
+    filename = "";
+  }
+
+private:
+
+  std::string filename;
+  std::mutex lock;
+  std::vector<fitsfile *> idle;
+};
+
+#endif
@@ -0,0 +1,63 @@
+// Helpers to split work over a few short lived worker threads.  The
+// workers are started and joined within each call, so no thread outlives
+// the function that started it (the .oct file may be unloaded at any
+// time).  Worker code must not call into Octave, as only the main thread
+// may do that; errors are passed back to the caller instead.
+
+#ifndef FITS_THREADS_H
+#define FITS_THREADS_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// number of threads to use, from the OCTAVE_FITS_THREADS environment
+// variable if set, else the number of hardware threads
+static inline int
+fits_num_threads (void)
+{
+  const char *env = getenv ("OCTAVE_FITS_THREADS");
+  int n = env ? atoi (env) : 0;
+
+  if (n < 1)
+    n = std::thread::hardware_concurrency ();
+
+  return std::max (n, 1);
+}
+
+// call fn (begin, end) on up to nthreads contiguous slices of [0, n).
+// The first slice runs on the calling thread, and a slice whose thread
+// could not be started is also run there.
+template <typename F>
+static void
+fits_parallel_for (size_t n, int nthreads, F fn)
+{
+  if (n == 0)
+    return;
+
+  size_t nslices = std::min<size_t> (std::max (nthreads, 1), n);
+  size_t chunk = (n + nslices - 1) / nslices;
+  std::vector<std::thread> workers;
+
+  for (size_t b = chunk; b < n; b += chunk)
+    {
+      size_t e = std::min (n, b + chunk);
+      try
+        {
+          workers.emplace_back (fn, b, e);
+        }
+      catch (const std::system_error &)
+        {
+          fn (b, e);
+        }
+    }
+
+  fn (0, std::min (chunk, n));
+
+  for (size_t i = 0; i < workers.size (); i++)
+    workers[i].join ();
+}
+
+#endif
@@ -0,0 +1,109 @@
+// A least recently used cache of decompressed image tiles, kept with
+// each open file so that cutouts of a tile compressed image only
+// decompress the tiles that have not been used recently.  The cache is
+// only used from the main thread.
+
+#ifndef FITS_TILE_CACHE_H
+#define FITS_TILE_CACHE_H
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+
+class
+fits_tile_cache
+{
+public:
+
+  // hdu number, tile index
+  typedef std::pair<int, long long> key_type;
+  typedef std::vector<double> tile_type;
+
+  static const size_t default_budget = 64 << 20;
+
+  fits_tile_cache (size_t budget = default_budget)
+    : budget (budget), used (0) { }
+
+  // get a cached tile, which becomes the most recently used, or NULL.
+  // The tile is only valid until the next insert.
+  const tile_type * find (const key_type &key)
+  {
+    map_type::iterator it = index.find (key);
+
+    if (it == index.end ())
+      return NULL;
+
+    entries.splice (entries.begin (), entries, it->second);
+    return &it->second->second;
+  }
+
+  // add a tile, taking its data, and drop the least recently used tiles
+  // beyond the memory budget.  Tiles larger than the budget are not kept.
+  void insert (const key_type &key, tile_type &tile)
+  {
+    size_t bytes = tile.size () * sizeof (double);
+
+    if (bytes > budget)
+      return;
+
+    erase (key);
+    entries.push_front (std::make_pair (key, tile_type ()));
+    entries.front ().second.swap (tile);
+    index[key] = entries.begin ();
+    used += bytes;
+
+    trim (budget);
+  }
+
+  void erase (const key_type &key)
+  {
+    map_type::iterator it = index.find (key);
+
+    if (it != index.end ())
+      {
+        used -= it->second->second.size () * sizeof (double);
+        entries.erase (it->second);
+        index.erase (it);
+      }
+  }
+
+  void clear (void)
+  {
+    entries.clear ();
+    index.clear ();
+    used = 0;
+  }
+
+  void set_budget (size_t bytes)
+  {
+    budget = bytes;
+    trim (budget);
+  }
+
+  size_t get_budget (void) const { return budget; }
+  size_t get_used (void) const { return used; }
+
+private:
+
+  typedef std::list<std::pair<key_type, tile_type> > list_type;
+  typedef std::map<key_type, list_type::iterator> map_type;
+
+  void trim (size_t limit)
+  {
+    while (used > limit && ! entries.empty ())
+      {
+        used -= entries.back ().second.size () * sizeof (double);
+        index.erase (entries.back ().first);
+        entries.pop_back ();
+      }
+  }
+
+  size_t budget;
+  size_t used;
+  list_type entries;
+  map_type index;
+};
+
+#endif
@@ -0,0 +1,37 @@
+// Swapping the first two axes of an image while it is read or written.
+// fitsread and fitswrite return and take images with their first two
+// axes swapped from the order in the file.  Rather than permuting a copy
+// of the whole image, the pixels go through a buffer of a block of rows,
+// small enough to stay in cache, that cfitsio converts from or to the
+// type in the file; the rows are transposed between the buffer and the
+// image a square block at a time.
+
+#ifndef FITS_TRANSPOSE_H
+#define FITS_TRANSPOSE_H
+
+#include <algorithm>
+
+// number of pixels in the buffer of rows
+static const long long fits_transpose_elems = 1 << 15;
+
+// dst = src.', for src of rows by cols, column major with leading
+// dimensions src_ld and dst_ld
+template <typename T>
+static inline void
+fits_transpose (const T *src, long long src_ld, T *dst, long long dst_ld,
+                long long rows, long long cols)
+{
+  const long long block = 32;
+
+  for (long long j0 = 0; j0 < cols; j0 += block)
+    for (long long i0 = 0; i0 < rows; i0 += block)
+      {
+        long long i1 = std::min (i0 + block, rows);
+        long long j1 = std::min (j0 + block, cols);
+        for (long long j = j0; j < j1; j++)
+          for (long long i = i0; i < i1; i++)
+            dst[j + i * dst_ld] = src[i + j * src_ld];
+      }
+}
+
+#endif
@@ -0,0 +1,484 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <octave/oct.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_PWRITE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+extern "C"
+{
+#include <fitsio.h>
+}
+
+#include "fits_threads.h"
+#include "fits_checksum.h"
+#include "fits_plain_file.h"
+
+// bytes summed by a worker at a time, a whole number of FITS blocks
+static const LONGLONG verify_chunk_bytes = 2880 * 2048;
+
+// files open at once, while their HDUs are summed together
+static const size_t verify_batch_files = 64;
+
+/*
+ * an HDU to verify: where it is, the DATASUM it gives, and the sums of
+ * its header and data found in the file.  A status is 1 if the sum is
+ * right, 0 if the keyword is missing and -1 if it is wrong, as cfitsio
+ * fits_verify_chksum gives.
+ */
+struct hdu_check
+{
+  hdu_check (void) : headstart (0), datastart (0), dataend (0), datasum (0),
+                     datastatus (0), hdustatus (0), unreadable (false) { }
+
+  LONGLONG headstart;
+  LONGLONG datastart;
+  LONGLONG dataend;
+  unsigned long datasum;
+  int datastatus;
+  int hdustatus;
+  fits_checksum header_sum;
+  fits_checksum data_sum;
+  bool unreadable;
+};
+
+struct file_check
+{
+  file_check (void) : raw (false) { }
+
+  std::vector<hdu_check> hdus;
+  bool raw;              // summed from the bytes of the file
+  std::string error;
+};
+
+/*
+ * mark HDU h as not verified, as for a wrong sum
+ */
+static void
+set_failed (hdu_check &h)
+{
+  h.datastatus = h.hdustatus = -1;
+  h.unreadable = true;
+}
+
+/*
+ * read the addresses and checksum keywords of the HDUs of file name to
+ * check, all of them if hdus is empty.  HDUs of a file that is not plain
+ * are verified by cfitsio here.  If the file can not be read, or has no
+ * HDU of hdus, fc.error says why, and the HDUs that could not be read
+ * are marked failed (a single one for all HDUs of a file that can not
+ * be opened).
+ */
+static void
+read_headers (const std::string &name, const std::vector<int> &hdus,
+              file_check &fc)
+{
+  int status = 0;
+  fitsfile *fp;
+
+  if (fits_open_file (&fp, name.c_str (), READONLY, &status) > 0)
+    {
+      fc.error = "couldnt open " + name;
+      fc.hdus.resize (std::max<size_t> (hdus.size (), 1));
+      for (size_t k = 0; k < fc.hdus.size (); k++)
+        set_failed (fc.hdus[k]);
+      return;
+    }
+
+  int nhdus = 0;
+  fits_get_num_hdus (fp, &nhdus, &status);
+
+  std::vector<int> list (hdus);
+  for (int i = 0; list.empty () && i < nhdus; i++)
+    list.push_back (i + 1);
+
+#ifdef HAVE_PWRITE
+  fc.raw = fits_plain_input (name);
+#endif
+  fc.hdus.resize (list.size ());
+
+  size_t k = 0;
+  for (; k < list.size () && status <= 0; k++)
+    {
+      hdu_check &h = fc.hdus[k];
+
+      if (list[k] > nhdus)
+        {
+          std::ostringstream msg;
+          msg << name << " has no HDU " << list[k];
+          if (fc.error.empty ())
+            fc.error = msg.str ();
+          set_failed (h);
+          continue;
+        }
+
+      fits_movabs_hdu (fp, list[k], NULL, &status);
+
+      if (! fc.raw)
+        {
+          fits_verify_chksum (fp, &h.datastatus, &h.hdustatus, &status);
+          continue;
+        }
+
+      fits_get_hduaddrll (fp, &h.headstart, &h.datastart, &h.dataend,
+                          &status);
+
+      char value[FLEN_VALUE], comment[FLEN_COMMENT];
+      h.hdustatus = 1;
+      if (fits_read_key_str (fp, "CHECKSUM", value, comment, &status)
+          == KEY_NO_EXIST)
+        {
+          status = 0;
+          h.hdustatus = 0;
+        }
+      h.datastatus = 1;
+      if (fits_read_key_str (fp, "DATASUM", value, comment, &status)
+          == KEY_NO_EXIST)
+        {
+          status = 0;
+          h.datastatus = 0;
+        }
+      else
+        h.datasum = strtoul (value, NULL, 10);
+    }
+
+  if (status > 0)
+    {
+      if (fc.error.empty ())
+        fc.error = "couldnt read " + name;
+      // the HDU being read when it failed, and those after it
+      for (k = k > 0 ? k - 1 : 0; k < list.size (); k++)
+        set_failed (fc.hdus[k]);
+    }
+
+  int cstatus = 0;
+  fits_close_file (fp, &cstatus);
+}
+
+#ifdef HAVE_PWRITE
+
+/*
+ * a run of bytes of an HDU, summed by one worker
+ */
+struct sum_range
+{
+  size_t file;
+  size_t hdu;
+  LONGLONG start;
+  LONGLONG len;
+  bool header;
+};
+
+// add the chunks of [start, end) of HDU hdu of file to ranges
+static void
+add_ranges (std::vector<sum_range> &ranges, size_t file, size_t hdu,
+            LONGLONG start, LONGLONG end, bool header)
+{
+  for (LONGLONG p = start; p < end; p += verify_chunk_bytes)
+    {
+      sum_range r = { file, hdu, p, std::min (verify_chunk_bytes, end - p),
+                      header };
+      ranges.push_back (r);
+    }
+}
+
+/*
+ * Sum the HDUs of files [b, e) that are plain files.  The headers and
+ * data units of all of them are split into chunks that the workers read
+ * and sum on their own; as the sum is associative, the sums of the
+ * chunks add to the sums of each header and data unit.
+ */
+static void
+sum_files (const string_vector &files, std::vector<file_check> &checks,
+           size_t b, size_t e)
+{
+  std::vector<int> fds (e - b, -1);
+  std::vector<sum_range> ranges;
+
+  for (size_t f = b; f < e; f++)
+    {
+      if (! checks[f].raw)
+        continue;
+
+      fds[f - b] = open (files[f].c_str (), O_RDONLY);
+
+      for (size_t k = 0; k < checks[f].hdus.size (); k++)
+        {
+          hdu_check &h = checks[f].hdus[k];
+          if (h.unreadable)
+            continue;
+          if (fds[f - b] < 0)
+            {
+              h.unreadable = true;
+              continue;
+            }
+          // the header and data are summed apart, for DATASUM
+          add_ranges (ranges, f, k, h.headstart, h.datastart, true);
+          add_ranges (ranges, f, k, h.datastart, h.dataend, false);
+        }
+    }
+
+  std::vector<fits_checksum> sums (ranges.size ());
+  std::vector<char> failed (ranges.size (), 0);
+
+  fits_parallel_for (ranges.size (), fits_num_threads (),
+                     [&] (size_t rb, size_t re)
+    {
+      std::vector<unsigned char> buf (verify_chunk_bytes);
+      for (size_t i = rb; i < re; i++)
+        {
+          const sum_range &r = ranges[i];
+          int fd = fds[r.file - b];
+          for (LONGLONG got = 0; got < r.len; )
+            {
+              ssize_t n = pread (fd, buf.data () + got, r.len - got,
+                                 r.start + got);
+              if (n < 0 && errno == EINTR)
+                continue;
+              if (n <= 0)
+                {
+                  failed[i] = 1;
+                  break;
+                }
+              got += n;
+            }
+          if (! failed[i])
+            sums[i].add (buf.data (), r.len, r.start);
+        }
+    });
+
+  for (size_t i = 0; i < ranges.size (); i++)
+    {
+      hdu_check &h = checks[ranges[i].file].hdus[ranges[i].hdu];
+      if (failed[i])
+        h.unreadable = true;
+      else if (ranges[i].header)
+        h.header_sum.add (sums[i]);
+      else
+        h.data_sum.add (sums[i]);
+    }
+
+  for (size_t f = 0; f < fds.size (); f++)
+    if (fds[f] >= 0)
+      close (fds[f]);
+}
+
+#endif
+
+/*
+ * set the status of each summed HDU of fc from its sums
+ */
+static void
+set_status (file_check &fc)
+{
+  for (size_t k = 0; fc.raw && k < fc.hdus.size (); k++)
+    {
+      hdu_check &h = fc.hdus[k];
+
+      // a file cut short can not match its sums
+      if (h.unreadable)
+        {
+          if (h.datastatus)
+            h.datastatus = -1;
+          if (h.hdustatus)
+            h.hdustatus = -1;
+          continue;
+        }
+
+      if (h.datastatus == 1 && h.data_sum.value () != h.datasum)
+        h.datastatus = -1;
+
+      // a right CHECKSUM makes the HDU sum to 0 (or -0)
+      fits_checksum hdu (h.header_sum);
+      hdu.add (h.data_sum);
+      if (h.hdustatus == 1 && hdu.value () != 0 && hdu.value () != 0xffffffff)
+        h.hdustatus = -1;
+    }
+}
+
+// PKG_ADD: autoload ("fits_verifyChecksum", "fits_verify.oct");
+DEFUN_DLD(fits_verifyChecksum, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {[@var{datastatus}, @var{hdustatus}, @var{errmsg}] = } fits_verifyChecksum(@var{filename})\n \
+@deftypefnx {Function File} {[@var{datastatus}, @var{hdustatus}, @var{errmsg}] = } fits_verifyChecksum(@var{filename}, @var{hdus})\n \
+Verify the DATASUM and CHECKSUM keywords of the HDUs of the FITS file @var{filename}\n \
+\n \
+@var{hdus} are the numbers of the HDUs to verify, starting from 1; by default all HDUs are verified.\n \
+The status of each HDU is returned in the row vectors @var{datastatus} and @var{hdustatus}: 1 if the\n \
+checksum is correct, 0 if the keyword is missing and -1 if it is wrong, as fits_verify_chksum gives.\n \
+\n \
+If @var{filename} is a cellstr of file names, the HDUs of all of them are verified together, and\n \
+@var{datastatus} and @var{hdustatus} are cell arrays with the status vectors of each file.  A file\n \
+that can not be read, or has no HDU of @var{hdus}, does not stop the others being verified: its HDUs\n \
+that could not be read have status -1 (a single -1 for a file that can not be opened, if @var{hdus}\n \
+is not given), and the cell array @var{errmsg} says what went wrong for each file, or is empty for\n \
+files read in full.  For a single file name, such an error is raised instead.\n \
+\n \
+Plain files are read in chunks that are summed on several threads, as many as the environment\n \
+variable OCTAVE_FITS_THREADS sets; the chunks of many files are shared out between the threads\n \
+together.  Other files, such as compressed ones, are verified by cfitsio.\n \
+@seealso {fits_writeChecksum}\n \
+@end deftypefn")
+{
+  if (args.length () < 1 || args.length () > 2)
+    {
+      print_usage ();
+      return octave_value ();
+    }
+
+  bool many = args (0).iscellstr ();
+  if (! many && ! args (0).is_string ())
+    {
+      error ("fits_verifyChecksum: filename should be a file name or cellstr of file names");
+      return octave_value ();
+    }
+
+  string_vector files = many ? string_vector (args (0).cellstr_value ())
+                             : string_vector (args (0).string_value ());
+
+  std::vector<int> hdus;
+  if (args.length () > 1)
+    {
+      if (! args (1).isnumeric ())
+        {
+          error ("fits_verifyChecksum: hdus should be HDU numbers");
+          return octave_value ();
+        }
+      NDArray h = args (1).array_value ();
+      for (octave_idx_type i = 0; i < h.numel (); i++)
+        {
+          if (h(i) < 1 || OCTAVE__D_NINT (h(i)) != h(i))
+            {
+              error ("fits_verifyChecksum: hdus should be HDU numbers");
+              return octave_value ();
+            }
+          hdus.push_back (int (h(i)));
+        }
+    }
+
+  std::vector<file_check> checks (files.numel ());
+  const int nthreads = fits_is_reentrant () ? fits_num_threads () : 1;
+
+  for (size_t b = 0; b < checks.size (); b += verify_batch_files)
+    {
+      size_t e = std::min (checks.size (), b + verify_batch_files);
+
+      fits_parallel_for (e - b, nthreads, [&] (size_t fb, size_t fe)
+        {
+          for (size_t f = b + fb; f < b + fe; f++)
+            read_headers (files[f], hdus, checks[f]);
+        });
+
+      if (! many && ! checks[0].error.empty ())
+        {
+          error ("fits_verifyChecksum: %s", checks[0].error.c_str ());
+          return octave_value ();
+        }
+
+#ifdef HAVE_PWRITE
+      sum_files (files, checks, b, e);
+#endif
+
+      for (size_t f = b; f < e; f++)
+        set_status (checks[f]);
+    }
+
+  Cell datastatus (many ? args (0).dims () : dim_vector (1, 1));
+  Cell hdustatus (datastatus.dims ());
+  Cell errmsg (datastatus.dims ());
+
+  for (size_t f = 0; f < checks.size (); f++)
+    {
+      const std::vector<hdu_check> &h = checks[f].hdus;
+      RowVector d (h.size ()), s (h.size ());
+      for (size_t k = 0; k < h.size (); k++)
+        {
+          d(k) = h[k].datastatus;
+          s(k) = h[k].hdustatus;
+        }
+      datastatus(f) = d;
+      hdustatus(f) = s;
+      errmsg(f) = checks[f].error;
+    }
+
+  octave_value_list ret;
+  if (many)
+    {
+      ret(0) = datastatus;
+      ret(1) = hdustatus;
+      ret(2) = errmsg;
+    }
+  else
+    {
+      ret(0) = datastatus(0);
+      ret(1) = hdustatus(0);
+      ret(2) = errmsg(0);
+    }
+
+  return ret;
+}
+
+#if 0
+%!error <fits_verifyChecksum: filename should be> fits_verifyChecksum(1)
+
+%!error <fits_verifyChecksum: hdus should be> fits_verifyChecksum("a.fits", 0)
+
+%!test
+%! file1 = tempname();
+%! file2 = tempname();
+%! data = reshape(sin(1:(700*600*3)), 700, 600, 3);
+%! save_fits_image_multi_ext(file1, data, -32, {[], [], []}, "Checksum", true);
+%! save_fits_image_multi_ext(file2, data(:,:,1:2), 16);
+%! [datastatus, hdustatus] = fits_verifyChecksum(file1);
+%! assert(datastatus, [1 1 1]);
+%! assert(hdustatus, [1 1 1]);
+%! [datastatus, hdustatus] = fits_verifyChecksum(file2);
+%! assert(datastatus, [0 0]);
+%! assert(hdustatus, [0 0]);
+%! ## change a pixel of the second extension
+%! fd = fits_openFile(file1, "READWRITE");
+%! fits_movAbsHDU(fd, 2);
+%! fits_writeImg(fd, single(5), 1);
+%! fits_closeFile(fd);
+%! oldthreads = getenv("OCTAVE_FITS_THREADS");
+%! unwind_protect
+%!   for threads = {"1", "4"}
+%!     setenv("OCTAVE_FITS_THREADS", threads{1});
+%!     [datastatus, hdustatus] = fits_verifyChecksum({file1; file2; file1}, [1 2]);
+%!     assert(size(datastatus), [3 1]);
+%!     assert(datastatus{1}, [1 -1]);
+%!     assert(hdustatus{1}, [1 -1]);
+%!     assert(datastatus{2}, [0 0]);
+%!     assert(hdustatus{3}, [1 -1]);
+%!   endfor
+%!   ## files that can not be read, or lack an HDU, do not stop the others
+%!   [datastatus, hdustatus, errmsg] = fits_verifyChecksum({file1, [file2 ".missing"], file2}, [1 3]);
+%!   assert(datastatus{1}, [1 1]);
+%!   assert(isempty(errmsg{1}));
+%!   assert(datastatus{2}, [-1 -1]);
+%!   assert(hdustatus{2}, [-1 -1]);
+%!   assert(strncmp(errmsg{2}, "couldnt open", 12));
+%!   assert(datastatus{3}, [0 -1]);
+%!   assert(hdustatus{3}, [0 -1]);
+%!   assert(errmsg{3}, [file2 " has no HDU 3"]);
+%!   [datastatus, hdustatus] = fits_verifyChecksum({[file2 ".missing"]});
+%!   assert(datastatus, {-1});
+%!   fail("fits_verifyChecksum(file2, 3)", "has no HDU 3");
+%! unwind_protect_cleanup
+%!   setenv("OCTAVE_FITS_THREADS", oldthreads);
+%! end_unwind_protect
+%! delete(file1);
+%! delete(file2);
+#endif
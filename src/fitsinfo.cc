@@ -5,11 +5,20 @@
 #include <octave/version.h>
 #include <octave/file-info.h>
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 extern "C"
 {
 #include "fitsio.h"
 }
 
+#include "fits_handle_cache.h"
+
+// files may be kept open between calls, see fits_handle_cache.h
+static fits_handle_cache open_files;
+
 static int
 get_bin_format (const std::string &coltype, std::string &type, int &len)
 {
@@ -106,6 +115,9 @@ DEFUN_DLD( fitsinfo, args, nargout,
 "-*- texinfo -*-\n \
 @deftypefn {Function File} {[@var{info}]} = fitsinfo(@var{filename})\n \
 Read information about fits format file\n \
+\n \
+Files may be kept open between calls, as described for read_fits_image\n \
+(environment variable OCTAVE_FITS_OPEN_FILES); fits_flushOpenFiles closes them.\n \
 @end deftypefn")
 {
   octave_value_list retval;  // create object to store return values
@@ -127,7 +139,7 @@ Read information about fits format file\n \
   // Open FITS file and position to first HDU containing an image
   int status=0;
   fitsfile *fp;
-  if ( fits_open_image( &fp, infile.c_str(), READONLY, &status) > 0 )
+  if ( open_files.open_image( &fp, infile, &status ) > 0 )
     {
       fits_report_error( stderr, status );
       error("Could not open file %s.", infile.c_str());
@@ -174,6 +186,7 @@ Read information about fits format file\n \
       if( fits_get_hdrpos( fp, &num_keys, &key_pos, &status) > 0 )
         {
           fits_report_error( stderr, status );
+          open_files.close( fp, &status );
           error( "Could not get number of header keywords" ) ;
           return octave_value();
         }
@@ -189,6 +202,7 @@ Read information about fits format file\n \
           if ( fits_read_record( fp, i, card, &status ) )
             {
               fits_report_error( stderr, status );
+              open_files.close( fp, &status );
               error( "Could not read header keyword" );
               return octave_value ();
             }
@@ -501,9 +515,9 @@ Read information about fits format file\n \
 
   if (status == END_OF_FILE) status = 0;
 
-  // Close FITS file
+  // Close FITS file, or keep it open for the next call
   status = 0;
-  if( fits_close_file(fp, &status) > 0 )
+  if( open_files.close( fp, &status ) > 0 )
     {
       fits_report_error( stderr, status );
       error( "Could not close file %s.", infile.c_str() );
@@ -522,6 +536,17 @@ Read information about fits format file\n \
   return retval;
 }
 
+// PKG_ADD: autoload ("__fitsinfo_flush__", "fitsinfo.oct");
+DEFUN_DLD( __fitsinfo_flush__, args, nargout,
+"-*- texinfo -*-\n \
+@deftypefn {Function File} {@var{n} =} __fitsinfo_flush__()\n \
+Close the files fitsinfo keeps open, returning how many were closed.\n \
+Called by fits_flushOpenFiles.\n \
+@end deftypefn")
+{
+  return octave_value( double( open_files.flush() ) );
+}
+
 #if 0
 %!shared testfile
 %! testfile = urlwrite ( ...
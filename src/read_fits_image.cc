@@ -15,8 +15,14 @@
 
 #include <iostream>
 #include <sstream>
+#include <limits>
+#include <algorithm>
+#include <ctype.h>
+#include <mutex>
+#include <utility>
 #include <octave/oct.h>
 #include <octave/version.h>
+#include <octave/parse.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -27,15 +33,447 @@ extern "C"
 #include "fitsio.h"
 }
 
+#include "fits_threads.h"
+#include "fits_gzread.h"
+#include "fits_buffer_pool.h"
+#include "fits_transpose.h"
+#include "fits_handle_cache.h"
+#include "fits_checksum.h"
+
+#ifdef HAVE_PWRITE
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 static bool any_bad_argument( const octave_value_list& args );
 
+// files may be kept open between calls, see fits_handle_cache.h
+static fits_handle_cache open_files;
+
+// with "reuse", images are read into a buffer of a small pool kept
+// between calls, instead of a new array
+static fits_buffer_pool<NDArray> image_pool;
+
+// The raw bytes of the data unit being read, summed for "verify" a chunk
+// at a time just after cfitsio has read and converted it: from the page
+// cache of a plain file, or from the memory image of a gzip file.
+struct data_sum
+{
+  int fd;                  // the file, or -1 to sum mem
+  const char *mem;
+  LONGLONG datastart;      // where the data unit starts in the file or mem
+  LONGLONG bytepix;
+  LONGLONG done;           // bytes of the data unit summed so far
+  bool failed;
+  fits_checksum sum;
+  std::vector<unsigned char> buf;
+};
+
+// add the bytes of the data unit up to byte end to its sum
+static void sum_data_to( data_sum& s, LONGLONG end )
+{
+  while( s.done < end && !s.failed )
+  {
+    LONGLONG len = std::min( end - s.done, LONGLONG(1 << 20) );
+    const unsigned char *p = reinterpret_cast<const unsigned char *>( s.mem + s.datastart + s.done );
+#ifdef HAVE_PWRITE
+    if( s.fd >= 0 )
+    {
+      s.buf.resize( len );
+      for( LONGLONG got=0; got<len; )
+      {
+        ssize_t n = pread( s.fd, s.buf.data() + got, len - got, s.datastart + s.done + got );
+        if( n < 0 && errno == EINTR )
+          continue;
+        if( n <= 0 )
+        {
+          s.failed = true;
+          return;
+        }
+        got += n;
+      }
+      p = s.buf.data();
+    }
+#endif
+    s.sum.add( p, len, s.done );
+    s.done += len;
+  }
+}
+
+// Set up dsum to sum the data unit of the current HDU of fp, opened from
+// name (with the memory image mem of a gzip file, or NULL), and read its
+// DATASUM; check is left false if there is none.  False if the raw bytes
+// can not be read, as for files read through a filter or section, with
+// the reason in why.
+static bool start_verify( const std::string& name, const char *mem, fitsfile *fp,
+                          data_sum& dsum, bool& check, unsigned long& datasum,
+                          LONGLONG& dataend, std::string& why, int *status )
+{
+  check = false;
+  why = "needs the data unit of a plain or gzip file, without filters";
+
+  // only "file" or "file[n]" is the whole data unit in the file
+  std::string path = name;
+  size_t bracket = name.find( '[' );
+  if( bracket != std::string::npos )
+  {
+    if( name.size() < bracket+3 || name[name.size()-1] != ']'
+        || name.find_first_not_of( "0123456789", bracket+1 ) != name.size()-1 )
+      return false;
+    path = name.substr( 0, bracket );
+  }
+
+  if( !mem && ( path.empty() || path == "-" || path.find( "://" ) != std::string::npos
+                || path.compare( 0, 4, "mem:" ) == 0 ) )
+    return false;
+
+  // compressed files cfitsio decompresses itself, rather than read_gz_image
+  if( !mem && ( ( path.size() > 3 && path.compare( path.size() - 3, 3, ".gz" ) == 0 )
+                || ( path.size() > 2 && path.compare( path.size() - 2, 2, ".Z" ) == 0 ) ) )
+  {
+    why = "can not sum the data unit of " + path + ", decompressed by cfitsio";
+    return false;
+  }
+
+  char value[FLEN_VALUE], comment[FLEN_COMMENT];
+  if( fits_read_key_str( fp, "DATASUM", value, comment, status ) == KEY_NO_EXIST )
+  {
+    *status = 0;
+    return true;
+  }
+  datasum = strtoul( value, NULL, 10 );
+
+  LONGLONG headstart;
+  if( fits_get_hduaddrll( fp, &headstart, &dsum.datastart, &dataend, status ) > 0 )
+    return false;
+
+  dsum.mem = mem;
+  if( !mem )
+  {
+#ifdef HAVE_PWRITE
+    dsum.fd = open( path.c_str(), O_RDONLY );
+#endif
+    if( dsum.fd < 0 )
+    {
+      why = "could not open " + path + " to sum its data unit";
+      return false;
+    }
+  }
+
+  check = true;
+  return true;
+}
+
+// Read n pixels as doubles into data, starting at the 0 based element
+// first.  If mask is not NULL, undefined pixels are flagged in it and set
+// to NaN a chunk at a time, while still in cache; else they are set to
+// NaN only if nan is set.  If dsum is not NULL, the raw bytes of each
+// chunk are added to it once the chunk is read.
+static int read_pixels( fitsfile *fp, LONGLONG first, LONGLONG n, double *data,
+                        char *mask, bool nan, LONGLONG chunk, int *status,
+                        data_sum *dsum = NULL )
+{
+  double nulval = std::numeric_limits<double>::quiet_NaN();
+  int anynul = 0;
+
+  if( !mask && !dsum )
+    return fits_read_img( fp, TDOUBLE, first+1, n, nan ? &nulval : NULL,
+                          data, &anynul, status );
+
+  for( LONGLONG i=0; i<n && *status<=0; i+=chunk )
+  {
+    LONGLONG len = std::min( chunk, n-i );
+    anynul = 0;
+    if( !mask )
+    {
+      if( fits_read_img( fp, TDOUBLE, first+i+1, len, nan ? &nulval : NULL,
+                         data+i, &anynul, status ) > 0 )
+        break;
+    }
+    else if( fits_read_imgnull( fp, TDOUBLE, first+i+1, len, data+i, mask+i, &anynul, status ) > 0 )
+      break;
+    if( dsum )
+      sum_data_to( *dsum, ( first+i+len ) * dsum->bytepix );
+    if( !mask )
+      continue;
+    if( anynul )
+      for( LONGLONG j=i; j<i+len; j++ )
+        if( mask[j] )
+          data[j] = nulval;
+  }
+
+  return *status;
+}
+
+// As read_pixels, for the pixels of whole rows of an image of nx by ny
+// pixels a plane, stored in the image data (and mask) with its first two
+// axes swapped.  A block of rows is read into a buffer, and transposed
+// from there while still in cache.
+static int read_pixels_transposed( fitsfile *fp, LONGLONG first, LONGLONG n, double *data,
+                                   char *mask, bool nan, LONGLONG nx, LONGLONG ny,
+                                   int *status, data_sum *dsum = NULL )
+{
+  LONGLONG rows = std::max( LONGLONG(1), fits_transpose_elems / nx );
+  std::vector<double> buf( std::min( n, rows*nx ) );
+  std::vector<char> bufmask( mask ? buf.size() : 0 );
+
+  for( LONGLONG k=first; k<first+n && *status<=0; )
+  {
+    LONGLONG plane = k / (nx*ny), y = (k / nx) % ny;
+    LONGLONG len = std::min( std::min( rows, ny-y ), (first+n-k) / nx );
+    if( read_pixels( fp, k, len*nx, buf.data(), mask ? bufmask.data() : NULL, nan,
+                     len*nx, status, dsum ) > 0 )
+      break;
+
+    LONGLONG out = plane*nx*ny + y;
+    fits_transpose( buf.data(), nx, data+out, ny, nx, len );
+    if( mask )
+      fits_transpose( bufmask.data(), nx, mask+out, ny, nx, len );
+    k += len*nx;
+  }
+
+  return *status;
+}
+
+#ifdef HAVE_ZLIB_H
+// value of an integer header card
+static bool card_long( const char *card, const char *key, long& value )
+{
+  size_t len = strlen( key );
+  if( strncmp( card, key, len ) != 0 || card[8] != '=' )
+    return false;
+  for( size_t i=len; i<8; i++ )
+    if( card[i] != ' ' )
+      return false;
+  char buf[71];
+  memcpy( buf, card+10, 70 );
+  buf[70] = 0;
+  return sscanf( buf, "%ld", &value ) == 1;
+}
+
+// Build in image a FITS file in memory holding one image HDU of a gzip
+// file, reading only its header and data (or a range of planes of it)
+// through the gzip reader, rather than having cfitsio decompress the
+// whole file.  Reads only go forward, so that the file can be streamed.  hdu is -1 for the first image, or may be
+// given as [n] in name; a section of planes [*,...,k] or [*,...,a:b] may
+// also follow name.  Sets hdunum to the HDU of the image in the memory
+// file.  Returns false if this can not be done, leaving it to cfitsio.
+static bool read_gz_image( const std::string& name, int hdu, std::vector<char>& image, int& hdunum )
+{
+  const size_t block = 2880;
+
+  std::string path = name, filter;
+  size_t bracket = name.find( '[' );
+  if( bracket != std::string::npos )
+  {
+    path = name.substr( 0, bracket );
+    filter = name.substr( bracket );
+  }
+  if( path.size() < 4 || path.compare( path.size()-3, 3, ".gz" ) != 0
+      || path.find( "://" ) != std::string::npos )
+    return false;
+
+  // a plane range or an extension number
+  long first = 0, last = 0;
+  if( !filter.empty() )
+  {
+    if( filter[filter.size()-1] != ']' || filter.find( '[', 1 ) != std::string::npos )
+      return false;
+    std::string spec = filter.substr( 1, filter.size()-2 );
+    spec.erase( std::remove( spec.begin(), spec.end(), ' ' ), spec.end() );
+    size_t comma = spec.rfind( ',' );
+    std::string axes = ( comma == std::string::npos ) ? "" : spec.substr( 0, comma+1 );
+    std::string range = ( comma == std::string::npos ) ? spec : spec.substr( comma+1 );
+    for( size_t i=0; i<axes.size(); i+=2 )
+      if( axes.compare( i, 2, "*," ) != 0 )
+        return false;
+    char end;
+    if( sscanf( range.c_str(), "%ld:%ld%c", &first, &last, &end ) == 2 )
+      ;
+    else if( sscanf( range.c_str(), "%ld%c", &first, &end ) == 1 )
+      last = first;
+    else
+      return false;
+    if( axes.empty() )
+    {
+      // [n] selects an extension
+      if( hdu >= 0 || first != last )
+        return false;
+      hdu = first;
+      first = last = 0;
+    }
+  }
+
+  fits_gz_reader gz;
+  if( !gz.open( path ) )
+    return false;
+
+  std::vector<char> header;
+  uint64_t offset = 0;
+  long bitpix = 0, naxis = 0;
+  std::vector<long> naxes;
+  for( int index=0; ; index++ )
+  {
+    // read the header a block at a time up to the END card
+    header.clear();
+    bool end = false;
+    while( !end )
+    {
+      size_t pos = header.size();
+      header.resize( pos + block );
+      if( !gz.read( offset + pos, reinterpret_cast<unsigned char *>( &header[pos] ), block ) )
+        return false;
+      for( size_t c=pos; c<pos+block && !end; c+=80 )
+        end = strncmp( &header[c], "END     ", 8 ) == 0;
+    }
+
+    long pcount = 0, gcount = 1, value;
+    bool image_hdu = ( index == 0 ), zimage = false;
+    bitpix = naxis = 0;
+    naxes.clear();
+    for( size_t c=0; c<header.size(); c+=80 )
+    {
+      const char *card = &header[c];
+      if( card_long( card, "BITPIX", value ) )
+        bitpix = value;
+      else if( card_long( card, "NAXIS", value ) )
+      {
+        naxis = value;
+        naxes.assign( naxis, 0 );
+      }
+      else if( strncmp( card, "NAXIS", 5 ) == 0 && isdigit( card[5] ) )
+      {
+        int n = atoi( card+5 );
+        char key[16];
+        snprintf( key, sizeof(key), "NAXIS%d", n );
+        if( n >= 1 && n <= naxis && card_long( card, key, value ) )
+          naxes[n-1] = value;
+      }
+      else if( card_long( card, "PCOUNT", value ) )
+        pcount = value;
+      else if( card_long( card, "GCOUNT", value ) )
+        gcount = value;
+      else if( strncmp( card, "XTENSION= 'IMAGE", 16 ) == 0 )
+        image_hdu = true;
+      else if( strncmp( card, "ZIMAGE  =", 9 ) == 0 )
+        zimage = true;
+    }
+
+    uint64_t datalen = 0;
+    if( naxis > 0 )
+    {
+      datalen = pcount;
+      uint64_t npix = 1;
+      for( long i=0; i<naxis; i++ )
+        npix *= naxes[i];
+      datalen = ( datalen + npix ) * gcount * ( labs( bitpix ) / 8 );
+    }
+
+    bool target = ( hdu >= 0 ) ? ( index == hdu ) : ( image_hdu && naxis > 0 );
+    if( target )
+    {
+      // tables and compressed images are left to cfitsio
+      if( !image_hdu || zimage || naxis < 1 || bitpix == 0 )
+        return false;
+      hdunum = ( index == 0 ) ? 1 : 2;
+      break;
+    }
+
+    // past the end of the file, the next read fails
+    offset += header.size() + ( datalen + block - 1 ) / block * block;
+  }
+
+  uint64_t datastart = offset + header.size();
+  uint64_t datalen = labs( bitpix ) / 8;
+  for( long i=0; i<naxis; i++ )
+    datalen *= naxes[i];
+
+  if( first > 0 )
+  {
+    // planes along the last axis, with NAXISn set to the number read
+    if( first > last || last > naxes[naxis-1] )
+      return false;
+    uint64_t plane = datalen / naxes[naxis-1];
+    datastart += ( first - 1 ) * plane;
+    datalen = ( last - first + 1 ) * plane;
+
+    char key[16], card[81];
+    snprintf( key, sizeof(key), "NAXIS%ld", naxis );
+    for( size_t c=0; c<header.size(); c+=80 )
+    {
+      long value;
+      if( card_long( &header[c], key, value ) )
+      {
+        snprintf( card, sizeof(card), "%-8s= %20ld / length of data axis %-27ld", key, last - first + 1, naxis );
+        memcpy( &header[c], card, 80 );
+      }
+    }
+  }
+
+  // an empty primary HDU goes before an extension
+  image.clear();
+  if( hdunum == 2 )
+  {
+    static const char *cards[] = { "SIMPLE  =                    T",
+                                   "BITPIX  =                    8",
+                                   "NAXIS   =                    0",
+                                   "EXTEND  =                    T",
+                                   "END" };
+    image.assign( block, ' ' );
+    for( int i=0; i<5; i++ )
+      memcpy( &image[i*80], cards[i], strlen( cards[i] ) );
+  }
+
+  size_t pos = image.size();
+  image.insert( image.end(), header.begin(), header.end() );
+  image.resize( pos + header.size() + ( datalen + block - 1 ) / block * block, 0 );
+
+  return gz.read( datastart, reinterpret_cast<unsigned char *>( &image[pos + header.size()] ), datalen );
+}
+#endif
+
 DEFUN_DLD( read_fits_image, args, nargout,
 "-*- texinfo -*-\n\
 @deftypefn {Function File} {[@var{image},@var{header}]} = read_fits_image(@var{filename},@var{hdu})\n\
+@deftypefnx {Function File} {[@var{image},@var{header},@var{nullval}]} = read_fits_image(@var{filename},@var{hdu},@var{option},...)\n\
 Read FITS file @var{filename} and return image data in @var{image}, and the image header in @var{header}.\n\
 \n\
 size(@var{image}) will return NAXIS1 NAXIS2 ... NAXISN.\n\
 \n\
+@var{hdu} may be left out when options are given.  The option \"nan\" returns undefined pixels\n\
+(BLANK values of integer images) as NaN rather than their stored value.\n\
+\n\
+If @var{nullval} is requested, it is a logical array the size of @var{image} flagging the\n\
+undefined pixels, found in the same pass that reads the image.  The undefined pixels\n\
+themselves are then returned as NaN.\n\
+\n\
+The option \"reuse\" reads into one of a few buffers kept between calls, rather than a new array,\n\
+so a loop reading many images of the same size does not allocate a new array each time.  A buffer\n\
+is only read into again once @var{image} and any copies of it have been cleared or overwritten.\n\
+The buffers kept hold at most 256 MiB, larger images are read into a new array; fits_flushOpenFiles\n\
+frees them.\n\
+\n\
+The option \"transpose\" swaps the first two axes of @var{image} (and @var{nullval}), as fitsread does.\n\
+Blocks of rows are transposed as they are read, so no second copy of the image is made.\n\
+\n\
+The option \"verify\" checks the data unit against its DATASUM keyword, and raises an error if they\n\
+differ.  The raw bytes of each chunk of pixels are summed just after cfitsio has read and converted\n\
+them, so the file is read only once.  Tile compressed images are checked against the DATASUM of the\n\
+compressed data, which is read a second time to sum it, after the image is decompressed.  Images\n\
+without DATASUM are read unchecked.  The image must be read from a plain or gzip file, without filters\n\
+other than an extension number.\n\
+\n\
+Tile compressed images are decompressed on several threads, each decoding whole tiles\n\
+directly into @var{image}.  The number of threads can be set with the environment\n\
+variable OCTAVE_FITS_THREADS.\n\
+\n\
+If the environment variable OCTAVE_FITS_OPEN_FILES is set to a number of files, files read by name\n\
+(optionally with an extension number, as in example 4) are kept open between calls, up to that many,\n\
+so reading planes of the same file again does not reopen it.  Names with an image section or a\n\
+filter are still opened by cfitsio on each call.  A file is reopened if it has been replaced, or its\n\
+size or modification time has changed; fits_flushOpenFiles closes the files kept open.\n\
+\n\
 @var{filename} can be concatenated with filters provided by libcfitsio. See:\
 <http://heasarc.gsfc.nasa.gov/docs/software/fitsio/c/c_user/node81.html>\
 \n\n\
@@ -51,6 +489,12 @@ Examples:\n\
 \n\
 NOTE: It's only possible to read one extension (HDU) at a time, i.e. multi-extension files need to be read in a loop.\n\
 \n\
+Images in gzip files ('.gz') are read without decompressing the whole file into memory, in one pass\n\
+up to the end of the image.  If the environment variable OCTAVE_FITS_GZ_INDEX is set to 1, the first read\n\
+of a file instead makes one pass over all of it and stores points to resume decompression from in the file\n\
+@var{filename}.gzidx, so later reads, such as of planes selected as in example 3, only decompress the data\n\
+they need.\n\
+\n\
 @seealso{save_fits_image, save_fits_image_multi_ext}\n \
 @end deftypefn")
 {
@@ -60,11 +504,30 @@ NOTE: It's only possible to read one extension (HDU) at a time, i.e. multi-exten
   octave_value fitsimage; // the octave container for the image data to be read by this function
   std::string infile = args(0).string_value ();
 
-  if ( args.length()==2 )
+  int optarg = 1;
+  int hdu = -1;
+  if ( args.length()>=2 && !args(1).is_string() )
   {
+    hdu = int(args(1).scalar_value());
     std::ostringstream stream;
     stream << infile << "[" << int(args(1).scalar_value()) << "]";
     infile = stream.str();
+    optarg = 2;
+  }
+
+  bool nan = false, reuse = false, transpose = false, verify = false;
+  for( int i=optarg; i<args.length(); i++ )
+  {
+    std::string opt = args(i).string_value();
+    std::transform( opt.begin(), opt.end(), opt.begin(), ::tolower );
+    if( opt == "nan" )
+      nan = true;
+    else if( opt == "reuse" )
+      reuse = true;
+    else if( opt == "transpose" )
+      transpose = true;
+    else if( opt == "verify" )
+      verify = true;
   }
 
   int status=0; // must be initialized with zero (I consider this to be a bug in libcfitsio).
@@ -72,7 +535,33 @@ NOTE: It's only possible to read one extension (HDU) at a time, i.e. multi-exten
 
   // Open FITS file and position to first HDU containing an image
   fitsfile *fp;
-  if ( fits_open_image( &fp, infile.c_str(), READONLY, &status) > 0 )
+  bool opened = false;
+  const char *rawimage = NULL;
+
+#ifdef HAVE_ZLIB_H
+  // The image of a gzip file is read through a seekable index into a
+  // file in memory, instead of cfitsio decompressing the whole file
+  std::vector<char> gzimage;
+  int gzhdu;
+  if ( read_gz_image( args(0).string_value (), hdu, gzimage, gzhdu ) )
+  {
+    void *memptr = gzimage.data();
+    size_t memsize = gzimage.size();
+    // a fixed name, as cfitsio would apply any extension or section in
+    // infile again to the memory image, which holds only the one HDU
+    if ( fits_open_memfile( &fp, "read_fits_image.gz", READONLY, &memptr, &memsize, 0, NULL, &status ) > 0
+         || fits_movabs_hdu( fp, gzhdu, NULL, &status ) > 0 )
+    {
+      fprintf( stderr, "Could not open file %s.\n", infile.c_str() );
+      fits_report_error( stderr, status );
+      return fitsimage = -1;
+    }
+    opened = true;
+    rawimage = gzimage.data();
+  }
+#endif
+
+  if ( !opened && open_files.open_image( &fp, infile, &status ) > 0 )
   {
       fprintf( stderr, "Could not open file %s.\n", infile.c_str() );
       fits_report_error( stderr, status );
@@ -87,6 +576,7 @@ NOTE: It's only possible to read one extension (HDU) at a time, i.e. multi-exten
   {
       fprintf( stderr, "Could not get image information.\n" );
       fits_report_error( stderr, status );
+      open_files.close( fp, &status );
       return fitsimage = -1 ;
   }
   if( 2 == num_axis )
@@ -127,7 +617,7 @@ NOTE: It's only possible to read one extension (HDU) at a time, i.e. multi-exten
   // Read image data and write it to an octave MArrayN type
   dim_vector dims(1,1);
   dims.resize( num_axis );
-  int read_sz=sz_axes[0];
+  LONGLONG read_sz=sz_axes[0];
   for( int i=0; i<num_axis; i++ )
   {
     dims(i) = sz_axes[i];
@@ -139,45 +629,202 @@ NOTE: It's only possible to read one extension (HDU) at a time, i.e. multi-exten
   }
   //std::cerr << "read_sz: " << read_sz << std::endl;
 
+  // "transpose" swaps the first two axes; the pixels only move if both
+  // are longer than one
+  LONGLONG nx = sz_axes[0], ny = sz_axes[1];
+  if( transpose && num_axis > 0 )
+  {
+    dims.resize( std::max( num_axis, 2 ) );
+    dims(0) = ny;
+    dims(1) = nx;
+  }
+  bool swap_rows = transpose && nx > 1 && ny > 1;
+
+  dim_vector alloc_dims = reuse ? dim_vector() : dims;
+
   #ifdef OCTAVE_API_VERSION_NUMBER
     #if OCTAVE_API_VERSION_NUMBER < 45
-      MArrayN<double> image_data( dims ); // a octave double-type array
+      MArrayN<double> image_data( alloc_dims ); // a octave double-type array
     #else
-      MArray<double> image_data( dims ); // a octave double-type array
+      MArray<double> image_data( alloc_dims ); // a octave double-type array
     #endif
   #else
-    MArray<double> image_data( dims ); // a octave double-type array
+    MArray<double> image_data( alloc_dims ); // a octave double-type array
   #endif
 
-  int type = TDOUBLE; // convert read data to double (done by libcfitsio)
-  std::vector<long> fpixel(num_axis,1); // start at first pixel in all axes
+  double *data;
+  if( reuse )
+    image_data = image_pool.get( dims, data );
+  else
+    data = image_data.fortran_vec();
+  char *mask = NULL;
+  boolNDArray nullmask;
+  if( nargout > 2 )
+  {
+    nullmask = boolNDArray( dims );
+    mask = reinterpret_cast<char *>( nullmask.fortran_vec() );
+  }
+
+  // "verify" sums the raw data unit as the image is read.  Tile compressed
+  // images, whose pixels are not in the file, are decompressed by cfitsio
+  // from reads we can not see, so their data unit is read again once
+  // decompressed.
+  data_sum dsum = { -1, NULL, 0, labs( bits_per_pixel ) / 8, 0, false, fits_checksum(),
+                    std::vector<unsigned char>() };
+  bool check = false;
+  unsigned long datasum = 0;
+  LONGLONG dataend = 0;
+  std::string why;
+  if( verify && !start_verify( args(0).string_value(), rawimage, fp, dsum, check,
+                               datasum, dataend, why, &status ) )
+  {
+    open_files.close( fp, &status );
+    error( "read_fits_image: \"verify\" %s", why.c_str() );
+    return octave_value_list();
+  }
+  data_sum *sum_read = ( check && !fits_is_compressed_image( fp, &status ) ) ? &dsum : NULL;
+
+  // read n pixels, from the 0 based element first, into the image
+  auto read_range = [&] ( fitsfile *f, LONGLONG first, LONGLONG n, LONGLONG chunk, int *st,
+                          data_sum *ds )
+  {
+    if( swap_rows )
+      return read_pixels_transposed( f, first, n, data, mask, nan, nx, ny, st, ds );
+    return read_pixels( f, first, n, data+first, mask ? mask+first : NULL, nan, chunk, st, ds );
+  };
+
+  // Tile compressed images are decompressed on several threads, each
+  // reading a band of whole tiles through its own handle on the file.
+  bool done = false;
+  int nthreads = fits_num_threads();
+  if( nthreads > 1 && num_axis > 0 && fits_is_reentrant()
+      && fits_is_compressed_image( fp, &status ) )
+  {
+    std::vector<long> tile_dims(num_axis,1);
+    if( fits_get_tile_dim( fp, num_axis, tile_dims.data(), &status ) > 0 )
+      status = 0; // fall back to reading on this thread
+    else
+    {
+      // bands along the slowest varying axis are contiguous in the image
+      int axis = num_axis-1;
+      while( axis > 0 && sz_axes[axis] == 1 )
+        axis--;
+      LONGLONG plane = 1;
+      for( int i=0; i<axis; i++ )
+        plane *= sz_axes[i];
+      LONGLONG tile = std::max( 1L, tile_dims[axis] );
+      LONGLONG ntiles = (sz_axes[axis] + tile - 1) / tile;
+
+      if( ntiles > 1 )
+      {
+        LONGLONG band = plane * tile;
+        std::vector<std::pair<LONGLONG, LONGLONG> > failed;
+        std::mutex lock;
+
+        fits_parallel_for( ntiles, nthreads, [&] (size_t b0, size_t b1)
+        {
+          LONGLONG first = b0 * band;
+          LONGLONG n = std::min( LONGLONG(b1) * band, read_sz ) - first;
+          fitsfile *tfp;
+          int tstatus = 0;
+          if( fits_open_image( &tfp, infile.c_str(), READONLY, &tstatus ) <= 0 )
+          {
+            read_range( tfp, first, n, n, &tstatus, NULL );
+            int cstatus = 0;
+            fits_close_file( tfp, &cstatus );
+          }
+          if( tstatus > 0 )
+          {
+            std::lock_guard<std::mutex> guard( lock );
+            failed.push_back( std::make_pair( first, n ) );
+          }
+        });
+
+        // bands that could not be read on a worker are read again here
+        for( size_t i=0; i<failed.size() && status<=0; i++ )
+          read_range( fp, failed[i].first, failed[i].second, failed[i].second, &status, NULL );
+        done = true;
+      }
+    }
+  }
+
+  if( !done && status <= 0 )
+    read_range( fp, 0, read_sz, 1 << 16, &status, sum_read );
 
-  int  anynul;
-  if( fits_read_pix( fp, type, fpixel.data(), read_sz, NULL, image_data.fortran_vec(), 
-                      &anynul, &status ) > 0 )
+  // the rest of the data unit, its padding, or all of it if compressed
+  if( check )
+  {
+    sum_data_to( dsum, dataend - dsum.datastart );
+#ifdef HAVE_PWRITE
+    if( dsum.fd >= 0 )
+      close( dsum.fd );
+#endif
+  }
+
+  if( status > 0 )
   {
        fprintf( stderr, "Could not read image.\n" );
        fits_report_error( stderr, status );
+       open_files.close( fp, &status );
        return fitsimage = -1;
   }
 
-  // Close FITS file
-  if( fits_close_file(fp, &status) > 0 )
+  // Close FITS file, or keep it open for the next call
+  if( open_files.close( fp, &status ) > 0 )
   {
       fprintf( stderr, "Could not close file %s.\n", infile.c_str() );
       fits_report_error( stderr, status );
   }
 
+  if( check && ( dsum.failed || dsum.sum.value() != datasum ) )
+  {
+    error( "read_fits_image: data of %s does not match its DATASUM", infile.c_str() );
+    return octave_value_list();
+  }
+
   octave_value_list retlist;
   retlist(0) =  image_data;
   retlist(1) =  header;
+  if( nargout > 2 )
+    retlist(2) = nullmask;
 
   return retlist;
 }
 
+// PKG_ADD: autoload ("fits_flushOpenFiles", "read_fits_image.oct");
+DEFUN_DLD( fits_flushOpenFiles, args, nargout,
+"-*- texinfo -*-\n\
+@deftypefn {Function File} {@var{n} =} fits_flushOpenFiles()\n\
+Close the files read_fits_image and fitsinfo keep open between calls, and free the buffers\n\
+read_fits_image keeps for the option \"reuse\".\n\
+\n\
+Files are only kept open when the environment variable OCTAVE_FITS_OPEN_FILES is set, see\n\
+read_fits_image.  Call this once a file kept open is to be changed or deleted in place, for\n\
+instance on systems that do not allow deleting open files.  @var{n} is the number of files\n\
+closed.\n\
+@seealso{read_fits_image, fitsinfo}\n\
+@end deftypefn")
+{
+  if( args.length() != 0 )
+  {
+    print_usage();
+    return octave_value();
+  }
+
+  double n = open_files.flush();
+  image_pool.clear();
+
+  // fitsinfo keeps its own files open
+  octave_value_list info = octave::feval( "__fitsinfo_flush__", octave_value_list(), 1 );
+  if( info.length() > 0 )
+    n += info(0).double_value();
+
+  return octave_value( n );
+}
+
 static bool any_bad_argument( const octave_value_list& args )
 {
-  if ( args.length() < 1 || args.length() > 2 )
+  if ( args.length() < 1 )
   {
     error( "read_fits_image: number of arguments - expecting read_fits_image( filename ) or read_fits_image( filename, extension )" );
     return true;
@@ -189,8 +836,10 @@ static bool any_bad_argument( const octave_value_list& args )
     return true;
   }
 
-  if( 2 == args.length() )
+  int optarg = 1;
+  if( args.length() >= 2 && !args(1).is_string() )
   {
+    optarg = 2;
     if( !args(1).is_scalar_type() )
     {
       error( "read_fits_image: second argument must be a non-negative scalar integer value" );
@@ -205,6 +854,22 @@ static bool any_bad_argument( const octave_value_list& args )
 
   }
 
+  for( int i=optarg; i<args.length(); i++ )
+  {
+    if( !args(i).is_string() )
+    {
+      error( "read_fits_image: options must be strings" );
+      return true;
+    }
+    std::string opt = args(i).string_value();
+    std::transform( opt.begin(), opt.end(), opt.begin(), ::tolower );
+    if( opt != "nan" && opt != "reuse" && opt != "transpose" && opt != "verify" )
+    {
+      error( "read_fits_image: unknown option '%s'", opt.c_str() );
+      return true;
+    }
+  }
+
   return false;
 }
 
@@ -221,6 +886,8 @@ static bool any_bad_argument( const octave_value_list& args )
 
 %!error <read_fits_image: filename> read_fits_image(1)
 
+%!error <read_fits_image: unknown option> read_fits_image("file.fits", "bad")
+
 %!test
 %! rd=read_fits_image(testfile);
 %! assert(!isempty(rd));
@@ -236,6 +903,191 @@ static bool any_bad_argument( const octave_value_list& args )
 %! assert(size(rd, 2), 200);
 %! assert(size(rd, 3), 4);
 
+%!test
+%! [rd, hdr, nulls] = read_fits_image(testfile, 0);
+%! assert(islogical(nulls));
+%! assert(size(nulls), size(rd));
+%! rdnan = read_fits_image(testfile, "nan");
+%! assert(isnan(rdnan), nulls);
+%! assert(rdnan(! nulls), rd(! nulls));
+%! p = 1:ndims(rd);
+%! p(1:2) = [2 1];
+%! [rt, hdrt, nullst] = read_fits_image(testfile, 0, "transpose");
+%! assert(rt, permute(rd, p));
+%! assert(nullst, permute(nulls, p));
+%! assert(read_fits_image(testfile, "transpose", "nan"), permute(rdnan, p));
+
+%!test
+%! tmpfile = [tempname() ".fits"];
+%! save_fits_image(tmpfile, magic(6));
+%! a = read_fits_image(tmpfile, "reuse");
+%! b = read_fits_image(tmpfile, "reuse");
+%! a(1) = -1;
+%! assert(b, magic(6));
+%! clear b;
+%! c = read_fits_image(tmpfile, "reuse");
+%! assert(c, magic(6));
+%! assert(a(2:end), c(2:end));
+%! fits_flushOpenFiles();
+%! d = read_fits_image(tmpfile, "reuse");
+%! assert(d, magic(6));
+%! delete (tmpfile);
+
+%!test
+%! tmpfile = [tempname() ".fits"];
+%! data = int16(magic(4));
+%! save_fits_image(tmpfile, data, 16);
+%! [rd, hdr, nulls] = read_fits_image(tmpfile);
+%! assert(rd, double(data));
+%! assert(nulls, false(4, 4));
+%! assert(read_fits_image(tmpfile, "nan"), double(data));
+%! delete (tmpfile);
+
+%!test
+%! tmpfile = [tempname() ".fits"];
+%! data = int16(reshape(0:(100*60*3-1), 100, 60, 3) - 9000);
+%! save_fits_image([tmpfile "[compress R 100,7,1]"], data, 16);
+%! oldthreads = getenv("OCTAVE_FITS_THREADS");
+%! unwind_protect
+%!   setenv("OCTAVE_FITS_THREADS", "1");
+%!   rd1 = read_fits_image(tmpfile);
+%!   setenv("OCTAVE_FITS_THREADS", "4");
+%!   [rd4, hdr, nulls] = read_fits_image(tmpfile);
+%! unwind_protect_cleanup
+%!   setenv("OCTAVE_FITS_THREADS", oldthreads);
+%!   delete (tmpfile);
+%! end_unwind_protect
+%! assert(rd1, double(data));
+%! assert(rd4, double(data));
+%! assert(nulls, false(size(data)));
+
+%!test
+%! tmpfile = [tempname() ".fits"];
+%! oldopen = getenv("OCTAVE_FITS_OPEN_FILES");
+%! unwind_protect
+%!   setenv("OCTAVE_FITS_OPEN_FILES", "2");
+%!   save_fits_image(tmpfile, magic(4));
+%!   assert(read_fits_image(tmpfile), magic(4));
+%!   assert(read_fits_image(tmpfile, 0), magic(4));
+%!   assert(read_fits_image([tmpfile "[*,2:3]"]), magic(4)(:,2:3));
+%!   save_fits_image(["!" tmpfile], magic(50));
+%!   assert(read_fits_image(tmpfile), magic(50));
+%!   ## a file of the same size put in its place, within the same second
+%!   other = [tempname() ".fits"];
+%!   save_fits_image(other, transpose(magic(50)));
+%!   rename(other, tmpfile);
+%!   assert(read_fits_image(tmpfile), transpose(magic(50)));
+%!   assert(fits_flushOpenFiles() >= 1);
+%!   assert(fits_flushOpenFiles(), 0);
+%! unwind_protect_cleanup
+%!   setenv("OCTAVE_FITS_OPEN_FILES", oldopen);
+%!   fits_flushOpenFiles();
+%!   delete (tmpfile);
+%! end_unwind_protect
+
+%!test
+%! ## an empty primary array and an ascii table before the image
+%! card = @(s) sprintf("%-80s", s);
+%! hdr = [card("SIMPLE  =                    T") card("BITPIX  =                    8") ...
+%!        card("NAXIS   =                    0") card("EXTEND  =                    T") ...
+%!        card("END")];
+%! hdr(end+1:2880) = " ";
+%! tbl = [card("XTENSION= 'TABLE   '") card("BITPIX  =                    8") ...
+%!        card("NAXIS   =                    2") card("NAXIS1  =                    4") ...
+%!        card("NAXIS2  =                    1") card("PCOUNT  =                    0") ...
+%!        card("GCOUNT  =                    1") card("TFIELDS =                    1") ...
+%!        card("TFORM1  = 'I4      '") card("TBCOL1  =                    1") ...
+%!        card("END")];
+%! tbl(end+1:2880) = " ";
+%! row = "  42";
+%! row(end+1:2880) = " ";
+%! tmpfile = [tempname() ".fits"];
+%! fid = fopen(tmpfile, "w");
+%! fwrite(fid, [hdr tbl row]);
+%! fclose(fid);
+%! oldopen = getenv("OCTAVE_FITS_OPEN_FILES");
+%! unwind_protect
+%!   fd = fits_openFile(tmpfile, "READWRITE");
+%!   fits_movAbsHDU(fd, 2);
+%!   fits_createImg(fd, "DOUBLE_IMG", [4 4]);
+%!   fits_writeImg(fd, magic(4));
+%!   fits_closeFile(fd);
+%!   for open = {"", "2"}
+%!     setenv("OCTAVE_FITS_OPEN_FILES", open{1});
+%!     assert(read_fits_image(tmpfile), magic(4));
+%!   endfor
+%! unwind_protect_cleanup
+%!   setenv("OCTAVE_FITS_OPEN_FILES", oldopen);
+%!   fits_flushOpenFiles();
+%!   delete (tmpfile);
+%! end_unwind_protect
+
+%!test
+%! gzfile = [tempname() ".fits.gz"];
+%! data = reshape(1:(50*40*6), 50, 40, 6);
+%! save_fits_image(gzfile, data, 32);
+%! oldindex = getenv("OCTAVE_FITS_GZ_INDEX");
+%! unwind_protect
+%!   for index = {"", "1"}
+%!     setenv("OCTAVE_FITS_GZ_INDEX", index{1});
+%!     assert(read_fits_image(gzfile), data);
+%!     assert(exist ([gzfile ".gzidx"], "file"), 2 * ! isempty(index{1}));
+%!     assert(read_fits_image([gzfile "[*,*,4]"]), data(:,:,4));
+%!     [rd, hdr] = read_fits_image([gzfile "[*,*,2:5]"]);
+%!     assert(rd, data(:,:,2:5));
+%!     assert(any(strncmp(cellstr(hdr), "NAXIS3  =                    4", 30)));
+%!     assert(read_fits_image(gzfile, 0), data);
+%!     assert(read_fits_image(gzfile, 3), -1);
+%!   endfor
+%! unwind_protect_cleanup
+%!   setenv("OCTAVE_FITS_GZ_INDEX", oldindex);
+%!   delete (gzfile);
+%!   if (exist ([gzfile ".gzidx"], "file"))
+%!     delete ([gzfile ".gzidx"]);
+%!   endif
+%! end_unwind_protect
+
+%!test
+%! gzfile = [tempname() ".fits.gz"];
+%! data = reshape(1:(30*20*4), 30, 20, 4);
+%! save_fits_image_multi_ext(gzfile, data, 16);
+%! unwind_protect
+%!   assert(read_fits_image(gzfile, 2), data(:,:,3));
+%!   assert(read_fits_image([gzfile "[3]"]), data(:,:,4));
+%!   assert(read_fits_image(gzfile, 1), data(:,:,2));
+%! unwind_protect_cleanup
+%!   delete (gzfile);
+%!   if (exist ([gzfile ".gzidx"], "file"))
+%!     delete ([gzfile ".gzidx"]);
+%!   endif
+%! end_unwind_protect
+
+%!test
+%! tmpfile = [tempname() ".fits"];
+%! gzfile = [tempname() ".fits.gz"];
+%! data = reshape(1:(300*200*3), 300, 200, 3);
+%! save_fits_image(tmpfile, data, 32, "Checksum", true);
+%! save_fits_image(gzfile, data, -32, "Checksum", true);
+%! unwind_protect
+%!   assert(read_fits_image(tmpfile, "verify"), data);
+%!   assert(read_fits_image(tmpfile, 0, "verify", "transpose"), permute(data, [2 1 3]));
+%!   [rd, hdr, nulls] = read_fits_image(tmpfile, "verify");
+%!   assert(rd, data);
+%!   assert(read_fits_image(gzfile, "verify"), data);
+%!   fail("read_fits_image([tmpfile \"[*,2:3,1]\"], \"verify\")", "needs the data unit");
+%!   fd = fits_openFile(tmpfile, "READWRITE");
+%!   fits_writeImg(fd, int32(-1), 1000);
+%!   fits_closeFile(fd);
+%!   fail("read_fits_image(tmpfile, \"verify\")", "does not match its DATASUM");
+%!   assert(read_fits_image(tmpfile)(1000), -1);
+%! unwind_protect_cleanup
+%!   delete (tmpfile);
+%!   delete (gzfile);
+%!   if (exist ([gzfile ".gzidx"], "file"))
+%!     delete ([gzfile ".gzidx"]);
+%!   endif
+%! end_unwind_protect
+
 %! if exist (testfile, 'file')
 %!   delete (testfile);
 %! endif
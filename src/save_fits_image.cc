@@ -16,6 +16,10 @@
 
 #include <iostream>
 #include <sstream>
+#include <vector>
+#include <algorithm>
+#include <ctime>
+#include <ctype.h>
 #include <octave/oct.h>
 
 #ifdef HAVE_CONFIG_H
@@ -27,8 +31,48 @@ extern "C"
 #include "fitsio.h"
 }
 
+#include "fits_threads.h"
+#include "fits_gzip.h"
+#include "fits_transpose.h"
+#include "fits_checksum.h"
+
 static bool any_bad_argument( const octave_value_list& args );
 
+// tile compression parameters, as given by the options
+struct compress_spec
+{
+  compress_spec() : type(NOCOMPRESS), qlevel(0), has_qlevel(false),
+                    dither(0), seed(0), hscale(0), has_hscale(false) {}
+
+  int type;
+  std::vector<long> tile;
+  float qlevel;
+  bool has_qlevel;
+  int dither;
+  int seed;
+  float hscale;
+  bool has_hscale;
+};
+
+// the pixels to write, of an image of nx by ny pixels a plane in the
+// file, held with its first two axes swapped if transpose is set
+struct image_source
+{
+  const double *data;
+  LONGLONG nx;
+  LONGLONG ny;
+  bool transpose;
+};
+
+static bool parse_options( const octave_value_list& args, int first, compress_spec& spec,
+                           bool& transpose, bool& checksum );
+static int set_compression( fitsfile *fp, const compress_spec& spec, int *status );
+static int write_pixels( fitsfile *fp, const image_source& src, LONGLONG first, LONGLONG n,
+                         LONGLONG fpixel, int *status, fits_checksum *sum = NULL );
+static int write_compressed_img( fitsfile *fp, const compress_spec& spec, int bitperpixel,
+                                 int num_axis, long *sz_axes, const image_source& src,
+                                 LONGLONG len, int *status );
+
 DEFUN_DLD( save_fits_image, args, nargout,
 "-*- texinfo -*-\n\
      @deftypefn {Function File}  save_fits_image(@var{filename}, @var{image}, @var{bit_per_pixel})\n\
@@ -36,7 +80,22 @@ DEFUN_DLD( save_fits_image, args, nargout,
      Datacubes will be saved with NAXIS=3.\n\n\
      The optional parameter @var{bit_per_pixel} specifies the data type of the pixel values. Accepted string values are BYTE_IMG, SHORT_IMG, LONG_IMG, LONGLONG_IMG, FLOAT_IMG, and DOUBLE_IMG (default). Alternatively, corresponding numbers may be passed, i.e. 8, 16, 32, 64, -32, and -64.\n\n\
      Use a preceding exclamation mark (!) in the filename to overwrite an existing file.\n\n\
-     Lossless file compression can be used by adding the suffix '.gz' to the filename.\n\n\
+     Lossless file compression can be used by adding the suffix '.gz' to the filename; the file is compressed on several threads.\n\n\
+     Tile compression, as done by fpack, is selected with property/value pairs after @var{image} or @var{bit_per_pixel}:\n\n\
+     'Compression': one of 'rice', 'gzip', 'gzip2', 'hcompress', 'plio' or 'none'.\n\n\
+     'TileSize': the tile dimensions (default whole rows).\n\n\
+     'QuantizeLevel': the quantization level of floating point images (negative for an absolute step size, 0 for lossless).\n\n\
+     'Dither': the dithering of quantized values, one of 'subtractive' (default), 'subtractive2' or 'none'.\n\n\
+     'DitherSeed': the dither seed, 1 to 10000 (default from the clock).\n\n\
+     'HCompScale': the HCOMPRESS scale factor.\n\n\
+     'Transpose': if true, the first two axes of @var{image} are swapped in the file, as fitswrite does.  Blocks\n\
+     of rows are transposed as they are written, so no second copy of the image is made.\n\n\
+     'Checksum': if true, the CHECKSUM and DATASUM keywords are written.  The data is summed a block at a\n\
+     time just after it is written, as cfitsio wrote it, so the whole file is not read back to sum it.\n\
+     The HDUs of a compressed image are summed by cfitsio once written.\n\n\
+     The image is written as a compressed image extension after an empty primary HDU.  Bands of whole tiles\n\
+     are compressed on several threads, then appended to the table in order; the number of threads can be set\n\
+     with the environment variable OCTAVE_FITS_THREADS.\n\n\
      @seealso{save_fits_image_multi_ext, read_fits_image}\n\
      @end deftypefn")
 {
@@ -46,6 +105,12 @@ DEFUN_DLD( save_fits_image, args, nargout,
   octave_value fitsimage;
   std::string outfile = args(0).string_value ();
 
+#ifdef HAVE_ZLIB_H
+  // '.gz' files are written uncompressed, then compressed on several threads
+  fits_gzip_temp gztemp;
+  outfile = gztemp.target( outfile );
+#endif
+
 
   const NDArray image = args(1).array_value();
   dim_vector dims = image.dims();
@@ -58,8 +123,31 @@ DEFUN_DLD( save_fits_image, args, nargout,
     len *= dims(i);
   }
 
+  // options start after the image, or after bit_per_pixel if given
+  int optarg = 2;
+  if( args.length() > 2 )
+  {
+    std::string opt = args(2).is_string() ? args(2).string_value() : "";
+    std::transform( opt.begin(), opt.end(), opt.begin(), ::tolower );
+    if( opt != "compression" && opt != "tilesize" && opt != "quantizelevel"
+        && opt != "dither" && opt != "ditherseed" && opt != "hcompscale"
+        && opt != "transpose" && opt != "checksum" )
+      optarg = 3;
+  }
+
+  compress_spec spec;
+  bool transpose = false, checksum = false;
+  if( ! parse_options( args, optarg, spec, transpose, checksum ) )
+    return octave_value_list();
+
+  // the pixels only move if both of the swapped axes are longer than one
+  if( transpose )
+    std::swap( sz_axes[0], sz_axes[1] );
+  image_source src = { image.fortran_vec(), sz_axes[0], sz_axes[1],
+                       transpose && sz_axes[0] > 1 && sz_axes[1] > 1 };
+
   int bitperpixel = DOUBLE_IMG;
-  if( 3 == args.length() )
+  if( 3 == optarg )
   {
     if( args(2).is_string() )
     {
@@ -124,20 +212,52 @@ DEFUN_DLD( save_fits_image, args, nargout,
       return octave_value_list();  
   }
 
-  long fpixel = 1;
-  if( fits_create_img( fp, bitperpixel, num_axis, sz_axes, &status ) > 0 )
+  if( spec.type != NOCOMPRESS )
   {
-    fprintf( stderr, "Could not create HDU.\n" );
-    fits_report_error( stderr, status );
-    return octave_value_list();
-  }
+    if( write_compressed_img( fp, spec, bitperpixel, num_axis, sz_axes, src, len, &status ) > 0 )
+    {
+      fprintf( stderr, "Could not write compressed image.\n" );
+      fits_report_error( stderr, status );
+      return octave_value_list();
+    }
 
-  double * datap = const_cast<double*>( image.fortran_vec() );
-  if( fits_write_img( fp, TDOUBLE, fpixel, len, datap , &status ) > 0 )
+    // the heap of the table is written by cfitsio, so both HDUs are summed
+    // from the file
+    if( checksum
+        && ( fits_movabs_hdu( fp, 1, NULL, &status ) > 0
+             || fits_write_chksum( fp, &status ) > 0
+             || fits_movabs_hdu( fp, 2, NULL, &status ) > 0
+             || fits_write_chksum( fp, &status ) > 0 ) )
+    {
+      fprintf( stderr, "Could not write checksum.\n" );
+      fits_report_error( stderr, status );
+      return octave_value_list();
+    }
+  }
+  else
   {
-    fprintf( stderr, "Could not write image data.\n" );
-    fits_report_error( stderr, status );
-    return octave_value_list();
+    if( fits_create_img( fp, bitperpixel, num_axis, sz_axes, &status ) > 0
+        || ( checksum && fits_reserve_checksum( fp, &status ) > 0 ) )
+    {
+      fprintf( stderr, "Could not create HDU.\n" );
+      fits_report_error( stderr, status );
+      return octave_value_list();
+    }
+
+    fits_checksum sum;
+    if( write_pixels( fp, src, 0, len, 1, &status, checksum ? &sum : NULL ) > 0 )
+    {
+      fprintf( stderr, "Could not write image data.\n" );
+      fits_report_error( stderr, status );
+      return octave_value_list();
+    }
+
+    if( checksum && fits_write_datasum( fp, sum.value(), &status ) > 0 )
+    {
+      fprintf( stderr, "Could not write checksum.\n" );
+      fits_report_error( stderr, status );
+      return octave_value_list();
+    }
   }
 
 
@@ -148,12 +268,21 @@ DEFUN_DLD( save_fits_image, args, nargout,
       fits_report_error( stderr, status );
   }
 
+#ifdef HAVE_ZLIB_H
+  if( !gztemp.gzfile().empty() )
+  {
+    bool ok = gztemp.compress( fits_num_threads() );
+    if( !ok )
+      error( "Could not compress file %s.", gztemp.gzfile().c_str() );
+  }
+#endif
+
   return octave_value_list();
 }
 
 static bool any_bad_argument( const octave_value_list& args )
 {
-  if ( args.length() < 2 || args.length() > 3 )
+  if ( args.length() < 2 )
   {
     error( "save_fits_image: number of arguments - expecting save_fits_image( filename, image ) or save_fits_image( filename, image, bitsperpixel )" );
     return true;
@@ -169,6 +298,430 @@ static bool any_bad_argument( const octave_value_list& args )
   return false;
 }
 
+static bool parse_options( const octave_value_list& args, int first, compress_spec& spec,
+                           bool& transpose, bool& checksum )
+{
+  if( (args.length() - first) % 2 != 0 )
+  {
+    error( "save_fits_image: options must be property/value pairs" );
+    return false;
+  }
+
+  bool given = false, off = false;
+  for( int i=first; i<args.length(); i+=2 )
+  {
+    if( !args(i).is_string() )
+    {
+      error( "save_fits_image: property name (string) expected" );
+      return false;
+    }
+    std::string prop = args(i).string_value();
+    std::transform( prop.begin(), prop.end(), prop.begin(), ::tolower );
+    octave_value val = args(i+1);
+
+    if( prop == "compression" || prop == "dither" )
+    {
+      if( !val.is_string() )
+      {
+        error( "save_fits_image: value of '%s' must be a string", prop.c_str() );
+        return false;
+      }
+      std::string name = val.string_value();
+      std::transform( name.begin(), name.end(), name.begin(), ::tolower );
+      if( prop == "compression" )
+      {
+        if( name == "rice" )
+          spec.type = RICE_1;
+        else if( name == "gzip" )
+          spec.type = GZIP_1;
+        else if( name == "gzip2" )
+          spec.type = GZIP_2;
+        else if( name == "hcompress" )
+          spec.type = HCOMPRESS_1;
+        else if( name == "plio" )
+          spec.type = PLIO_1;
+        else if( name == "none" )
+          spec.type = NOCOMPRESS;
+        else
+        {
+          error( "save_fits_image: unknown compression '%s'", name.c_str() );
+          return false;
+        }
+      }
+      else
+      {
+        if( name == "subtractive" )
+          spec.dither = SUBTRACTIVE_DITHER_1;
+        else if( name == "subtractive2" )
+          spec.dither = SUBTRACTIVE_DITHER_2;
+        else if( name == "none" )
+          spec.dither = NO_DITHER;
+        else
+        {
+          error( "save_fits_image: unknown dither '%s'", name.c_str() );
+          return false;
+        }
+        given = true;
+      }
+      if( prop == "compression" && spec.type == NOCOMPRESS )
+        off = true;
+      continue;
+    }
+
+    if( prop == "transpose" )
+    {
+      if( ( !val.isnumeric() && !val.islogical() ) || !val.is_scalar_type() )
+      {
+        error( "save_fits_image: value of 'Transpose' must be true or false" );
+        return false;
+      }
+      transpose = val.bool_value();
+      continue;
+    }
+
+    if( prop == "checksum" )
+    {
+      if( ( !val.isnumeric() && !val.islogical() ) || !val.is_scalar_type() )
+      {
+        error( "save_fits_image: value of 'Checksum' must be true or false" );
+        return false;
+      }
+      checksum = val.bool_value();
+      continue;
+    }
+
+    if( !val.isnumeric() || val.isempty() )
+    {
+      error( "save_fits_image: value of '%s' must be numeric", prop.c_str() );
+      return false;
+    }
+
+    if( prop == "tilesize" )
+    {
+      NDArray t = val.array_value();
+      spec.tile.resize( t.numel() );
+      for( octave_idx_type j=0; j<t.numel(); j++ )
+      {
+        if( t(j) < 1 || OCTAVE__D_NINT( t(j) ) != t(j) )
+        {
+          error( "save_fits_image: TileSize must be positive integers" );
+          return false;
+        }
+        spec.tile[j] = long(t(j));
+      }
+    }
+    else if( prop == "quantizelevel" )
+    {
+      spec.qlevel = val.float_value();
+      spec.has_qlevel = true;
+    }
+    else if( prop == "ditherseed" )
+    {
+      double seed = val.double_value();
+      if( seed < 1 || seed > 10000 || OCTAVE__D_NINT( seed ) != seed )
+      {
+        error( "save_fits_image: DitherSeed must be an integer from 1 to 10000" );
+        return false;
+      }
+      spec.seed = int(seed);
+    }
+    else if( prop == "hcompscale" )
+    {
+      spec.hscale = val.float_value();
+      spec.has_hscale = true;
+    }
+    else
+    {
+      error( "save_fits_image: unknown property '%s'", args(i).string_value().c_str() );
+      return false;
+    }
+    given = true;
+  }
+
+  // rice is used if only the other compression options were given
+  if( off )
+    spec.type = NOCOMPRESS;
+  else if( given && spec.type == NOCOMPRESS )
+    spec.type = RICE_1;
+
+  return true;
+}
+
+static int set_compression( fitsfile *fp, const compress_spec& spec, int *status )
+{
+  fits_set_compression_type( fp, spec.type, status );
+  if( !spec.tile.empty() )
+    fits_set_tile_dim( fp, spec.tile.size(), const_cast<long*>( spec.tile.data() ), status );
+  if( spec.has_qlevel )
+    fits_set_quantize_level( fp, spec.qlevel, status );
+  if( spec.dither != 0 )
+    fits_set_quantize_method( fp, spec.dither, status );
+  if( spec.seed > 0 )
+    fits_set_dither_seed( fp, spec.seed, status );
+  if( spec.has_hscale )
+    fits_set_hcomp_scale( fp, spec.hscale, status );
+
+  return *status;
+}
+
+// Write the n pixels of the image from the 0 based element first, at
+// pixel fpixel of fp.  If the image is held transposed, first and n
+// are whole rows of the image in the file, which are transposed a block
+// of rows at a time into a buffer small enough to stay in cache, that
+// cfitsio converts to the type of the image from there.  If sum is
+// given, each block is added to it as cfitsio wrote it, read back just
+// after it is written.
+static int write_pixels( fitsfile *fp, const image_source& src, LONGLONG first, LONGLONG n,
+                         LONGLONG fpixel, int *status, fits_checksum *sum )
+{
+  if( !src.transpose && !sum )
+    return fits_write_img( fp, TDOUBLE, fpixel, n, const_cast<double*>( src.data + first ),
+                           status );
+
+  if( !src.transpose )
+  {
+    for( LONGLONG k=first; k<first+n && *status<=0; k+=fits_transpose_elems )
+    {
+      LONGLONG len = std::min( LONGLONG(fits_transpose_elems), first+n-k );
+      fits_write_img( fp, TDOUBLE, fpixel + k-first, len, const_cast<double*>( src.data + k ),
+                      status );
+      if( *status <= 0 )
+        fits_checksum_written( fp, *sum, fpixel-1 + k-first, len, status );
+    }
+    return *status;
+  }
+
+  LONGLONG nx = src.nx, ny = src.ny;
+  LONGLONG rows = std::max( LONGLONG(1), fits_transpose_elems / nx );
+  std::vector<double> buf( std::min( n, rows*nx ) );
+
+  for( LONGLONG k=first; k<first+n && *status<=0; )
+  {
+    LONGLONG plane = k / (nx*ny), y = (k / nx) % ny;
+    LONGLONG len = std::min( std::min( rows, ny-y ), (first+n-k) / nx );
+    fits_transpose( src.data + plane*nx*ny + y, ny, buf.data(), nx, len, nx );
+    fits_write_img( fp, TDOUBLE, fpixel + k-first, len*nx, buf.data(), status );
+    if( sum && *status <= 0 )
+      fits_checksum_written( fp, *sum, fpixel-1 + k-first, len*nx, status );
+    k += len*nx;
+  }
+
+  return *status;
+}
+
+// read the tile dimensions of the current compressed image HDU
+static int read_tile_dims( fitsfile *fp, int num_axis, std::vector<long>& tile, int *status )
+{
+  tile.resize( num_axis );
+  for( int i=0; i<num_axis && *status<=0; i++ )
+  {
+    char keyname[FLEN_KEYWORD];
+    fits_make_keyn( "ZTILE", i+1, keyname, status );
+    fits_read_key( fp, TLONG, keyname, &tile[i], NULL, status );
+  }
+  return *status;
+}
+
+// compress a band of whole tiles of the image into a new memory file,
+// with the tile dimensions of the full image
+static int compress_band( const compress_spec& spec, int bitperpixel, int num_axis,
+                          const long *sz_axes, const std::vector<long>& tile, int seed,
+                          const image_source& src, LONGLONG first, LONGLONG len,
+                          fitsfile **mfp, int *status )
+{
+  if( fits_create_file( mfp, "mem://", status ) > 0 )
+  {
+    *mfp = NULL;
+    return *status;
+  }
+
+  compress_spec band_spec = spec;
+  band_spec.tile = tile;
+  band_spec.seed = seed;
+  set_compression( *mfp, band_spec, status );
+  fits_create_img( *mfp, bitperpixel, num_axis, const_cast<long*>( sz_axes ), status );
+
+  // cfitsio may adjust the tiles of some algorithms to the image size
+  std::vector<long> band_tile;
+  if( read_tile_dims( *mfp, num_axis, band_tile, status ) <= 0 && band_tile != tile )
+    *status = DATA_COMPRESSION_ERR;
+
+  write_pixels( *mfp, src, first, len, 1, status );
+
+  return *status;
+}
+
+// append the rows of the compressed image table of a band to fp, from
+// row row0 on.  The variable length data of each row is appended to the
+// heap of fp, so the heap is in row order.
+static int append_band_rows( fitsfile *mfp, fitsfile *fp, LONGLONG row0, int *status )
+{
+  int ncols;
+  LONGLONG nrows;
+  fits_get_num_cols( mfp, &ncols, status );
+  fits_get_num_rowsll( mfp, &nrows, status );
+
+  std::vector<unsigned char> buf;
+  for( int col=1; col<=ncols && *status<=0; col++ )
+  {
+    char keyname[FLEN_KEYWORD], name[FLEN_VALUE], tform[FLEN_VALUE];
+    fits_make_keyn( "TTYPE", col, keyname, status );
+    fits_read_key( mfp, TSTRING, keyname, name, NULL, status );
+    fits_make_keyn( "TFORM", col, keyname, status );
+    fits_read_key( mfp, TSTRING, keyname, tform, NULL, status );
+    if( *status > 0 )
+      break;
+
+    // columns such as GZIP_COMPRESSED_DATA are only added when needed
+    int dcol;
+    if( fits_get_colnum( fp, CASEINSEN, name, &dcol, status ) == COL_NOT_FOUND )
+    {
+      *status = 0;
+      fits_get_num_cols( fp, &dcol, status );
+      dcol++;
+      fits_insert_col( fp, dcol, name, tform, status );
+    }
+
+    int typecode;
+    LONGLONG repeat, width;
+    fits_get_coltypell( mfp, col, &typecode, &repeat, &width, status );
+    int datatype = abs( typecode );
+    if( datatype == TLONG )
+      datatype = TINT;
+    int elsize = ( datatype == TBYTE ? 1 : datatype == TSHORT ? 2 :
+                   datatype == TINT || datatype == TFLOAT ? 4 : 8 );
+
+    for( LONGLONG row=1; row<=nrows && *status<=0; row++ )
+    {
+      LONGLONG n = repeat, offset;
+      if( typecode < 0 )
+        fits_read_descriptll( mfp, col, row, &n, &offset, status );
+      if( n == 0 )
+      {
+        fits_write_descript( fp, dcol, row0+row, 0, 0, status );
+        continue;
+      }
+
+      int anynul = 0;
+      buf.resize( n * elsize );
+      fits_read_col( mfp, datatype, col, row, 1, n, NULL, buf.data(), &anynul, status );
+      fits_write_col( fp, datatype, dcol, row0+row, 1, n, buf.data(), status );
+    }
+  }
+
+  return *status;
+}
+
+// copy the compression keywords (Z...) of the band header that are not
+// yet in the header of fp, such as those written when a tile needs them
+static int copy_missing_zkeys( fitsfile *mfp, fitsfile *fp, int *status )
+{
+  int nkeys;
+  fits_get_hdrspace( mfp, &nkeys, NULL, status );
+  for( int i=1; i<=nkeys && *status<=0; i++ )
+  {
+    char card[FLEN_CARD], name[FLEN_KEYWORD], existing[FLEN_CARD];
+    int len, kstatus = 0;
+    fits_read_record( mfp, i, card, status );
+    fits_get_keyname( card, name, &len, status );
+    if( *status > 0 || name[0] != 'Z' )
+      continue;
+    if( fits_read_card( fp, name, existing, &kstatus ) == KEY_NO_EXIST )
+      fits_write_record( fp, card, status );
+  }
+  return *status;
+}
+
+// Write the image as a tile compressed HDU.  The image is split into
+// bands of whole tiles along its slowest varying axis, each compressed
+// into a memory file on a worker thread; the rows of the bands are then
+// appended to the table in order.  If a band could not be compressed,
+// the image is compressed by cfitsio on this thread.
+static int write_compressed_img( fitsfile *fp, const compress_spec& spec, int bitperpixel,
+                                 int num_axis, long *sz_axes, const image_source& src,
+                                 LONGLONG len, int *status )
+{
+  compress_spec full = spec;
+  if( full.seed == 0 )
+    full.seed = int( time( NULL ) % 10000 ) + 1;
+
+  if( set_compression( fp, full, status ) > 0
+      || fits_create_img( fp, bitperpixel, num_axis, sz_axes, status ) > 0 )
+    return *status;
+
+  int nthreads = fits_num_threads();
+  std::vector<long> tile;
+  if( nthreads < 2 || num_axis < 1 || len == 0 || !fits_is_reentrant()
+      || read_tile_dims( fp, num_axis, tile, status ) > 0 )
+  {
+    *status = 0;
+    return write_pixels( fp, src, 0, len, 1, status );
+  }
+
+  // tiles are numbered with the first axis varying fastest, so the tiles
+  // of a band along the last axis are consecutive rows of the table
+  int axis = num_axis-1;
+  while( axis > 0 && sz_axes[axis] == 1 )
+    axis--;
+  LONGLONG plane = 1, tiles_per_plane = 1;
+  for( int i=0; i<axis; i++ )
+  {
+    plane *= sz_axes[i];
+    tiles_per_plane *= (sz_axes[i] + tile[i] - 1) / tile[i];
+  }
+  LONGLONG ntilerows = (sz_axes[axis] + tile[axis] - 1) / tile[axis];
+  LONGLONG nbands = std::min( ntilerows, LONGLONG(4 * nthreads) );
+  LONGLONG rows_per_band = (ntilerows + nbands - 1) / nbands;
+  nbands = (ntilerows + rows_per_band - 1) / rows_per_band;
+
+  if( nbands < 2 )
+    return write_pixels( fp, src, 0, len, 1, status );
+
+  std::vector<fitsfile *> bands( nbands, (fitsfile *)NULL );
+  std::vector<int> band_status( nbands, 0 );
+
+  fits_parallel_for( nbands, nthreads, [&] (size_t b0, size_t b1)
+  {
+    for( size_t b=b0; b<b1; b++ )
+    {
+      LONGLONG first = b * rows_per_band * tile[axis];
+      LONGLONG last = std::min( LONGLONG(sz_axes[axis]), first + rows_per_band * tile[axis] );
+      std::vector<long> band_axes( sz_axes, sz_axes + num_axis );
+      band_axes[axis] = last - first;
+
+      // keep the dither offsets the tiles have in the full image
+      LONGLONG row0 = b * rows_per_band * tiles_per_plane;
+      int seed = int( (full.seed - 1 + row0) % 10000 ) + 1;
+
+      compress_band( full, bitperpixel, num_axis, band_axes.data(), tile, seed,
+                     src, first * plane, (last - first) * plane, &bands[b],
+                     &band_status[b] );
+    }
+  });
+
+  bool ok = true;
+  for( LONGLONG b=0; b<nbands; b++ )
+    ok = ok && band_status[b] <= 0;
+
+  for( LONGLONG b=0; b<nbands && ok && *status<=0; b++ )
+  {
+    append_band_rows( bands[b], fp, b * rows_per_band * tiles_per_plane, status );
+    copy_missing_zkeys( bands[b], fp, status );
+  }
+
+  for( LONGLONG b=0; b<nbands; b++ )
+  {
+    int cstatus = 0;
+    if( bands[b] )
+      fits_close_file( bands[b], &cstatus );
+  }
+
+  if( !ok )
+    write_pixels( fp, src, 0, len, 1, status );
+
+  return *status;
+}
+
 #if 0
 %!shared testfile
 %! testfile = tempname();
@@ -187,6 +740,90 @@ static bool any_bad_argument( const octave_value_list& args )
 %! assert(size(rd, 2), 3);
 %! assert(data, rd)
 
+%!error <save_fits_image: unknown compression> save_fits_image(testfile, 1, "Compression", "bad")
+
+%!error <property/value pairs> save_fits_image(testfile, 1, 16, "Compression")
+
+%!test
+%! data = reshape(1:(70*1100*2), 70, 1100, 2);
+%! save_fits_image(["!" testfile], data, 32, "Transpose", true);
+%! assert(read_fits_image(testfile), permute(data, [2 1 3]));
+%! assert(read_fits_image(testfile, "transpose"), data);
+%! save_fits_image(["!" testfile], data(:, :, 1), "Compression", "rice", "TileSize", [1100 16], "Transpose", true);
+%! assert(read_fits_image(testfile), transpose(data(:, :, 1)));
+
+%!test
+%! data = reshape(1:(300*200), 300, 200) - 20000;
+%! nandata = data;
+%! nandata(1:7:end) = NaN;
+%! ## cfitsio writes NaN to integer images as the C conversion gives it
+%! for args = {{data, 16}, {nandata, 16}, {nandata, 32}, {nandata, 64}}
+%!   for transpose = {false, true}
+%!     save_fits_image(["!" testfile], args{1}{:}, "Checksum", true, "Transpose", transpose{1});
+%!     fd = fits_openFile(testfile, "READWRITE");
+%!     datasum = fits_readKey(fd, "DATASUM");
+%!     checksum = fits_readKey(fd, "CHECKSUM");
+%!     ## cfitsio keeps the checksum if it is already right
+%!     fits_writeChecksum(fd);
+%!     assert(fits_readKey(fd, "DATASUM"), datasum);
+%!     assert(fits_readKey(fd, "CHECKSUM"), checksum);
+%!     fits_closeFile(fd);
+%!   endfor
+%! endfor
+
+%!error <value of 'Checksum'> save_fits_image(testfile, 1, "Checksum", "yes")
+
+%!test
+%! data = int32(reshape(1:(64*50*2), 64, 50, 2));
+%! oldthreads = getenv("OCTAVE_FITS_THREADS");
+%! unwind_protect
+%!   for threads = {"1", "4"}
+%!     setenv("OCTAVE_FITS_THREADS", threads{1});
+%!     for algo = {"rice", "gzip", "plio"}
+%!       save_fits_image(["!" testfile], data, 32, "Compression", algo{1}, "TileSize", [64 3]);
+%!       assert(read_fits_image(testfile), double(data));
+%!     endfor
+%!   endfor
+%! unwind_protect_cleanup
+%!   setenv("OCTAVE_FITS_THREADS", oldthreads);
+%! end_unwind_protect
+
+%!test
+%! data = reshape(sin(1:(100*40)), 100, 40);
+%! oldthreads = getenv("OCTAVE_FITS_THREADS");
+%! unwind_protect
+%!   setenv("OCTAVE_FITS_THREADS", "1");
+%!   save_fits_image(["!" testfile], data, -32, "Compression", "rice", "QuantizeLevel", 16, "DitherSeed", 7);
+%!   rd1 = read_fits_image(testfile);
+%!   setenv("OCTAVE_FITS_THREADS", "4");
+%!   save_fits_image(["!" testfile], data, -32, "Compression", "rice", "QuantizeLevel", 16, "DitherSeed", 7);
+%!   rd4 = read_fits_image(testfile);
+%! unwind_protect_cleanup
+%!   setenv("OCTAVE_FITS_THREADS", oldthreads);
+%! end_unwind_protect
+%! assert(rd4, rd1);
+%! assert(rd4, data, 0.1);
+
+%!test
+%! gzfile = [tempname() ".fits.gz"];
+%! data = reshape(1:(1024*600), 1024, 600);
+%! oldthreads = getenv("OCTAVE_FITS_THREADS");
+%! unwind_protect
+%!   setenv("OCTAVE_FITS_THREADS", "4");
+%!   save_fits_image(gzfile, data);
+%!   assert(read_fits_image(gzfile), data);
+%!   assert(isempty(setdiff(glob([gzfile ".*"]), [gzfile ".gzidx"])));
+%!   ## the uncompressed file is removed on errors too
+%!   fail("save_fits_image(['!' gzfile], data, 'Compression', 'bad')", "unknown compression");
+%!   assert(isempty(setdiff(glob([gzfile ".*"]), [gzfile ".gzidx"])));
+%! unwind_protect_cleanup
+%!   setenv("OCTAVE_FITS_THREADS", oldthreads);
+%!   delete (gzfile);
+%!   if (exist ([gzfile ".gzidx"], "file"))
+%!     delete ([gzfile ".gzidx"]);
+%!   endif
+%! end_unwind_protect
+
 %! if exist (testfile, 'file')
 %!   delete (testfile);
 %! endif
@@ -28,96 +28,434 @@ extern "C"
 #include "fitsio.h"
 }
 
-static bool any_bad_argument( const octave_value_list& args );
+#ifdef HAVE_PWRITE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <memory>
+#include <vector>
+
+#include "fits_threads.h"
+#include "fits_gzip.h"
+#include "fits_pixels.h"
+#include "fits_checksum.h"
+#include "fits_plain_file.h"
+
+static bool any_bad_argument( const octave_value_list& args, int nargs );
+
+// An extension to write: its pixels, in the type they are held in, the
+// image type to store them as, and where its data unit starts in the
+// file once all the headers are written.
+struct extension
+{
+  std::shared_ptr<void> array;   // keeps the array data points into
+  const void *data;
+  size_t elem_bytes;
+  int datatype;                  // cfitsio type of data
+  int bitpix;
+  std::vector<LONGLONG> naxes;
+  LONGLONG npix;
+  string_vector header;
+  LONGLONG offset;
+};
+
+// pixels converted and written by a worker at a time
+static const LONGLONG fill_block_pixels = 1 << 18;
+
+// keep a reference to the array a, which shares its data with the value
+// it came from, and return its data
+template <typename AT>
+static const void *keep_array( const AT& a, extension& ext )
+{
+  std::shared_ptr<AT> p = std::make_shared<AT>( a );
+  ext.array = p;
+  ext.elem_bytes = sizeof( typename AT::element_type );
+  return p->data();
+}
+
+// Point ext at the values of v in their own type, and set its bitpix to
+// the image type that holds them exactly.  Logical values are stored as
+// bytes.  False if v is not a real numeric or logical array.
+static bool native_data( const octave_value& v, extension& ext )
+{
+#define NATIVE(VALUE, DATATYPE, BITPIX) \
+  { ext.data = keep_array( v.VALUE(), ext ); ext.datatype = DATATYPE; ext.bitpix = BITPIX; }
+
+  if( ( !v.isnumeric() && !v.islogical() ) || v.iscomplex() )
+    return false;
+
+  if( v.islogical() || v.is_uint8_type() )
+    NATIVE( uint8_array_value, TBYTE, BYTE_IMG )
+  else if( v.is_int8_type() )
+    NATIVE( int8_array_value, TSBYTE, SBYTE_IMG )
+  else if( v.is_int16_type() )
+    NATIVE( int16_array_value, TSHORT, SHORT_IMG )
+  else if( v.is_uint16_type() )
+    NATIVE( uint16_array_value, TUSHORT, USHORT_IMG )
+  else if( v.is_int32_type() )
+    NATIVE( int32_array_value, TINT, LONG_IMG )
+  else if( v.is_uint32_type() )
+    NATIVE( uint32_array_value, TUINT, ULONG_IMG )
+  else if( v.is_int64_type() )
+    NATIVE( int64_array_value, TLONGLONG, LONGLONG_IMG )
+  else if( v.is_uint64_type() )
+    NATIVE( uint64_array_value, TULONGLONG, ULONGLONG_IMG )
+  else if( v.is_single_type() )
+    NATIVE( float_array_value, TFLOAT, FLOAT_IMG )
+  else
+    NATIVE( array_value, TDOUBLE, DOUBLE_IMG )
+
+#undef NATIVE
+
+  return true;
+}
+
+// the BITPIX of an argument, as a name or a number
+static bool get_bitpix( const octave_value& arg, int& bitperpixel )
+{
+  static const char *names[] = { "BYTE_IMG", "SBYTE_IMG", "SHORT_IMG",
+                                 "USHORT_IMG", "LONG_IMG", "ULONG_IMG",
+                                 "LONGLONG_IMG", "ULONGLONG_IMG",
+                                 "FLOAT_IMG", "DOUBLE_IMG" };
+  static const int values[] = { BYTE_IMG, SBYTE_IMG, SHORT_IMG, USHORT_IMG,
+                                LONG_IMG, ULONG_IMG, LONGLONG_IMG,
+                                ULONGLONG_IMG, FLOAT_IMG, DOUBLE_IMG };
+
+  if( arg.is_string() )
+  {
+    for( int i=0; i<10; i++ )
+      if( arg.string_value() == names[i] )
+      {
+        bitperpixel = values[i];
+        return true;
+      }
+    error ("Invalid string value for 'bit_per_pixel': %s", arg.string_value().c_str() );
+    return false;
+  }
+  else if( arg.is_scalar_type() )
+  {
+    double val = arg.double_value();
+    if( (OCTAVE__D_NINT( val ) ==  val) )
+    {
+      for( int i=0; i<10; i++ )
+        if( values[i] == val )
+        {
+          bitperpixel = values[i];
+          return true;
+        }
+      error ("Invalid numeric value for 'bit_per_pixel': %f", val );
+      return false;
+    }
+    return true;
+  }
+
+  error ("Third parameter must be a valid string or a valid scalar value.\nSee 'help save_fits_image' for valid values." );
+  return false;
+}
+
+// true for the keywords that cfitsio writes for the image itself, or
+// that would change the meaning of the values written
+static bool is_image_keyword( const std::string& card )
+{
+  static const char *keys[] = { "SIMPLE", "BITPIX", "NAXIS", "EXTEND",
+                                "XTENSION", "PCOUNT", "GCOUNT", "BSCALE",
+                                "BZERO", "CHECKSUM", "DATASUM", "END" };
+
+  std::string key = card.substr( 0, 8 );
+  key.erase( key.find_last_not_of( " \n" ) + 1 );
+
+  if( key.empty() || key.compare( 0, 5, "NAXIS" ) == 0 )
+    return true;
+
+  for( size_t i=0; i<sizeof( keys ) / sizeof( keys[0] ); i++ )
+    if( key == keys[i] )
+      return true;
+
+  return false;
+}
+
+// Set path to the file name to fill the data units of, if name is a plain
+// file that can be written with pwrite, rather than e.g. a compressed or
+// in memory file, or one of another cfitsio driver.
+static bool planned_path( const std::string& name, std::string& path )
+{
+#ifdef HAVE_PWRITE
+  return fits_plain_output( name, path );
+#else
+  return false;
+#endif
+}
+
+// convert n pixels of ext from pixel first to its image type, at out.
+// False if a value overflows the type, which cfitsio fails on.
+static bool encode_block( const extension& ext, LONGLONG first, LONGLONG n,
+                          unsigned char *out )
+{
+#define ENCODE(T) \
+  return fits_encode_pixels( static_cast<const T *>( ext.data ) + first, n, ext.bitpix, out )
+
+  switch( ext.datatype )
+  {
+    case TBYTE:      ENCODE( uint8_t );
+    case TSBYTE:     ENCODE( int8_t );
+    case TSHORT:     ENCODE( int16_t );
+    case TUSHORT:    ENCODE( uint16_t );
+    case TINT:       ENCODE( int32_t );
+    case TUINT:      ENCODE( uint32_t );
+    case TLONGLONG:  ENCODE( int64_t );
+    case TULONGLONG: ENCODE( uint64_t );
+    case TFLOAT:     ENCODE( float );
+    default:         ENCODE( double );
+  }
+
+#undef ENCODE
+}
+
+// write the pixels of ext to the current HDU of fp through cfitsio.  If
+// sum is given, they are written a block at a time, each added to sum as
+// cfitsio wrote it, read back just after it is written.
+static int write_image( fitsfile *fp, const extension& ext, fits_checksum *sum, int *status )
+{
+  const LONGLONG block = sum ? fill_block_pixels / 16 : ext.npix;
+  const char *data = static_cast<const char*>( ext.data );
+
+  for( LONGLONG p=0; p<ext.npix && *status<=0; p+=block )
+  {
+    LONGLONG n = std::min( block, ext.npix - p );
+    if( fits_write_img( fp, ext.datatype, p+1, n, const_cast<char*>( data + p*ext.elem_bytes ),
+                        status ) <= 0 && sum )
+      fits_checksum_written( fp, *sum, p, n, status );
+  }
+
+  return *status;
+}
+
+// Convert and write the pixels of the data units of the file at path on
+// worker threads, each writing its own blocks with pwrite.  The headers
+// cfitsio wrote are left as they are.  If sums is given, each block is
+// also summed while it is in the buffer, and the sum of each data unit
+// is returned in it.  A value out of range of its image type fails with
+// the NUM_OVERFLOW cfitsio would have given.
+static bool fill_data_units( const std::string& path,
+                             const std::vector<extension>& exts, int *status,
+                             std::vector<fits_checksum> *sums = NULL )
+{
+#ifdef HAVE_PWRITE
+  int fd = open( path.c_str(), O_WRONLY );
+  if( fd < 0 )
+    return false;
+
+  // blocks of each data unit: extension index and first pixel
+  std::vector< std::pair<size_t, LONGLONG> > blocks;
+  for( size_t u=0; u<exts.size(); u++ )
+    for( LONGLONG p=0; p<exts[u].npix; p+=fill_block_pixels )
+      blocks.push_back( std::make_pair( u, p ) );
+
+  std::vector<char> failed( blocks.size(), 0 ), overflow( blocks.size(), 0 );
+  std::vector<fits_checksum> block_sums( sums ? blocks.size() : 0 );
+
+  fits_parallel_for( blocks.size(), fits_num_threads(),
+    [&]( size_t b, size_t e )
+    {
+      std::vector<unsigned char> buf( fill_block_pixels * sizeof( double ) );
+      for( size_t i=b; i<e; i++ )
+      {
+        const extension& ext = exts[blocks[i].first];
+        const size_t bytepix = fits_pixel_bytes( ext.bitpix );
+        LONGLONG first = blocks[i].second;
+        LONGLONG n = std::min( fill_block_pixels, ext.npix - first );
+        size_t len = n * bytepix;
+        off_t at = ext.offset + first * bytepix;
+
+        if( !encode_block( ext, first, n, buf.data() ) )
+        {
+          overflow[i] = 1;
+          continue;
+        }
+        if( sums )
+          block_sums[i].add( buf.data(), len, first * bytepix );
+        for( size_t done=0; done<len; )
+        {
+          ssize_t w = pwrite( fd, buf.data() + done, len - done, at + done );
+          if( w <= 0 )
+          {
+            failed[i] = 1;
+            break;
+          }
+          done += w;
+        }
+      }
+    } );
+
+  bool ok = ( close( fd ) == 0 );
+  for( size_t i=0; i<failed.size(); i++ )
+  {
+    ok = ok && !failed[i] && !overflow[i];
+    if( overflow[i] )
+      *status = NUM_OVERFLOW;
+  }
+
+  if( sums )
+  {
+    sums->assign( exts.size(), fits_checksum() );
+    for( size_t i=0; i<blocks.size(); i++ )
+      (*sums)[blocks[i].first].add( block_sums[i] );
+  }
+
+  return ok;
+#else
+  return false;
+#endif
+}
 
 DEFUN_DLD( save_fits_image_multi_ext, args, nargout,
 "-*- texinfo -*-\n\
      @deftypefn {Function File}  save_fits_image_multi_ext(@var{filename}, @var{image}, @var{bit_per_pixel})\n\
+     @deftypefnx {Function File}  save_fits_image_multi_ext(@var{filename}, @var{images}, @var{bit_per_pixel}, @var{headers})\n\
      Write @var{IMAGE} to FITS file @var{filename}.\n\n\
      Datacubes will be saved as multi-image extensions.\n\n\
-     The optional parameter @var{bit_per_pixel} specifies the data type of the pixel values. Accepted string values are BYTE_IMG, SHORT_IMG, LONG_IMG, LONGLONG_IMG, FLOAT_IMG, and DOUBLE_IMG (default). Alternatively, corresponding numbers may be passed, i.e. 8, 16, 32, 64, -32, and -64.\n\n\
+     The optional parameter @var{bit_per_pixel} specifies the data type of the pixel values. Accepted string values are BYTE_IMG, SHORT_IMG, LONG_IMG, LONGLONG_IMG, FLOAT_IMG, and DOUBLE_IMG (default), and SBYTE_IMG, USHORT_IMG, ULONG_IMG and ULONGLONG_IMG, which are stored with BZERO. Alternatively, corresponding numbers may be passed, i.e. 8, 16, 32, 64, -32, and -64 (10, 20, 40 and 80).\n\n\
+     If @var{images} is a cell array, each of its arrays is written as an extension of its own, of any size and number of dimensions. The pixels are written from the type of the array, without converting a copy to double, and by default as the image type that holds that type exactly (e.g. SHORT_IMG for int16, USHORT_IMG for uint16, BYTE_IMG for logical). @var{bit_per_pixel} may then also be a cell array giving the type of each extension, with [] for the default.\n\n\
+     @var{headers} is a cell array with the header of each extension, a cellstr or char matrix of header cards as returned by read_fits_image, or [] for none. Cards that describe the image itself (SIMPLE, BITPIX, NAXISn, EXTEND, BSCALE, BZERO, ...) are skipped, as they are written for the image.\n\n\
      Use a preceding exclamation mark (!) in the filename to overwrite an existing file.\n\n\
-     Lossless file compression can be used by adding the suffix '.gz' to the filename.\n\n\
+     Lossless file compression can be used by adding the suffix '.gz' to the filename; the file is compressed on several threads.\n\n\
+     The headers of all extensions are written first; the pixels of a plain file are then converted and written on several threads, as many as the environment variable OCTAVE_FITS_THREADS sets.\n\n\
+     A trailing property/value pair 'Checksum', true writes the CHECKSUM and DATASUM keywords of each extension. The pixels are summed as they are converted for writing, or, where cfitsio converts them, as cfitsio wrote them just after each block is written, so the file is not read back to sum them.\n\n\
      @seealso{save_fits_image, read_fits_image}\n\
      @end deftypefn")
 {
   bool verbose = false;
 
-  if ( any_bad_argument(args) )
+  // a trailing 'Checksum', value pair
+  int nargs = args.length();
+  bool checksum = false;
+  if( nargs >= 4 && args(nargs-2).is_string() )
+  {
+    std::string prop = args(nargs-2).string_value();
+    std::transform( prop.begin(), prop.end(), prop.begin(), ::tolower );
+    if( prop == "checksum" )
+    {
+      const octave_value val = args(nargs-1);
+      if( ( !val.isnumeric() && !val.islogical() ) || !val.is_scalar_type() )
+      {
+        error( "save_fits_image_multi_ext: value of 'Checksum' must be true or false" );
+        return octave_value_list();
+      }
+      checksum = val.bool_value();
+      nargs -= 2;
+    }
+  }
+
+  if ( any_bad_argument(args, nargs) )
     return octave_value_list();
 
   octave_value fitsimage;
   std::string outfile = args(0).string_value ();
 
-  int num_axis = 2;
-  const NDArray image = args(1).array_value();
-  long int sz_axes[2]; 
-  sz_axes[0] = image.dim1();
-  sz_axes[1] = image.dim2();
-
-  int num_images;
-  if (image.ndims() < 3)
-    num_images = 1;
+  std::vector<extension> exts;
+  if( args(1).iscell() )
+  {
+    // one extension per array, each in its own type and shape
+    const Cell images = args(1).cell_value();
+    for( octave_idx_type i=0; i<images.numel(); i++ )
+    {
+      extension ext;
+      if( !native_data( images(i), ext ) )
+      {
+        error ("save_fits_image_multi_ext: extension %d must be a real numeric or logical array", int(i+1) );
+        return octave_value_list();
+      }
+      const dim_vector dims = images(i).dims();
+      for( int k=0; k<dims.length(); k++ )
+        ext.naxes.push_back( dims(k) );
+      ext.npix = dims.numel();
+      exts.push_back( ext );
+    }
+  }
   else
-    num_images = image.dim3();
+  {
+    // the planes of the array, written as DOUBLE_IMG unless told otherwise
+    extension whole;
+    if( !native_data( args(1), whole ) )
+    {
+      error ("save_fits_image_multi_ext: image must be a real numeric or logical array" );
+      return octave_value_list();
+    }
+    whole.bitpix = DOUBLE_IMG;
+
+    const dim_vector dims = args(1).dims();
+    LONGLONG npix = LONGLONG( dims(0) ) * dims(1);
+    LONGLONG num_images = ( npix > 0 ) ? dims.numel() / npix : 1;
+
+    for( LONGLONG i=0; i<num_images; i++ )
+    {
+      extension ext = whole;
+      ext.data = static_cast<const char *>( whole.data ) + i * npix * whole.elem_bytes;
+      ext.naxes.push_back( dims(0) );
+      ext.naxes.push_back( dims(1) );
+      ext.npix = npix;
+      exts.push_back( ext );
+    }
+  }
 
   if(verbose)
-    std::cerr << "num_images " <<  num_images << std::endl;
-
-  int bitperpixel = DOUBLE_IMG;
-  if( 3 == args.length() )
-  {
-    if( args(2).is_string() )
-    {
-      if( args(2).string_value() == "BYTE_IMG" )
-        bitperpixel = BYTE_IMG;
-      else if( args(2).string_value() == "SHORT_IMG" )
-        bitperpixel = SHORT_IMG;
-      else if( args(2).string_value() == "LONG_IMG" )
-        bitperpixel = LONG_IMG;
-      else if( args(2).string_value() == "LONGLONG_IMG" )
-        bitperpixel = LONGLONG_IMG;
-      else if( args(2).string_value() == "FLOAT_IMG" )
-        bitperpixel = FLOAT_IMG;
-      else if( args(2).string_value() == "DOUBLE_IMG" )
-        bitperpixel = DOUBLE_IMG;
-      else
+    std::cerr << "num_images " <<  exts.size() << std::endl;
+
+  if( nargs > 2 )
+  {
+    if( args(2).iscell() )
+    {
+      const Cell types = args(2).cell_value();
+      if( size_t( types.numel() ) != exts.size() )
       {
-        error ("Invalid string value for 'bit_per_pixel': %s", args(2).string_value().c_str() );
+        error ("save_fits_image_multi_ext: bit_per_pixel must be a cell with one type per extension" );
         return octave_value_list();
       }
+      for( size_t i=0; i<exts.size(); i++ )
+        if( !types(i).isempty() && !get_bitpix( types(i), exts[i].bitpix ) )
+          return octave_value_list();
     }
-    else if( args(2).is_scalar_type() )
+    else if( !args(2).isempty() )
     {
-      double val = args(2).double_value();
-      if( (OCTAVE__D_NINT( val ) ==  val) )
-      {
-        if( BYTE_IMG == val )
-          bitperpixel = BYTE_IMG;
-        else if( SHORT_IMG == val )
-          bitperpixel = SHORT_IMG;
-        else if( LONG_IMG == val )
-          bitperpixel = LONG_IMG;
-        else if( LONGLONG_IMG == val )
-          bitperpixel = LONGLONG_IMG;
-        else if( FLOAT_IMG == val )
-          bitperpixel = FLOAT_IMG;
-        else if( DOUBLE_IMG == val )
-          bitperpixel = DOUBLE_IMG;
-        else
-        {
-          error ("Invalid numeric value for 'bit_per_pixel': %f", val );
-          return octave_value_list();
-        }
-      }
+      int bitperpixel = exts.empty() ? DOUBLE_IMG : exts[0].bitpix;
+      if( !get_bitpix( args(2), bitperpixel ) )
+        return octave_value_list();
+      for( size_t i=0; i<exts.size(); i++ )
+        exts[i].bitpix = bitperpixel;
     }
-    else
+  }
+
+  if( nargs > 3 )
+  {
+    const Cell headers = args(3).iscell() ? args(3).cell_value() : Cell();
+    if( !args(3).iscell() || size_t( headers.numel() ) != exts.size() )
     {
-      error ("Third parameter must be a valid string or a valid scalar value.\nSee 'help save_fits_image' for valid values." );
+      error ("save_fits_image_multi_ext: headers must be a cell with one header per extension" );
       return octave_value_list();
     }
+    for( size_t i=0; i<exts.size(); i++ )
+    {
+      if( headers(i).iscellstr() )
+        exts[i].header = string_vector( headers(i).cellstr_value() );
+      else if( headers(i).is_string() )
+        exts[i].header = headers(i).string_vector_value();
+      else if( !headers(i).isempty() )
+      {
+        error ("save_fits_image_multi_ext: header %d must be a cellstr or char matrix", int(i+1) );
+        return octave_value_list();
+      }
+    }
   }
 
+#ifdef HAVE_ZLIB_H
+  // '.gz' files are written uncompressed, then compressed on several threads
+  fits_gzip_temp gztemp;
+  outfile = gztemp.target( outfile );
+#endif
+
   int status=0; // must be initialized with zero (I consider this to be a bug in libcfitsio).
                 // status seems not to be set to zero after successful API calls
 
@@ -130,12 +468,17 @@ DEFUN_DLD( save_fits_image_multi_ext, args, nargout,
       return fitsimage = -1;
   }
 
-  long fpixel = 1;
-  for( int i=0; i<num_images; i++ )
+  // For a plain file, cfitsio writes only the headers, which fixes where
+  // each data unit starts; the pixels are then written in parallel.
+  std::string path;
+  bool planned = planned_path( outfile, path );
+
+  for( size_t i=0; i<exts.size(); i++ )
   {
+    extension& ext = exts[i];
     if(verbose)
       std::cerr << "image: " << i << std::endl;
-    if( fits_create_img( fp, bitperpixel, num_axis, sz_axes, &status ) > 0 )
+    if( fits_create_imgll( fp, ext.bitpix, ext.naxes.size(), ext.naxes.data(), &status ) > 0 )
     {
       fits_report_error( stderr, status );
       error ("Could not create HDU." );
@@ -150,13 +493,51 @@ DEFUN_DLD( save_fits_image_multi_ext, args, nargout,
       error ("Could not write XTENSION to HDU." );
       return octave_value_list();
     }
-    double * datap = const_cast<double*>( image.fortran_vec() );
-    if( fits_write_img( fp, TDOUBLE, fpixel, sz_axes[0]*sz_axes[1], datap + i*sz_axes[0]*sz_axes[1], &status ) > 0 )
+    for( octave_idx_type k=0; k<ext.header.numel(); k++ )
+    {
+      std::string card = ext.header[k];
+      if( !is_image_keyword( card ) && fits_write_record( fp, card.c_str(), &status ) > 0 )
+      {
+        fits_report_error( stderr, status );
+        error ("Could not write header card %s.", card.c_str() );
+        return octave_value_list();
+      }
+    }
+    if( checksum && fits_reserve_checksum( fp, &status ) > 0 )
+    {
+      fits_report_error( stderr, status );
+      error ("Could not write CHECKSUM to HDU." );
+      return octave_value_list();
+    }
+    fits_checksum sum;
+    if( !planned && ext.npix > 0
+        && write_image( fp, ext, checksum ? &sum : NULL, &status ) > 0 )
+    {
+      fits_report_error( stderr, status );
+      error ("Could not write image data." );
+      return octave_value_list();
+    }
+    if( !planned && checksum && fits_write_datasum( fp, sum.value(), &status ) > 0 )
+    {
+      fits_report_error( stderr, status );
+      error ("Could not write checksum." );
+      return octave_value_list();
+    }
+  }
+
+  for( size_t i=0; planned && i<exts.size(); i++ )
+  {
+    LONGLONG headstart, datastart, dataend;
+    if( fits_movabs_hdu( fp, i+1, NULL, &status ) > 0
+        || fits_get_hduaddrll( fp, &headstart, &datastart, &dataend, &status ) > 0 )
     {
       fits_report_error( stderr, status );
+      status = 0;
+      fits_close_file( fp, &status );
       error ("Could not write image data." );
       return octave_value_list();
     }
+    exts[i].offset = datastart;
   }
 
   // Close FITS file
@@ -167,13 +548,52 @@ DEFUN_DLD( save_fits_image_multi_ext, args, nargout,
       error("Could not close file %s.", outfile.c_str() );
   }
 
+  std::vector<fits_checksum> sums;
+  status = 0;
+  if( planned && !fill_data_units( path, exts, &status, checksum ? &sums : NULL ) )
+  {
+    if( status > 0 )
+      fits_report_error( stderr, status );
+    error ("Could not write image data." );
+    return octave_value_list();
+  }
+
+  // the data units summed as they were filled, the headers are reopened
+  // to add them to
+  if( planned && checksum )
+  {
+    status = 0;
+    fits_open_file( &fp, path.c_str(), READWRITE, &status );
+    for( size_t i=0; i<exts.size() && status<=0; i++ )
+      if( fits_movabs_hdu( fp, i+1, NULL, &status ) <= 0 )
+        fits_write_datasum( fp, sums[i].value(), &status );
+    if( status > 0 )
+    {
+      fits_report_error( stderr, status );
+      status = 0;
+      fits_close_file( fp, &status );
+      error ("Could not write checksum." );
+      return octave_value_list();
+    }
+    fits_close_file( fp, &status );
+  }
+
+#ifdef HAVE_ZLIB_H
+  if( !gztemp.gzfile().empty() )
+  {
+    bool ok = gztemp.compress( fits_num_threads() );
+    if( !ok )
+      error( "Could not compress file %s.", gztemp.gzfile().c_str() );
+  }
+#endif
+
   return octave_value_list();
 }
-static bool any_bad_argument( const octave_value_list& args )
+static bool any_bad_argument( const octave_value_list& args, int nargs )
 {
-  if ( args.length() < 2 || args.length() > 3 )
+  if ( nargs < 2 || nargs > 4 )
   {
-    error( "save_fits_image_multi_ext: number of arguments - expecting save_fits_image_multi_ext( filename, image ) or save_fits_image_multi_ext( filename, image, bitsperpixel )" );
+    error( "save_fits_image_multi_ext: number of arguments - expecting save_fits_image_multi_ext( filename, image ), save_fits_image_multi_ext( filename, image, bitsperpixel ) or save_fits_image_multi_ext( filename, images, bitsperpixel, headers )" );
     return true;
   }
 
@@ -246,4 +666,133 @@ static bool any_bad_argument( const octave_value_list& args )
 %! if exist (testfile, 'file')
 %!   delete (testfile);
 %! endif
+
+%!test
+%! testfile = tempname();
+%! data = reshape(mod(0:(700*600*3-1), 251) - 100.5, 700, 600, 3);
+%! for bp = [8, 16, 32, 64, -32, -64]
+%!   in = data;
+%!   if (bp == 8)
+%!     in = abs(data);
+%!   endif
+%!   save_fits_image_multi_ext(testfile, in, bp);
+%!   switch (bp)
+%!     case {8, 16, 32, 64}
+%!       expect = fix(in);
+%!     case -32
+%!       expect = double(single(in));
+%!     otherwise
+%!       expect = in;
+%!   endswitch
+%!   for i = 1:3
+%!     rd = read_fits_image(testfile, i-1);
+%!     assert(rd, expect(:,:,i))
+%!   endfor
+%!   delete (testfile);
+%! endfor
+
+%!test
+%! ## values out of range, and NaN, are handled as cfitsio handles them,
+%! ## whether the file is filled with pwrite or written by cfitsio
+%! file1 = tempname();
+%! file2 = tempname();
+%! data = reshape(mod(0:(700*600*2-1), 200), 700, 600, 2);
+%! over = data;
+%! over(1, 1, 2) = 1e10;
+%! nans = data;
+%! nans(1:9:end) = NaN;
+%! unwind_protect
+%!   for bp = [8, 16, 32, 64]
+%!     fail("save_fits_image_multi_ext(file1, over, bp)", "Could not write image data");
+%!     fail("save_fits_image_multi_ext(['file://' file2], over, bp)", "Could not write image data");
+%!     delete (file1);
+%!     delete (file2);
+%!     save_fits_image_multi_ext(file1, nans, bp);
+%!     save_fits_image_multi_ext(["file://" file2], nans, bp);
+%!     for i = 0:1
+%!       assert(read_fits_image(file1, i), read_fits_image(file2, i));
+%!     endfor
+%!     delete (file1);
+%!     delete (file2);
+%!   endfor
+%!   save_fits_image_multi_ext(file1, {uint16([0 65535]), [-0.49 65535.49]}, {[], 20});
+%!   assert(read_fits_image(file1, 1), [0 65535]);
+%!   fail("save_fits_image_multi_ext(file2, [-0.5 1], 20)", "Could not write image data");
+%! unwind_protect_cleanup
+%!   if (exist(file1, "file"))
+%!     delete (file1);
+%!   endif
+%!   if (exist(file2, "file"))
+%!     delete (file2);
+%!   endif
+%! end_unwind_protect
+
+%!test
+%! gzfile = [tempname() ".fits.gz"];
+%! data = reshape(1:(300*200*2), 300, 200, 2);
+%! unwind_protect
+%!   save_fits_image_multi_ext(gzfile, data, 32);
+%!   assert(isempty(glob([gzfile ".*"])));
+%!   ## the uncompressed file is removed on errors too
+%!   data(1) = 1e10;
+%!   fail("save_fits_image_multi_ext(['!' gzfile], data, 16)", "Could not write image data");
+%!   assert(isempty(glob([gzfile ".*"])));
+%!   assert(read_fits_image(gzfile, 1), data(:,:,2));
+%! unwind_protect_cleanup
+%!   delete (gzfile);
+%!   if (exist ([gzfile ".gzidx"], "file"))
+%!     delete ([gzfile ".gzidx"]);
+%!   endif
+%! end_unwind_protect
+
+%!error <extension 2 must be a real numeric> save_fits_image_multi_ext(tempname(), {1, "abc"})
+
+%!error <one type per extension> save_fits_image_multi_ext(tempname(), {1, 2}, {8})
+
+%!error <one header per extension> save_fits_image_multi_ext(tempname(), {1, 2}, [], {{}})
+
+%!test
+%! testfile = tempname();
+%! im1 = int16(reshape(-30:29, 3, 4, 5));
+%! im2 = uint16([0, 1, 65535; 32768, 2, 3]);
+%! im3 = single([1.5, -2.25]);
+%! im4 = [true, false, true];
+%! hdr = {"OBJECT  = 'M31     '           / target", "BITPIX  =                  -64"};
+%! save_fits_image_multi_ext(testfile, {im1, im2, im3, im4}, {[], [], -64, []}, {hdr, [], [], {}});
+%! [rd, header] = read_fits_image(testfile, 0);
+%! assert(rd, double(im1))
+%! assert(any(strncmp(cellstr(header), "OBJECT  = 'M31", 14)))
+%! assert(any(strncmp(cellstr(header), "BITPIX  =                   16", 30)))
+%! assert(read_fits_image(testfile, 1), double(im2))
+%! assert(read_fits_image(testfile, 2), double(im3))
+%! assert(read_fits_image(testfile, 3), double(im4))
+%! delete (testfile);
+
+%!test
+%! testfile = tempname();
+%! data = uint8(reshape(mod(0:(64*32*2*3-1), 256), 64, 32, 2, 3));
+%! save_fits_image_multi_ext(testfile, data);
+%! for i = 1:6
+%!   assert(read_fits_image(testfile, i-1), double(data(:,:,i)))
+%! endfor
+%! delete (testfile);
+
+%!test
+%! testfile = tempname();
+%! images = {reshape(-2e5:2e5, 401, 1000)/7, uint16(0:1000), int8([-5 3 7]), [1 NaN 3 NaN]};
+%! save_fits_image_multi_ext(testfile, images, {-32, [], [], 32}, {[], [], [], []}, "Checksum", true);
+%! fd = fits_openFile(testfile, "READWRITE");
+%! for i = 1:4
+%!   fits_movAbsHDU(fd, i);
+%!   datasum = fits_readKey(fd, "DATASUM");
+%!   checksum = fits_readKey(fd, "CHECKSUM");
+%!   ## cfitsio keeps the checksum if it is already right
+%!   fits_writeChecksum(fd);
+%!   assert(fits_readKey(fd, "DATASUM"), datasum);
+%!   assert(fits_readKey(fd, "CHECKSUM"), checksum);
+%! endfor
+%! fits_closeFile(fd);
+%! delete (testfile);
+
+%!error <value of 'Checksum'> save_fits_image_multi_ext(tempname(), 1, 8, "Checksum", "yes")
 #endif